@@ -110,7 +110,8 @@ channel_tracker_v3::channel_tracker_v3() :
         Globalreg::fetch_mandatory_global_as<entry_tracker>();
 
 
-    packetchain->register_handler(&packet_chain_handler, this, CHAINPOS_LOGGING, 0);
+    packetchain->register_batch_handler(&packet_chain_handler, this, CHAINPOS_LOGGING, 0,
+            "channel tracker");
 
     pack_comp_device = packetchain->register_packet_component("DEVICE");
 
@@ -213,20 +214,25 @@ void channel_tracker_v3::update_device_counts(std::unordered_map<double, unsigne
     }
 }
 
-int channel_tracker_v3::packet_chain_handler(CHAINCALL_PARMS) {
+int channel_tracker_v3::packet_chain_handler(CHAINCALL_BATCH_PARMS) {
     channel_tracker_v3 *cv3 = (channel_tracker_v3 *) auxdata;
 
     kis_lock_guard<kis_mutex> lk(cv3->lock, __func__);
 
-    // auto l1info = in_pack->fetch<kis_layer1_packinfo>(cv3->pack_comp_l1data);
+    for (size_t p = 0; p < n_packs; p++)
+        cv3->handle_packet_nr(in_packs[p]);
 
+    return 1;
+}
+
+void channel_tracker_v3::handle_packet_nr(const std::shared_ptr<kis_packet>& in_pack) {
     // Nothing to do with no l1info
     if (!in_pack->signal_info.data_ok)
-        return 1;
+        return;
 
     // Find or make a frequency record if we know our frequency
     if (in_pack->signal_info.freq_khz != 0) {
-        auto const& imi_idx = cv3->frequency_map.try_emplace(in_pack->signal_info.freq_khz, channel_tracker_v3_channel{});
+        auto const& imi_idx = frequency_map.try_emplace(in_pack->signal_info.freq_khz, channel_tracker_v3_channel{});
         auto& freq = imi_idx.first->second;
 
         if (imi_idx.second) {
@@ -245,7 +251,7 @@ int channel_tracker_v3::packet_chain_handler(CHAINCALL_PARMS) {
     if (in_pack->common_info.common_info_ok) {
         if (!(in_pack->common_info.channel == "0" || in_pack->common_info.channel == "")) {
             auto const& smi_idx =
-                cv3->channel_map.try_emplace(in_pack->common_info.channel, channel_tracker_v3_channel{});
+                channel_map.try_emplace(in_pack->common_info.channel, channel_tracker_v3_channel{});
             auto& chan = smi_idx.first->second;
 
             if (smi_idx.second) {
@@ -258,8 +264,6 @@ int channel_tracker_v3::packet_chain_handler(CHAINCALL_PARMS) {
             chan.data_rrd.add_sample(in_pack->common_info.datasize, Globalreg::globalreg->last_tv_sec);
         }
     }
-
-    return 1;
 }
 
 void channel_tracker_v3::as_json(std::ostream& os, json_adapter_v2::opts *opts) {
@@ -109,8 +109,10 @@ protected:
     std::shared_ptr<time_tracker> timetracker;
     std::shared_ptr<entry_tracker> entrytracker;
 
-    // packetchain callback
-    static int packet_chain_handler(CHAINCALL_PARMS);
+    // packetchain callback; packets are handled in batches so the channel lock is only
+    // taken once per batch
+    static int packet_chain_handler(CHAINCALL_BATCH_PARMS);
+    void handle_packet_nr(const std::shared_ptr<kis_packet>& in_pack);
 
     // Seen channels as string-named channels, aggregated across all the phys
     using channel_map_iter_t = std::unordered_map<std::string, channel_tracker_v3_channel>::iterator;
@@ -24,6 +24,7 @@
 #include <time.h>
 #include <list>
 #include <map>
+#include <thread>
 #include <vector>
 
 #include "kismet_algorithm.h"
@@ -56,6 +57,11 @@
 #include "util.h"
 #include "zstr.hpp"
 
+// Device shards held by this thread; the recursion depth of each shard, and a mask
+// of held shards used to preserve lock ordering
+static thread_local std::array<unsigned int, DEVICE_LOCK_SHARDS> device_shard_depth{};
+static thread_local uint64_t device_shard_held = 0;
+
 device_tracker::device_tracker() :
     lifetime_global(),
     kis_database("devicetracker"),
@@ -64,7 +70,16 @@ device_tracker::device_tracker() :
     Globalreg::enable_pool_type<kis_historic_location>([](auto *a) { a->reset(); });
 
     phy_mutex.set_name("device_tracker::phy_mutex");
-    devicelist_mutex.set_name("devicetracker::devicelist");
+    devicelist_index_mutex.set_name("devicetracker::devicelist_index");
+    view_mutex.set_name("devicetracker::view_mutex");
+    macdevice_alert_mutex.set_name("devicetracker::macdevice_alert");
+    activity_mutex.set_name("devicetracker::activity");
+    databaselog_dirty_mutex.set_name("devicetracker::databaselog_dirty");
+    databaselog_write_mutex.set_name("devicetracker::databaselog_write");
+
+    activity_head = nullptr;
+    activity_tail = nullptr;
+    activity_idle_cursor = nullptr;
 
     next_phy_id = 0;
 
@@ -159,7 +174,7 @@ device_tracker::device_tracker() :
         packetchain->register_handler([](void *auxdata, const std::shared_ptr<kis_packet>& in_packet) -> int {
 				auto devicetracker = reinterpret_cast<device_tracker *>(auxdata);
                 return devicetracker->common_tracker(in_packet);
-            }, this, CHAINPOS_TRACKER, -100);
+            }, this, CHAINPOS_TRACKER, -100, "devicetracker common tracker");
 
 
     // Post any events related to the device generated during tracking mode
@@ -173,7 +188,7 @@ device_tracker::device_tracker() :
 				for (const auto& e : in_packet->process_complete_events)
 					devicetracker->eventbus->publish(e);
 				return 1;
-        }, this, CHAINPOS_TRACKER, 0x7FFFFFFF);
+        }, this, CHAINPOS_TRACKER, 0x7FFFFFFF, "devicetracker completion events");
 
     if (!Globalreg::globalreg->kismet_config->fetch_opt_bool("track_device_rrds", true)) {
         _MSG("Not tracking historical packet data to save RAM", MSGFLAG_INFO);
@@ -203,6 +218,7 @@ device_tracker::device_tracker() :
         _MSG_INFO("Saving devices to the Kismet database log every {} seconds", lograte);
 
         databaselog_logging = false;
+        databaselog_generation = 1;
 
         databaselog_timer =
             timetracker->register_timer(std::chrono::seconds(lograte), 1,
@@ -227,21 +243,30 @@ device_tracker::device_tracker() :
                     if (!dbf->is_enabled())
                         return 1;
 
-                    databaselog_write_devices();
-                    // _MSG_DEBUG("done logging at {}", std::chrono::system_clock::now());
+                    // Write on our own thread so a large pass doesn't tie up a timer
+                    // worker; the previous pass has already finished
+                    databaselog_logging = true;
+
+                    if (databaselog_t.joinable())
+                        databaselog_t.join();
+
+                    databaselog_t = std::thread([this]() {
+                            thread_set_process_name("DEVICELOG");
+                            databaselog_write_devices();
+                            databaselog_logging = false;
+                        });
 
                     return 1;
                 });
     } else {
         databaselog_timer = -1;
+        databaselog_generation = 0;
     }
 
 #if 0
     last_devicelist_saved = 0;
 #endif
 
-    last_database_logged = 0;
-
     // Preload the vector for speed
     unsigned int preload_sz =
         Globalreg::globalreg->kismet_config->fetch_opt_uint("tracker_device_presize", 1000);
@@ -296,6 +321,18 @@ device_tracker::device_tracker() :
 
     full_refresh_time = (time_t) Globalreg::globalreg->last_tv_sec;
 
+    view_worker_threads =
+        Globalreg::globalreg->kismet_config->fetch_opt_uint("tracker_view_threads", 0);
+
+    if (view_worker_threads == 0)
+        view_worker_threads = std::min(std::max(std::thread::hardware_concurrency(), 1U), 4U);
+
+    if (view_worker_threads > 1)
+        view_pool = std::make_unique<device_tracker_view_pool>(view_worker_threads - 1);
+
+    view_search_index =
+        Globalreg::globalreg->kismet_config->fetch_opt_bool("tracker_view_search_index", true);
+
     track_persource_history =
         Globalreg::globalreg->kismet_config->fetch_opt_bool("keep_per_datasource_stats", false);
 
@@ -312,33 +349,31 @@ device_tracker::device_tracker() :
     auto httpd = Globalreg::fetch_mandatory_global_as<kis_net_beast_httpd>();
 
     httpd->register_route("/devices/views/all_views", {"GET", "POST"}, httpd->RO_ROLE, {},
-            std::make_shared<kis_net_web_tracked_endpoint>(view_vec, get_devicelist_mutex()));
+            std::make_shared<kis_net_web_tracked_endpoint>(view_vec, view_mutex));
 
     httpd->register_route("/devices/multimac/devices", {"POST"}, httpd->RO_ROLE, {},
             std::make_shared<kis_net_web_tracked_endpoint>(
                 [this](shared_con con) -> std::shared_ptr<tracker_element> {
                     return multimac_endp_handler(con);
-                }, get_devicelist_mutex()));
+                }));
 
     httpd->register_route("/devices/multikey/devices", {"POST"}, httpd->RO_ROLE, {},
             std::make_shared<kis_net_web_tracked_endpoint>(
                 [this](shared_con con) -> std::shared_ptr<tracker_element> {
                     return multikey_endp_handler(con, false);
-                }, get_devicelist_mutex()));
+                }));
 
     httpd->register_route("/devices/multikey/as-object/devices", {"POST"}, httpd->RO_ROLE, {},
             std::make_shared<kis_net_web_tracked_endpoint>(
                 [this](shared_con con) -> std::shared_ptr<tracker_element> {
                     return multikey_endp_handler(con, true);
-                }, get_devicelist_mutex()));
+                }));
 
     httpd->register_route("/devices/all_devices", {"GET", "POST"}, httpd->RO_ROLE, {"ekjson", "itjson"},
             std::make_shared<kis_net_web_tracked_endpoint>(
                 [this](shared_con con) -> std::shared_ptr<tracker_element> {
-                    auto device_ro = std::make_shared<tracker_element_vector>();
-                    device_ro->set(immutable_tracked_vec->begin(), immutable_tracked_vec->end());
-                    return device_ro;
-                }, get_devicelist_mutex()));
+                    return get_immutable_device_vec();
+                }));
 
     httpd->register_route("/devices/by-key/:key/device", {"GET", "POST"}, httpd->RO_ROLE, {},
             std::make_shared<kis_net_web_tracked_endpoint>(
@@ -355,7 +390,7 @@ device_tracker::device_tracker() :
                         throw std::runtime_error("nonexistent device key");
 
                     return dev;
-                }, get_devicelist_mutex()));
+                }));
 
     httpd->register_route("/devices/by-mac/:mac/devices", {"GET", "POST"}, httpd->RO_ROLE, {},
             std::make_shared<kis_net_web_tracked_endpoint>(
@@ -368,12 +403,28 @@ device_tracker::device_tracker() :
 
                     auto devvec = std::make_shared<tracker_element_vector>();
 
-                    const auto mmp = tracked_mac_multimap.equal_range(mac);
-                    for (auto mmpi = mmp.first; mmpi != mmp.second; ++mmpi)
-                        devvec->push_back(mmpi->second);
+                    for (const auto& d : fetch_devices(mac))
+                        devvec->push_back(d);
 
                     return devvec;
-                }, get_devicelist_mutex()));
+                }));
+
+    httpd->register_route("/devices/by-oui/:oui/devices", {"GET", "POST"}, httpd->RO_ROLE, {},
+            std::make_shared<kis_net_web_tracked_endpoint>(
+                [this](shared_con con) -> std::shared_ptr<tracker_element> {
+                    auto oui_k = con->uri_params().find(":oui");
+                    auto oui = string_to_n<mac_addr>(oui_k->second);
+
+                    if (oui.error())
+                        throw std::runtime_error("invalid device OUI");
+
+                    auto devvec = std::make_shared<tracker_element_vector>();
+
+                    for (const auto& d : fetch_devices_oui(oui.OUI()))
+                        devvec->push_back(d);
+
+                    return devvec;
+                }));
 
     httpd->register_route("/devices/last-time/:timestamp/devices", {"GET", "POST"}, httpd->RO_ROLE, {},
             std::make_shared<kis_net_web_tracked_endpoint>(
@@ -392,14 +443,7 @@ device_tracker::device_tracker() :
                         ts = tv;
                     }
 
-                    auto ts_worker = device_tracker_view_function_worker(
-                        [ts](std::shared_ptr<kis_tracked_device_base> d) -> bool {
-                            if (d->get_last_time() <= ts)
-                                return false;
-                            return true;
-                        });
-
-                    auto next_work_vec = do_device_work(ts_worker);
+                    auto next_work_vec = fetch_devices_since(ts);
 
                     if (!regex.is_null()) {
                         try {
@@ -415,7 +459,7 @@ device_tracker::device_tracker() :
                     }
 
                     return next_work_vec;
-                }, get_devicelist_mutex()));
+                }));
 
     httpd->register_route("/devices/by-key/:key/set_name", {"POST"}, httpd->LOGON_ROLE, {"cmd"},
             std::make_shared<kis_net_web_function_endpoint>(
@@ -437,7 +481,7 @@ device_tracker::device_tracker() :
 
                     std::ostream os(&con->response_stream());
                     os << "Device name set\n";
-                }, get_devicelist_mutex()));
+                }));
 
     httpd->register_route("/devices/by-key/:key/set_tag", {"POST"}, httpd->LOGON_ROLE, {"cmd"},
             std::make_shared<kis_net_web_function_endpoint>(
@@ -460,7 +504,7 @@ device_tracker::device_tracker() :
 
                     std::ostream os(&con->response_stream());
                     os << "Device tag set\n";
-                }, get_devicelist_mutex()));
+                }));
 
     httpd->register_route("/devices/pcap/by-key/:key/packets", {"GET"}, httpd->RO_ROLE, {"pcapng"},
             std::make_shared<kis_net_web_function_endpoint>(
@@ -539,7 +583,7 @@ device_tracker::device_tracker() :
                         else
                             macdevice_alert_conf_map[mi] = type_set;
                     }
-                }, get_devicelist_mutex()));
+                }, macdevice_alert_mutex));
 
     httpd->register_route("/devices/alerts/mac/:type/remove", {"POST"}, httpd->LOGON_ROLE, {"cmd"},
             std::make_shared<kis_net_web_function_endpoint>(
@@ -599,7 +643,7 @@ device_tracker::device_tracker() :
                             }
                         }
                     }
-                }, get_devicelist_mutex()));
+                }, macdevice_alert_mutex));
 
     httpd->register_route("/devices/alerts/mac/:type/macs", {"GET"}, httpd->RO_ROLE, {},
             std::make_shared<kis_net_web_tracked_endpoint>(
@@ -624,7 +668,7 @@ device_tracker::device_tracker() :
                     }
 
                     return ret;
-                }, get_devicelist_mutex()));
+                }, macdevice_alert_mutex));
 
     httpd->register_websocket_route("/devices/monitor", httpd->RO_ROLE, {"ws"},
             std::make_shared<kis_net_web_function_endpoint>(
@@ -695,21 +739,18 @@ device_tracker::device_tracker() :
                                     timetracker->register_timer(std::chrono::seconds(rate), true,
                                             [this, con, dev_r, dev_k, dev_m, json, ws, &last_tm, rename_map, format_t](int) -> int {
                                                 if (dev_r == "*") {
-                                                    auto worker = device_tracker_view_function_worker([json, last_tm, format_t, this, ws](std::shared_ptr<kis_tracked_device_base> dev) -> bool {
+                                                    // Only devices seen since the last pass can have changed
+                                                    for (const auto& d : *fetch_devices_since(last_tm)) {
+                                                        auto dev = std::static_pointer_cast<kis_tracked_device_base>(d);
+
                                                         if (dev->get_mod_time() > last_tm) {
                                                             std::stringstream ss;
                                                             entrytracker->serialize_with_json_summary(format_t, ss, dev, json);
                                                             auto data = ss.str();
                                                             ws->write(data);
                                                         }
-
-                                                        return false;
-                                                    });
-
-                                                    do_device_work(worker);
+                                                    }
                                                 } else if (!dev_k.get_error()) {
-                                                    kis_lock_guard<kis_mutex> lk(get_devicelist_mutex(), "ws monitor timer serialize lambda");
-
                                                     auto dev = fetch_device(dev_k);
                                                     if (dev != nullptr) {
                                                         if (dev->get_mod_time() > last_tm) {
@@ -720,13 +761,10 @@ device_tracker::device_tracker() :
                                                         }
                                                     }
                                                 } else if (!dev_m.error()) {
-                                                    kis_lock_guard<kis_mutex> lk(get_devicelist_mutex(), "ws monitor timer serialize lambda");
-
-                                                    const auto mmp = tracked_mac_multimap.equal_range(dev_m);
-                                                    for (auto mmpi = mmp.first; mmpi != mmp.second; ++mmpi) {
-                                                        if (mmpi->second->get_mod_time() > last_tm) {
+                                                    for (const auto& d : fetch_devices(dev_m)) {
+                                                        if (d->get_mod_time() > last_tm) {
                                                             std::stringstream ss;
-                                                            entrytracker->serialize_with_json_summary(format_t, ss, mmpi->second, json);
+                                                            entrytracker->serialize_with_json_summary(format_t, ss, d, json);
                                                             auto data = ss.str();
                                                             ws->write(data);
                                                         }
@@ -900,8 +938,12 @@ device_tracker::~device_tracker() {
         timetracker->remove_timer(device_idle_timer);
         timetracker->remove_timer(max_devices_timer);
         timetracker->remove_timer(device_storage_timer);
+        timetracker->remove_timer(databaselog_timer);
     }
 
+    if (databaselog_t.joinable())
+        databaselog_t.join();
+
     // TODO broken for now
     /*
 	if (track_filter != NULL)
@@ -912,11 +954,12 @@ device_tracker::~device_tracker() {
         delete(p.second);
 
     immutable_tracked_vec->clear();
-    tracked_mac_multimap.clear();
+    tracked_mac_index.clear();
+    tracked_oui_index.clear();
 }
 
 void device_tracker::macdevice_timer_event() {
-    kis_lock_guard<kis_mutex> lk(get_devicelist_mutex(), "device_tracker macdevice_timer_event");
+    kis_lock_guard<kis_mutex> lk(macdevice_alert_mutex, "device_tracker macdevice_timer_event");
 
     time_t now = Globalreg::globalreg->last_tv_sec;
 
@@ -978,7 +1021,7 @@ std::string device_tracker::fetch_phy_name(int in_phy) {
 }
 
 int device_tracker::fetch_num_devices() {
-    kis_lock_guard<kis_mutex> lk(get_devicelist_mutex(), "device_tracker fetch_num_devices");
+    kis_shared_lock<kis_shared_mutex> lk(devicelist_index_mutex, "device_tracker fetch_num_devices");
 
     return tracked_map.size();
 }
@@ -1005,6 +1048,8 @@ int device_tracker::register_phy_handler(kis_phy_handler *in_weak_handler) {
 	phy_filterpackets[num] = 0;
 
     if (map_phy_views) {
+        kis_lock_guard<kis_mutex> view_lk(view_mutex, "device_tracker register_phy_handler");
+
         auto phy_id = strongphy->fetch_phy_id();
 
         auto k = phy_view_map.find(phy_id);
@@ -1045,7 +1090,7 @@ void device_tracker::update_full_refresh() {
 }
 
 std::shared_ptr<kis_tracked_device_base> device_tracker::fetch_device(const device_key& in_key) {
-    kis_lock_guard<kis_mutex> lk(get_devicelist_mutex(), "device_tracker fetch_device");
+    kis_shared_lock<kis_shared_mutex> lk(devicelist_index_mutex, "device_tracker fetch_device");
 
 	device_itr i = tracked_map.find(in_key);
 
@@ -1064,14 +1109,174 @@ std::shared_ptr<kis_tracked_device_base> device_tracker::fetch_device_nr(const d
 	return NULL;
 }
 
+std::shared_ptr<tracker_element_vector> device_tracker::get_immutable_device_vec() {
+    kis_shared_lock<kis_shared_mutex> lk(devicelist_index_mutex, "device_tracker get_immutable_device_vec");
+    return std::make_shared<tracker_element_vector>(immutable_tracked_vec);
+}
+
+void device_tracker::lock_device_shard(unsigned int in_shard) {
+    if (device_shard_depth[in_shard] > 0) {
+        device_shard_depth[in_shard]++;
+        return;
+    }
+
+    const uint64_t bit = 1ULL << in_shard;
+
+    // Taking a lower shard while holding a higher one could deadlock against a thread
+    // locking in order; the caller has to take every shard it needs up front instead
+    if (device_shard_held & ~((bit << 1) - 1))
+        throw std::runtime_error(fmt::format("invalid use: thread {} attempted to lock device "
+                    "shard {} out of order while holding higher shards",
+                    std::this_thread::get_id(), in_shard));
+
+    device_shard_mutexes[in_shard].lock();
+
+    device_shard_depth[in_shard] = 1;
+    device_shard_held |= bit;
+}
+
+void device_tracker::unlock_device_shard(unsigned int in_shard) {
+    if (device_shard_depth[in_shard] == 0)
+        throw std::runtime_error(fmt::format("invalid use: thread {} attempted to unlock device "
+                    "shard {} which it does not hold", std::this_thread::get_id(), in_shard));
+
+    if (--device_shard_depth[in_shard] > 0)
+        return;
+
+    device_shard_held &= ~(1ULL << in_shard);
+    device_shard_mutexes[in_shard].unlock();
+}
+
+void device_tracker::lock_devicelist() {
+    for (unsigned int s = 0; s < DEVICE_LOCK_SHARDS; s++)
+        lock_device_shard(s);
+}
+
+void device_tracker::unlock_devicelist() {
+    for (int s = DEVICE_LOCK_SHARDS - 1; s >= 0; s--)
+        unlock_device_shard(s);
+}
+
+void device_mac_bucket::add(const std::shared_ptr<kis_tracked_device_base>& in_dev) {
+    if (first == nullptr) {
+        first = in_dev;
+        return;
+    }
+
+    overflow.push_back(in_dev);
+}
+
+bool device_mac_bucket::remove(const device_key& in_key) {
+    if (first != nullptr && first->get_key() == in_key) {
+        if (overflow.size() == 0) {
+            first.reset();
+            return true;
+        }
+
+        first = overflow.back();
+        overflow.pop_back();
+        return false;
+    }
+
+    for (auto i = overflow.begin(); i != overflow.end(); ++i) {
+        if ((*i)->get_key() == in_key) {
+            overflow.erase(i);
+            break;
+        }
+    }
+
+    return first == nullptr;
+}
+
+void device_tracker::add_mac_index_nr(const std::shared_ptr<kis_tracked_device_base>& in_dev) {
+    const auto mac = in_dev->get_macaddr();
+
+    tracked_mac_index[mac.longmac].add(in_dev);
+    tracked_oui_index[mac.OUI()].insert(mac.longmac);
+}
+
+void device_tracker::remove_mac_index_nr(const std::shared_ptr<kis_tracked_device_base>& in_dev) {
+    const auto mac = in_dev->get_macaddr();
+
+    auto mi = tracked_mac_index.find(mac.longmac);
+    if (mi == tracked_mac_index.end())
+        return;
+
+    if (!mi->second.remove(in_dev->get_key()))
+        return;
+
+    // Last device with this MAC is gone, drop it from the OUI index as well
+    tracked_mac_index.erase(mi);
+
+    auto oi = tracked_oui_index.find(mac.OUI());
+    if (oi != tracked_oui_index.end()) {
+        oi->second.erase(mac.longmac);
+        if (oi->second.empty())
+            tracked_oui_index.erase(oi);
+    }
+}
+
+void device_tracker::fetch_devices_nr(const mac_addr& in_mac,
+        std::vector<std::shared_ptr<kis_tracked_device_base>>& ret) {
+
+    // Exact MAC
+    if (in_mac.maskbits >= 64) {
+        auto mi = tracked_mac_index.find(in_mac.longmac);
+        if (mi != tracked_mac_index.end())
+            mi->second.append_to(ret);
+        return;
+    }
+
+    const auto mask = in_mac.maskbits == 0 ? 0 : in_mac.bits_to_mask(in_mac.maskbits);
+    const auto masked = in_mac.longmac & mask;
+
+    // Masks which cover the OUI only need to look at the MACs under that OUI
+    if (in_mac.maskbits >= 24) {
+        auto oi = tracked_oui_index.find(in_mac.OUI());
+        if (oi == tracked_oui_index.end())
+            return;
+
+        for (const auto& m : oi->second) {
+            if ((m & mask) != masked)
+                continue;
+
+            auto mi = tracked_mac_index.find(m);
+            if (mi != tracked_mac_index.end())
+                mi->second.append_to(ret);
+        }
+
+        return;
+    }
+
+    // Anything shorter than an OUI has to look at every MAC
+    for (const auto& mi : tracked_mac_index) {
+        if ((mi.first & mask) == masked)
+            mi.second.append_to(ret);
+    }
+}
+
 // Fetch one or more devices by mac address or mac mask
 std::vector<std::shared_ptr<kis_tracked_device_base>> device_tracker::fetch_devices(const mac_addr& in_mac) {
-    kis_lock_guard<kis_mutex> lk(get_devicelist_mutex(), "device_tracker fetch_device mac");
+    kis_shared_lock<kis_shared_mutex> lk(devicelist_index_mutex, "device_tracker fetch_device mac");
     std::vector<std::shared_ptr<kis_tracked_device_base>> ret;
 
-    const auto mmp = tracked_mac_multimap.equal_range(in_mac);
-    for (auto mmpi = mmp.first; mmpi != mmp.second; ++mmpi) {
-        ret.push_back(mmpi->second);
+    fetch_devices_nr(in_mac, ret);
+
+    return ret;
+}
+
+std::vector<std::shared_ptr<kis_tracked_device_base>> device_tracker::fetch_devices_oui(uint32_t in_oui) {
+    kis_shared_lock<kis_shared_mutex> lk(devicelist_index_mutex, "device_tracker fetch_devices_oui");
+    std::vector<std::shared_ptr<kis_tracked_device_base>> ret;
+
+    auto oi = tracked_oui_index.find(in_oui & 0x00FFFFFF);
+    if (oi == tracked_oui_index.end())
+        return ret;
+
+    for (const auto& m : oi->second) {
+        auto mi = tracked_mac_index.find(m);
+        if (mi != tracked_mac_index.end())
+            mi->second.append_to(ret);
     }
 
     return ret;
@@ -1153,10 +1358,10 @@ std::shared_ptr<kis_tracked_device_base>
             const std::shared_ptr<kis_packet>& in_pack,
             unsigned int in_flags, const std::string& in_basic_type) {
 
-    // Updating devices can only happen in serial because we don't know that a device is being
-    // created & we don't know how to append the data until we get to the end of processing
-    // so the entire chain is perforce locked
-    kis_lock_guard<kis_mutex> lg(get_devicelist_mutex(), "device_tracker update_common_device");
+    // Updates to a device are serialized by the device shard; this also ensures only one
+    // thread can create a device for this MAC.  Phys typically already hold the shards
+    // for all the devices in a packet.
+    device_lock_scope dlk(this, in_mac);
 
     std::stringstream sstr;
 
@@ -1168,16 +1373,12 @@ std::shared_ptr<kis_tracked_device_base>
     std::shared_ptr<kis_tracked_device_base> device = NULL;
     device_key key(in_phy->fetch_phyname_hash(), in_mac);
 
-	if ((device = fetch_device_nr(key)) == NULL) {
+	if ((device = fetch_device(key)) == NULL) {
         if (in_flags & UCD_UPDATE_EXISTING_ONLY)
             return NULL;
 
         device = std::make_shared<kis_tracked_device_base>(device_builder.get());
 
-        // Device ID is the size of the vector so a new device always gets put
-        // in it's numbered slot
-        device->set_kis_internal_id(immutable_tracked_vec->size());
-
         device->set_key(key);
 
         device->set_macaddr(in_mac);
@@ -1215,9 +1416,11 @@ std::shared_ptr<kis_tracked_device_base>
 
     // Update the mod data
     device->update_modtime();
+    databaselog_mark_dirty(device);
 
     // Raise alerts for new devices or devices which have been idle and re-appeared
     // Also keep them in macdevice_flagged_vec to send devicelost alerts
+    kis_unique_lock<kis_mutex> alert_lk(macdevice_alert_mutex, "device_tracker update_common_device");
     auto k = macdevice_alert_conf_map.find(device->get_macaddr());
     if (k != macdevice_alert_conf_map.end()) {
         if (new_device || ((device->get_last_time() < in_pack->ts.tv_sec &&
@@ -1246,9 +1449,14 @@ std::shared_ptr<kis_tracked_device_base>
         }
 
     }
+    alert_lk.unlock();
 
     device->set_if_lt_last_time(in_pack->ts.tv_sec);
 
+    // New devices join the activity index once they're in the device list
+    if (!new_device)
+        touch_device_activity(device.get(), device->get_last_time());
+
     if (in_flags & UCD_UPDATE_PACKETS) {
         device->inc_packets();
 
@@ -1407,11 +1615,20 @@ std::shared_ptr<kis_tracked_device_base>
 
     if (new_device) {
         // Add the new device to the list
+        kis_unique_lock<kis_shared_mutex> index_lk(devicelist_index_mutex, "device_tracker update_common_device");
+
+        // Device ID is the size of the vector so a new device always gets put
+        // in it's numbered slot
+        device->set_kis_internal_id(immutable_tracked_vec->size());
+
         tracked_map[key] = device;
         immutable_tracked_vec->push_back(device);
 
-        auto mm_pair = std::make_pair(in_mac, device);
-        tracked_mac_multimap.insert(mm_pair);
+        add_mac_index_nr(device);
+
+        index_lk.unlock();
+
+        touch_device_activity(device.get(), device->get_last_time());
 
         // If we have no packet info, add it to the device list immediately,
         // otherwise, flag the packet to trigger a new device event at the
@@ -1453,66 +1670,139 @@ std::shared_ptr<tracker_element_vector> device_tracker::do_readonly_device_work(
 
 // Simple std::sort comparison function to order by the least frequently
 // seen devices
-bool devicetracker_sort_lastseen(const std::shared_ptr<tracker_element>& a,
-    const std::shared_ptr<tracker_element>& b) {
+void device_tracker::touch_device_activity(kis_tracked_device_base *in_dev, time_t in_ts) {
+    // Devices are seen many times a second; the position only changes when the time does.
+    // The link time is only modified under the device shard, which the caller holds.
+    if (in_dev->activity.linked && in_dev->activity.time == in_ts)
+        return;
 
-    if (a == nullptr)
-        return true;
-    if (b == nullptr)
-        return true;
+    kis_lock_guard<kis_mutex> lk(activity_mutex, "device_tracker touch_device_activity");
 
-    return dynamic_cast<kis_tracked_device_base *>(a.get())->get_last_time() <
-        dynamic_cast<kis_tracked_device_base *>(b.get())->get_last_time();
+    unlink_device_activity_nr(in_dev);
+    link_device_activity_nr(in_dev, in_ts);
 }
 
-void device_tracker::timetracker_event(int eventid) {
-    if (eventid == device_idle_timer) {
-        kis_lock_guard<kis_mutex> lk(get_devicelist_mutex(), "device_tracker timetracker_event device_idle_timer");
+void device_tracker::link_device_activity_nr(kis_tracked_device_base *in_dev, time_t in_ts) {
+    in_dev->activity.time = in_ts;
+    in_dev->activity.linked = true;
 
-        time_t ts_now = Globalreg::globalreg->last_tv_sec;
-        bool purged = false;
+    // Almost every update is the newest time we've seen, but packets from multiple sources
+    // can arrive slightly out of order, so walk back to the right position
+    auto pos = activity_tail;
+    while (pos != nullptr && pos->activity.time > in_ts)
+        pos = pos->activity.prev;
 
-        // Reset the smart pointer of any devices we're dropping from the device list
-        for (size_t pi = 0; pi < immutable_tracked_vec->size(); pi++) {
-            auto d = std::static_pointer_cast<kis_tracked_device_base>(*(immutable_tracked_vec->begin() + pi));
+    in_dev->activity.prev = pos;
 
-            if (d == nullptr)
-                continue;
+    if (pos == nullptr) {
+        in_dev->activity.next = activity_head;
+        activity_head = in_dev;
+    } else {
+        in_dev->activity.next = pos->activity.next;
+        pos->activity.next = in_dev;
+    }
+
+    if (in_dev->activity.next == nullptr)
+        activity_tail = in_dev;
+    else
+        in_dev->activity.next->activity.prev = in_dev;
 
-            if (ts_now - d->get_last_time() > device_idle_expiration &&
-                (d->get_packets() < device_idle_min_packets ||
-                 device_idle_min_packets <= 0)) {
+    // Landed inside the region the idle timer already examined; move the cursor back so
+    // the device is examined on the next pass
+    if (activity_idle_cursor != nullptr && activity_idle_cursor->activity.time > in_ts)
+        activity_idle_cursor = in_dev->activity.prev;
+}
 
-                device_itr mi = tracked_map.find(d->get_key());
-                if (mi != tracked_map.end())
-                    tracked_map.erase(mi);
+void device_tracker::unlink_device_activity_nr(kis_tracked_device_base *in_dev) {
+    if (!in_dev->activity.linked)
+        return;
 
-                // Erase it from the multimap
-                auto mmp = tracked_mac_multimap.equal_range(d->get_macaddr());
+    if (activity_idle_cursor == in_dev)
+        activity_idle_cursor = in_dev->activity.prev;
 
-                for (auto mmpi = mmp.first; mmpi != mmp.second; ++mmpi) {
-                    if (mmpi->second->get_key() == d->get_key()) {
-                        tracked_mac_multimap.erase(mmpi);
-                        break;
-                    }
-                }
+    if (in_dev->activity.prev == nullptr)
+        activity_head = in_dev->activity.next;
+    else
+        in_dev->activity.prev->activity.next = in_dev->activity.next;
+
+    if (in_dev->activity.next == nullptr)
+        activity_tail = in_dev->activity.prev;
+    else
+        in_dev->activity.next->activity.prev = in_dev->activity.prev;
+
+    in_dev->activity.prev = nullptr;
+    in_dev->activity.next = nullptr;
+    in_dev->activity.linked = false;
+}
+
+std::shared_ptr<tracker_element_vector> device_tracker::fetch_devices_since(time_t in_ts) {
+    auto ret = std::make_shared<tracker_element_vector>();
+
+    // Devices are resolved through the immutable vec, so the index lock has to be taken
+    // before the activity lock
+    kis_shared_lock<kis_shared_mutex> index_lk(devicelist_index_mutex, "device_tracker fetch_devices_since");
+    kis_lock_guard<kis_mutex> lk(activity_mutex, "device_tracker fetch_devices_since");
+
+    // Walk back from the newest device until we reach the requested time
+    auto d = activity_tail;
+    while (d != nullptr && d->activity.time > in_ts)
+        d = d->activity.prev;
+
+    for (d = d == nullptr ? activity_head : d->activity.next; d != nullptr; d = d->activity.next) {
+        // Devices being removed may already be gone from the vec
+        auto dev = *(immutable_tracked_vec->begin() + d->get_kis_internal_id());
+        if (dev != nullptr)
+            ret->push_back(dev);
+    }
+
+    return ret;
+}
+
+time_t device_tracker::fetch_activity_time() {
+    kis_lock_guard<kis_mutex> lk(activity_mutex, "device_tracker fetch_activity_time");
+
+    if (activity_tail == nullptr)
+        return 0;
+
+    return activity_tail->activity.time;
+}
 
-                // Forget it from any views
-                remove_view_device(d);
+void device_tracker::timetracker_event(int eventid) {
+    if (eventid == device_idle_timer) {
+        // Holding every shard excludes anything which could add or update devices, so the
+        // activity index can't move under us
+        devicelist_scope_locker dlk(this);
 
-                // Forget the immutable vec pointer to it
-                (immutable_tracked_vec->begin() + pi)->reset();
+        time_t ts_now = Globalreg::globalreg->last_tv_sec;
+        std::vector<std::shared_ptr<kis_tracked_device_base>> purge_vec;
 
-                purged = true;
+        {
+            kis_lock_guard<kis_mutex> lk(activity_mutex, "device_tracker timetracker_event idle");
 
+            auto d = activity_idle_cursor == nullptr ?
+                activity_head : activity_idle_cursor->activity.next;
+
+            // Only devices past the idle time are examined; devices which are idle but have
+            // too many packets to expire are skipped on future passes
+            while (d != nullptr && ts_now - d->activity.time > device_idle_expiration) {
+                if (d->get_packets() < device_idle_min_packets || device_idle_min_packets <= 0)
+                    purge_vec.push_back(std::static_pointer_cast<kis_tracked_device_base>(
+                                *(immutable_tracked_vec->begin() + d->get_kis_internal_id())));
+                else
+                    activity_idle_cursor = d;
+
+                d = d->activity.next;
             }
         }
 
-        if (purged)
+        for (const auto& d : purge_vec)
+            remove_device_nr(d);
+
+        if (purge_vec.size())
             update_full_refresh();
 
     } else if (eventid == max_devices_timer) {
-        kis_lock_guard<kis_mutex> lk(get_devicelist_mutex(), "device_tracker timetracker_event max_devices_timer");
+        devicelist_scope_locker dlk(this);
 
 		// Do nothing if we don't care
 		if (max_num_devices <= 0)
@@ -1522,44 +1812,59 @@ void device_tracker::timetracker_event(int eventid) {
 		if (tracked_map.size() <= max_num_devices)
             return;
 
-        // Now this gets expensive; clone the immutable vec, sort it, and then we start
-        // zeroing out the immutable vec records
-        tracker_element_vector sorted_vec(immutable_tracked_vec);
+        // The activity index is ordered by last time seen, so the devices to drop are
+        // simply the oldest at the head
+        std::vector<std::shared_ptr<kis_tracked_device_base>> purge_vec;
 
-#if defined(HAVE_CPP17_PARALLEL)
-        std::stable_sort(std::execution::par_unseq, sorted_vec.begin(), sorted_vec.end(), devicetracker_sort_lastseen);
-#else
-        std::stable_sort(sorted_vec.begin(), sorted_vec.end(), devicetracker_sort_lastseen);
-#endif
-
-        for (auto i = sorted_vec.begin() + max_num_devices; i != sorted_vec.end(); ++i) {
-            auto d = std::static_pointer_cast<kis_tracked_device_base>(*i);
-
-            device_itr mi = tracked_map.find(d->get_key());
-            if (mi != tracked_map.end())
-                tracked_map.erase(mi);
+        {
+            kis_lock_guard<kis_mutex> lk(activity_mutex, "device_tracker timetracker_event max");
 
-            // Erase it from the multimap
-            auto mmp = tracked_mac_multimap.equal_range(d->get_macaddr());
-
-            for (auto mmpi = mmp.first; mmpi != mmp.second; ++mmpi) {
-                if (mmpi->second->get_key() == d->get_key()) {
-                    tracked_mac_multimap.erase(mmpi);
-                    break;
-                }
-            }
+            auto num_purge = tracked_map.size() - max_num_devices;
 
-            // Forget it from the immutable vec, but keep its
-            // position; we need to have vecpos = devid
-            (immutable_tracked_vec->begin() + d->get_kis_internal_id())->reset();
+            for (auto d = activity_head; d != nullptr && purge_vec.size() < num_purge;
+                    d = d->activity.next)
+                purge_vec.push_back(std::static_pointer_cast<kis_tracked_device_base>(
+                            *(immutable_tracked_vec->begin() + d->get_kis_internal_id())));
         }
 
+        for (const auto& d : purge_vec)
+            remove_device_nr(d);
+
         // Do an update since we're trimming something
         update_full_refresh();
 
 	}
 }
 
+void device_tracker::remove_device_nr(const std::shared_ptr<kis_tracked_device_base>& d) {
+    {
+        kis_unique_lock<kis_shared_mutex> index_lk(devicelist_index_mutex, "device_tracker remove_device_nr");
+
+        device_itr mi = tracked_map.find(d->get_key());
+        if (mi != tracked_map.end())
+            tracked_map.erase(mi);
+
+        remove_mac_index_nr(d);
+
+        // Forget it from the immutable vec, but keep its
+        // position; we need to have vecpos = devid
+        (immutable_tracked_vec->begin() + d->get_kis_internal_id())->reset();
+    }
+
+    if (databaselog_generation != 0) {
+        kis_lock_guard<kis_mutex> lk(databaselog_dirty_mutex, "device_tracker remove_device_nr");
+        databaselog_dirty_map.erase(d->get_key());
+    }
+
+    {
+        kis_lock_guard<kis_mutex> lk(activity_mutex, "device_tracker remove_device_nr");
+        unlink_device_activity_nr(d.get());
+    }
+
+    // Forget it from any views
+    remove_view_device(d);
+}
+
 void device_tracker::usage(const char *name __attribute__((unused))) {
     printf("\n");
 	printf(" *** Device Tracking Options ***\n");
@@ -1653,7 +1958,8 @@ int device_tracker::database_upgrade_db() {
 }
 
 void device_tracker::add_device(std::shared_ptr<kis_tracked_device_base> device) {
-    kis_lock_guard<kis_mutex> lk(get_devicelist_mutex(), "device_tracker add_device");
+    device_lock_scope dlk(this, device->get_macaddr());
+    kis_unique_lock<kis_shared_mutex> index_lk(devicelist_index_mutex, "device_tracker add_device");
 
     if (fetch_device_nr(device->get_key()) != NULL) {
         _MSG("device_tracker tried to add device " + device->get_macaddr().mac_to_string() +
@@ -1668,12 +1974,15 @@ void device_tracker::add_device(std::shared_ptr<kis_tracked_device_base> device)
     tracked_map[device->get_key()] = device;
     immutable_tracked_vec->push_back(device);
 
-    auto mm_pair = std::make_pair(device->get_macaddr(), device);
-    tracked_mac_multimap.emplace(mm_pair);
+    add_mac_index_nr(device);
+
+    index_lk.unlock();
+
+    touch_device_activity(device.get(), device->get_last_time());
 }
 
 bool device_tracker::add_view(std::shared_ptr<device_tracker_view> in_view) {
-    kis_lock_guard<kis_mutex> lk(devicelist_mutex);
+    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker add_view");
 
     for (const auto& i : *view_vec) {
         auto vi = static_cast<device_tracker_view *>(i.get());
@@ -1683,7 +1992,10 @@ bool device_tracker::add_view(std::shared_ptr<device_tracker_view> in_view) {
 
     view_vec->push_back(in_view);
 
-    for (const auto& i : *immutable_tracked_vec) {
+    for (const auto& i : *get_immutable_device_vec()) {
+        if (i == nullptr)
+            continue;
+
         auto di = std::static_pointer_cast<kis_tracked_device_base>(i);
         in_view->new_device(di);
     }
@@ -1692,7 +2004,7 @@ bool device_tracker::add_view(std::shared_ptr<device_tracker_view> in_view) {
 }
 
 void device_tracker::remove_view(const std::string& in_id) {
-    kis_lock_guard<kis_mutex> lk(devicelist_mutex);
+    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker remove_view");
 
     for (auto i = view_vec->begin(); i != view_vec->end(); ++i) {
         auto vi = static_cast<device_tracker_view *>((*i).get());
@@ -1704,7 +2016,7 @@ void device_tracker::remove_view(const std::string& in_id) {
 }
 
 void device_tracker::new_view_device(std::shared_ptr<kis_tracked_device_base> in_device) {
-    kis_lock_guard<kis_mutex> lk(devicelist_mutex);
+    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker new_view_device");
 
     for (const auto& i : *view_vec) {
         auto vi = dynamic_cast<device_tracker_view *>(i.get());
@@ -1713,7 +2025,7 @@ void device_tracker::new_view_device(std::shared_ptr<kis_tracked_device_base> in
 }
 
 void device_tracker::update_view_device(std::shared_ptr<kis_tracked_device_base> in_device) {
-    kis_lock_guard<kis_mutex> lk(devicelist_mutex);
+    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker update_view_device");
 
     for (const auto& i : *view_vec) {
         auto vi = dynamic_cast<device_tracker_view *>(i.get());
@@ -1722,7 +2034,7 @@ void device_tracker::update_view_device(std::shared_ptr<kis_tracked_device_base>
 }
 
 void device_tracker::remove_view_device(std::shared_ptr<kis_tracked_device_base> in_device) {
-    kis_lock_guard<kis_mutex> lk(devicelist_mutex);
+    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker remove_view_device");
 
     for (const auto& i : *view_vec) {
         auto vi = dynamic_cast<device_tracker_view *>(i.get());
@@ -1731,7 +2043,7 @@ void device_tracker::remove_view_device(std::shared_ptr<kis_tracked_device_base>
 }
 
 std::shared_ptr<device_tracker_view> device_tracker::get_phy_view(int in_phyid) {
-    kis_lock_guard<kis_mutex> lk(devicelist_mutex);
+    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker get_phy_view");
 
     auto vk = phy_view_map.find(in_phyid);
     if (vk != phy_view_map.end())
@@ -1740,6 +2052,22 @@ std::shared_ptr<device_tracker_view> device_tracker::get_phy_view(int in_phyid)
     return nullptr;
 }
 
+void device_tracker::databaselog_mark_dirty(const std::shared_ptr<kis_tracked_device_base>& in_dev) {
+    // Generation 0 means we're not logging devices at all
+    if (databaselog_generation == 0)
+        return;
+
+    // Already in the current map; the device generation is only touched under the device
+    // shard, which the caller holds
+    if (in_dev->databaselog_generation == databaselog_generation)
+        return;
+
+    kis_lock_guard<kis_mutex> lk(databaselog_dirty_mutex, "device_tracker databaselog_mark_dirty");
+
+    databaselog_dirty_map[in_dev->get_key()] = in_dev;
+    in_dev->databaselog_generation = databaselog_generation;
+}
+
 void device_tracker::databaselog_write_devices() {
     auto dbf = Globalreg::fetch_global_as<kis_database_logfile>();
 
@@ -1749,32 +2077,35 @@ void device_tracker::databaselog_write_devices() {
     if (!dbf->is_enabled())
         return;
 
-    device_tracker_view_function_worker worker([this, dbf](std::shared_ptr<kis_tracked_device_base> dev) -> bool {
-            if (dev->get_mod_time() >= last_database_logged) {
-                dbf->log_device(dev);
-            }
-
-            return false;
-        });
-
-    // Remember the time BEFORE we spend time looking at all the devices
-    uint64_t log_time = Globalreg::globalreg->last_tv_sec;
-
-    // _MSG_DEBUG("starting database log at {}", log_time);
+    kis_lock_guard<kis_mutex> wlk(databaselog_write_mutex, "device_tracker databaselog_write_devices");
 
-    databaselog_logging = true;
+    // Take the devices modified since the last pass and start a new generation; devices
+    // modified while we write them land in the new map and are written next time
+    std::vector<std::shared_ptr<kis_tracked_device_base>> dirty_vec;
 
-    // _MSG_DEBUG("got devicelist lock at {}", (uint64_t) Globalreg::globalreg->last_tv_sec);
+    if (databaselog_generation == 0) {
+        // Periodic logging is off, so nothing is tracked; this is the final write at
+        // shutdown, and gets every device
+        for (const auto& d : *get_immutable_device_vec())
+            if (d != nullptr)
+                dirty_vec.push_back(std::static_pointer_cast<kis_tracked_device_base>(d));
+    } else {
+        kis_lock_guard<kis_mutex> lk(databaselog_dirty_mutex, "device_tracker databaselog_write_devices");
 
-    do_device_work(worker);
+        dirty_vec.reserve(databaselog_dirty_map.size());
 
-    // _MSG_DEBUG("finished database log at {}", (uint64_t) Globalreg::globalreg->last_tv_sec);
+        for (const auto& d : databaselog_dirty_map)
+            dirty_vec.push_back(d.second);
 
-    databaselog_logging = false;
+        databaselog_dirty_map.clear();
+        databaselog_generation++;
+    }
 
-    // Then update the log; we might catch a few high-change devices twice, but this is
-    // safer by far
-    last_database_logged = log_time;
+    // Each device is only locked while it is written
+    for (const auto& d : dirty_vec) {
+        device_lock_scope dlk(this, d->get_macaddr());
+        dbf->log_device(d);
+    }
 }
 
 void device_tracker::load_stored_username(std::shared_ptr<kis_tracked_device_base> in_dev) {
@@ -1892,10 +2223,13 @@ void device_tracker::load_stored_tags(std::shared_ptr<kis_tracked_device_base> i
 void device_tracker::set_device_user_name(std::shared_ptr<kis_tracked_device_base> in_dev,
         const std::string& in_username) {
 
-    kis_lock_guard<kis_mutex> lk(get_devicelist_mutex(), "set_device_user_name");
+    device_lock_scope dlk(this, in_dev->get_macaddr());
 
     in_dev->set_username(in_username);
 
+    // Names are searchable; let the views re-index the device
+    update_view_device(in_dev);
+
     if (!database_valid()) {
         _MSG("Unable to store device name to permanent storage, the database connection "
                 "is not available", MSGFLAG_ERROR);
@@ -1942,7 +2276,7 @@ void device_tracker::set_device_user_name(std::shared_ptr<kis_tracked_device_bas
 void device_tracker::set_device_tag(std::shared_ptr<kis_tracked_device_base> in_dev,
         const std::string& in_tag, const std::string& in_content) {
 
-    kis_lock_guard<kis_mutex> lk(get_devicelist_mutex(), "set_device_tag");
+    device_lock_scope dlk(this, in_dev->get_macaddr());
 
     auto e = std::make_shared<tracker_element_string>();
     e->set(in_content);
@@ -1956,6 +2290,11 @@ void device_tracker::set_device_tag(std::shared_ptr<kis_tracked_device_base> in_
         sm->insert(in_tag, e);
     }
 
+    // Tags are searchable; let the views re-index the device.  Devices tagged while they
+    // are being created are indexed when they are added to the views.
+    if (fetch_device(in_dev->get_key()) == in_dev)
+        update_view_device(in_dev);
+
     if (!database_valid()) {
         _MSG("Unable to store device name to permanent storage, the database connection "
                 "is not available", MSGFLAG_ERROR);
@@ -2009,6 +2348,8 @@ void device_tracker::handle_new_datasource_event(std::shared_ptr<eventbus_event>
     auto datasource = std::static_pointer_cast<kis_datasource>(ds_k->second);
 
     if (map_seenby_views) {
+        kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker handle_new_datasource_event");
+
         auto source_uuid =datasource->get_source_uuid();
         auto source_key = datasource->get_source_key();
 
@@ -21,9 +21,12 @@
 
 #include "config.h"
 
+#include <array>
 #include <atomic>
+#include <mutex>
 #include <stdio.h>
 #include <time.h>
+#include <thread>
 #include <list>
 #include <map>
 #include <unordered_map>
@@ -61,9 +64,40 @@
 #define KIS_PHY_ANY	-1
 #define KIS_PHY_UNKNOWN -2
 
+// Number of device lock shards; devices are assigned to a shard by MAC address.  This
+// must not exceed 64, as each thread tracks the shards it holds in a 64-bit mask.
+#define DEVICE_LOCK_SHARDS  64
+
 class kis_phy_handler;
 class kis_packet;
 
+// Devices which share a MAC address.  In theory multiple objects in different PHYs could
+// have the same MAC, but nearly every MAC maps to a single device, so the first device is
+// held inline and only additional devices allocate.
+class device_mac_bucket {
+public:
+    void add(const std::shared_ptr<kis_tracked_device_base>& in_dev);
+
+    // Remove a device by key; returns true if the bucket is now empty
+    bool remove(const device_key& in_key);
+
+    bool empty() const {
+        return first == nullptr;
+    }
+
+    void append_to(std::vector<std::shared_ptr<kis_tracked_device_base>>& ret) const {
+        if (first == nullptr)
+            return;
+
+        ret.push_back(first);
+        ret.insert(ret.end(), overflow.begin(), overflow.end());
+    }
+
+protected:
+    std::shared_ptr<kis_tracked_device_base> first;
+    std::vector<std::shared_ptr<kis_tracked_device_base>> overflow;
+};
+
 class device_tracker : public lifetime_global, public kis_database, 
     public deferred_startup, public std::enable_shared_from_this<device_tracker> {
 
@@ -118,9 +152,21 @@ public:
 	// Look for an existing device record under read-only shared lock
     std::shared_ptr<kis_tracked_device_base> fetch_device(const device_key& in_key);
 
-    // Fetch one or more devices by mac address or mac mask
+    // Fetch one or more devices by mac address or mac mask; masks covering at least the OUI
+    // are resolved through the OUI index, shorter masks must scan every MAC
     std::vector<std::shared_ptr<kis_tracked_device_base>> fetch_devices(const mac_addr& in_mac);
 
+    // Fetch all devices seen after a given time, oldest first, from the activity index; this
+    // only touches the devices which match
+    std::shared_ptr<tracker_element_vector> fetch_devices_since(time_t in_ts);
+
+    // Time of the most recently active device in the activity index, in packet time, or 0
+    // if there are no devices; suitable as a cursor for fetch_devices_since
+    time_t fetch_activity_time();
+
+    // Fetch all devices with a given OUI (as returned by mac_addr::OUI())
+    std::vector<std::shared_ptr<kis_tracked_device_base>> fetch_devices_oui(uint32_t in_oui);
+
     // Look for an existing device record, without lock - must be called under some form of existing
     // lock to be safely used
     std::shared_ptr<kis_tracked_device_base> fetch_device_nr(const device_key& in_key);
@@ -137,6 +183,22 @@ public:
     std::shared_ptr<tracker_element_vector> do_readonly_device_work(device_tracker_view_worker& worker, 
             std::shared_ptr<tracker_element_vector> source_vec);
 
+    // Maximum number of threads a read-only view worker is split across
+    unsigned int get_view_worker_threads() const {
+        return view_worker_threads;
+    }
+
+    // Shared threads read-only view workers are split across, or null if workers only
+    // run on the calling thread
+    device_tracker_view_pool *get_view_pool() const {
+        return view_pool.get();
+    }
+
+    // Are views allowed to build search indexes
+    bool get_view_search_index() const {
+        return view_search_index;
+    }
+
     using device_map_t = ankerl::unordered_dense::map<device_key, std::shared_ptr<kis_tracked_device_base>>;
     using device_itr = device_map_t::iterator;
     using const_device_itr = device_map_t::const_iterator;
@@ -200,6 +262,30 @@ public:
     // CLI extension
     static void usage(const char *name);
 
+    // Device locking
+    //
+    // Devices are protected by a fixed set of lock shards, selected by the MAC address of
+    // the device.  Anything which reads or modifies a device record must hold the shard for
+    // that device, typically via a device_lock_scope; devices lock their own shard during
+    // serialization.
+    //
+    // Shards must be acquired in ascending order.  Callers which need several devices lock
+    // them all up front with a multi-device device_lock_scope; taking a new shard lower than
+    // one already held throws a runtime_error, so work which touches other devices (such as
+    // view workers) has to run after the held devices are released.
+    //
+    // Shards already held by a thread are recursive and may be re-locked freely.
+    //
+    // lock_devicelist() acquires every shard, for bulk operations which must see a stable
+    // view of every device, such as expiring devices.
+    static unsigned int device_lock_shard(const mac_addr& in_mac) {
+        auto h = in_mac.longmac * 0x9E3779B97F4A7C15ULL;
+        return (unsigned int) (h >> 58) % DEVICE_LOCK_SHARDS;
+    }
+
+    void lock_device_shard(unsigned int in_shard);
+    void unlock_device_shard(unsigned int in_shard);
+
     void lock_devicelist();
     void unlock_devicelist();
 
@@ -230,10 +316,9 @@ public:
     // Get a cached phyname; use this to de-dup thousands of devices phynames
     std::shared_ptr<tracker_element_string> get_cached_phyname(const std::string& phyname);
 
-    // Expose to devicelist mutex for external batch locking
-    kis_mutex& get_devicelist_mutex() {
-        return devicelist_mutex;
-    }
+    // Copy of the immutable device vector, for callers which walk every device.  Removed
+    // devices are null.
+    std::shared_ptr<tracker_element_vector> get_immutable_device_vec();
 
 protected:
     std::shared_ptr<entry_tracker> entrytracker;
@@ -299,6 +384,16 @@ protected:
     // Timer event for storing devices
     int device_storage_timer;
 
+    // Threads available to read-only view workers
+    unsigned int view_worker_threads;
+
+    // Pool threads for read-only view workers; the thread calling the worker takes a share
+    // of the work, so the pool has one fewer thread than view_worker_threads
+    std::unique_ptr<device_tracker_view_pool> view_pool;
+
+    // Views may index searched fields
+    bool view_search_index;
+
     // Timestamp for the last time we removed a device
     std::atomic<time_t> full_refresh_time;
 
@@ -323,6 +418,8 @@ protected:
     // 2 = lost only
     // 3 = seen and lost
     std::map<mac_addr, unsigned int> macdevice_alert_conf_map;
+    // Protects the alert map and flagged vec
+    kis_mutex macdevice_alert_mutex;
     // Timeout event
     int macdevice_alert_timeout_timer;
     // Trigger event called to see if we need to alert devices have
@@ -338,18 +435,62 @@ protected:
     device_map_t tracked_map;
 
     // MAC address lookups are incredibly expensive from the webui if we don't
-    // track by map; in theory multiple objects in different PHYs could have the
-    // same MAC so it's not a simple 1:1 map
-    std::multimap<mac_addr, std::shared_ptr<kis_tracked_device_base> > tracked_mac_multimap;
+    // track by map; devices are indexed by the full MAC, and each OUI tracks the
+    // set of MACs seen under it so that prefix and masked lookups don't need to
+    // scan every device.
+    ankerl::unordered_dense::map<uint64_t, device_mac_bucket> tracked_mac_index;
+    ankerl::unordered_dense::map<uint32_t, ankerl::unordered_dense::set<uint64_t>> tracked_oui_index;
+
+    // Index maintenance and lookup; must be called under devicelist_index_mutex
+    void add_mac_index_nr(const std::shared_ptr<kis_tracked_device_base>& in_dev);
+    void remove_mac_index_nr(const std::shared_ptr<kis_tracked_device_base>& in_dev);
+    void fetch_devices_nr(const mac_addr& in_mac,
+            std::vector<std::shared_ptr<kis_tracked_device_base>>& ret);
 
     // Immutable vector, one entry per device; may never be sorted.  Devices
     // which are removed are set to 'null'.  Each position corresponds to the
     // device ID.
     std::shared_ptr<tracker_element_vector> immutable_tracked_vec;
 
+    // Structural lock over tracked_map, the MAC indexes, and immutable_tracked_vec.
+    // This is only held for the duration of an index lookup or insert, and nothing else may
+    // be locked while holding it.  It is not recursive.
+    kis_shared_mutex devicelist_index_mutex;
+
+    // Removes a device from the indexes and views; must be called under lock_devicelist
+    void remove_device_nr(const std::shared_ptr<kis_tracked_device_base>& in_dev);
+
+    // Activity index:  every device, ordered by last time seen, oldest first.  Devices move to
+    // the tail as they are updated, so idle expiration and max device eviction only consume
+    // from the head and never touch devices which aren't due.
+    //
+    // The idle cursor marks the last device the idle timer has already examined and kept
+    // because it has too many packets to expire; everything up to the cursor is skipped on
+    // the next pass, since a device can only become eligible again by being seen, which
+    // moves it to the tail.
+    //
+    // The links in each device are only modified while holding that device shard and
+    // activity_mutex; activity_mutex is always the last lock taken.
+    kis_tracked_device_base *activity_head;
+    kis_tracked_device_base *activity_tail;
+    kis_tracked_device_base *activity_idle_cursor;
+    kis_mutex activity_mutex;
+
+    // Move a device to its position in the activity index; must hold the device shard
+    void touch_device_activity(kis_tracked_device_base *in_dev, time_t in_ts);
+    // Link and unlink, must be called under activity_mutex
+    void link_device_activity_nr(kis_tracked_device_base *in_dev, time_t in_ts);
+    void unlink_device_activity_nr(kis_tracked_device_base *in_dev);
+
+    // Device lock shards, see lock_device_shard
+    std::array<std::mutex, DEVICE_LOCK_SHARDS> device_shard_mutexes;
+
     // List of views using new API as we transition the rest to the new API
     std::shared_ptr<tracker_element_vector> view_vec;
 
+    // Protects view_vec and the phy and seenby view maps
+    kis_mutex view_mutex;
+
     using shared_con = std::shared_ptr<kis_net_beast_httpd_connection>;
     std::shared_ptr<tracker_element> multimac_endp_handler(shared_con con);
     std::shared_ptr<tracker_element> all_phys_endp_handler(shared_con con);
@@ -365,17 +506,28 @@ protected:
     ankerl::unordered_dense::map<int, kis_phy_handler *> phy_handler_map;
     kis_mutex phy_mutex;
 
-    // New multimutex primitive
-    kis_mutex devicelist_mutex;
-
     kis_mutex storing_mutex;
     std::atomic<bool> devices_storing;
 
     // If we log devices to the kismet database...
     int databaselog_timer;
-    time_t last_database_logged;
     std::atomic<bool> databaselog_logging;
 
+    // Devices modified since the last database log pass.  Devices are added as their mod time
+    // is updated, and each pass swaps the map out and writes only those devices, off the
+    // packet and device locks, on databaselog_t.  The generation lets devices which are
+    // already in the current map skip taking the lock.
+    kis_mutex databaselog_dirty_mutex;
+    ankerl::unordered_dense::map<device_key, std::shared_ptr<kis_tracked_device_base>> databaselog_dirty_map;
+    std::atomic<uint64_t> databaselog_generation;
+
+    // Serializes writing passes between the background writer and the final write at shutdown
+    kis_mutex databaselog_write_mutex;
+    std::thread databaselog_t;
+
+    // Add a device to the dirty map; must hold the device shard
+    void databaselog_mark_dirty(const std::shared_ptr<kis_tracked_device_base>& in_dev);
+
     // Do we constrain memory by not tracking RRD data?
     bool ram_no_rrd;
 
@@ -406,6 +558,85 @@ protected:
 
 };
 
+// Scoped lock over the shards of one or more devices; shards are released when the
+// scope is destroyed or unlock() is called.  Additional devices can be added to an existing
+// scope with lock(), subject to the shard ordering rules in device_tracker.
+class device_lock_scope {
+public:
+    device_lock_scope(device_tracker *in_tracker) :
+        tracker{in_tracker},
+        shards{0} { }
+
+    device_lock_scope(device_tracker *in_tracker, const mac_addr& in_mac) :
+        tracker{in_tracker},
+        shards{0} {
+        lock(in_mac);
+    }
+
+    device_lock_scope(device_tracker *in_tracker, std::initializer_list<mac_addr> in_macs) :
+        tracker{in_tracker},
+        shards{0} {
+        lock(in_macs);
+    }
+
+    device_lock_scope(const std::shared_ptr<device_tracker>& in_tracker) :
+        device_lock_scope(in_tracker.get()) { }
+
+    device_lock_scope(const std::shared_ptr<device_tracker>& in_tracker, const mac_addr& in_mac) :
+        device_lock_scope(in_tracker.get(), in_mac) { }
+
+    device_lock_scope(const std::shared_ptr<device_tracker>& in_tracker,
+            std::initializer_list<mac_addr> in_macs) :
+        device_lock_scope(in_tracker.get(), in_macs) { }
+
+    device_lock_scope(const device_lock_scope&) = delete;
+    device_lock_scope& operator=(const device_lock_scope&) = delete;
+
+    ~device_lock_scope() {
+        unlock();
+    }
+
+    void lock(const mac_addr& in_mac) {
+        auto s = device_tracker::device_lock_shard(in_mac);
+
+        if (shards & (1ULL << s))
+            return;
+
+        tracker->lock_device_shard(s);
+        shards |= (1ULL << s);
+    }
+
+    // Lock a group of devices, in shard order
+    void lock(std::initializer_list<mac_addr> in_macs) {
+        uint64_t want = 0;
+
+        for (const auto& m : in_macs)
+            want |= (1ULL << device_tracker::device_lock_shard(m));
+
+        want &= ~shards;
+
+        for (unsigned int s = 0; want != 0; s++, want >>= 1) {
+            if (want & 1) {
+                tracker->lock_device_shard(s);
+                shards |= (1ULL << s);
+            }
+        }
+    }
+
+    void unlock() {
+        for (int s = DEVICE_LOCK_SHARDS - 1; s >= 0 && shards != 0; s--) {
+            if (shards & (1ULL << s)) {
+                tracker->unlock_device_shard(s);
+                shards &= ~(1ULL << s);
+            }
+        }
+    }
+
+protected:
+    device_tracker *tracker;
+    uint64_t shards;
+};
+
 class devicelist_scope_locker {
 public:
     devicelist_scope_locker(device_tracker *in_tracker) {
@@ -31,6 +31,7 @@
 #include <pthread.h>
 
 #include "datasourcetracker.h"
+#include "devicetracker.h"
 #include "devicetracker_component.h"
 #include "kis_datasource.h"
 
@@ -568,6 +569,20 @@ void kis_tracked_device_base::reserve_fields(std::shared_ptr<tracker_element_map
     }
 }
 
+void kis_tracked_device_base::pre_serialize() {
+    auto devicetracker = Globalreg::globalreg->devicetracker;
+
+    if (devicetracker != nullptr)
+        devicetracker->lock_device_shard(device_tracker::device_lock_shard(get_macaddr()));
+}
+
+void kis_tracked_device_base::post_serialize() {
+    auto devicetracker = Globalreg::globalreg->devicetracker;
+
+    if (devicetracker != nullptr)
+        devicetracker->unlock_device_shard(device_tracker::device_lock_shard(get_macaddr()));
+}
+
 void kis_tracked_device_base::add_related_device(const std::string& in_relationship, const device_key in_key) {
     auto related_group_i = related_devices_map->find(in_relationship);
 
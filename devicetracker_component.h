@@ -317,6 +317,15 @@ protected:
 #define KIS_DEVICE_BASICCRYPT_DECRYPTED	(1 << 5)
 
 // Base of all device tracking under the new trackerentry system
+// Position of a device in the device tracker activity index; this is not exported and is
+// managed entirely by the device tracker
+struct device_activity_link {
+    kis_tracked_device_base *prev = nullptr;
+    kis_tracked_device_base *next = nullptr;
+    time_t time = 0;
+    bool linked = false;
+};
+
 class kis_tracked_device_base : public tracker_component {
 public:
     kis_tracked_device_base() :
@@ -614,8 +623,17 @@ public:
     // Optional location cloud
     __ProxyFullyDynamicTrackable(location_cloud, kis_location_rrd, location_cloud_id);
 
+    // Hold the device lock shard for the duration of serialization
+    virtual void pre_serialize() override;
+    virtual void post_serialize() override;
+
     kis_shared_mutex device_mutex;
 
+    device_activity_link activity;
+
+    // Database log generation this device was last marked dirty in; managed by the device tracker
+    uint64_t databaselog_generation = 0;
+
 protected:
     virtual void register_fields() override;
     virtual void reserve_fields(std::shared_ptr<tracker_element_map> e) override;
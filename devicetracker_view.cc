@@ -27,8 +27,430 @@
 #include "devicetracker_component.h"
 #include "util.h"
 
+#include <atomic>
+#include <thread>
+
 #include "kis_mutex.h"
 #include "kismet_algorithm.h"
+#include "alphanum.hpp"
+
+bool device_tracker_view_sort_index::make_key(const std::shared_ptr<kis_tracked_device_base>& in_dev,
+        sort_key& ret_key) const {
+    using key_type = sort_key::key_type;
+
+    auto f = get_tracker_element_path(path, in_dev);
+
+    if (f == nullptr) {
+        ret_key.type = key_type::missing_key;
+        return true;
+    }
+
+    switch (f->get_type()) {
+        case tracker_type::tracker_string:
+        case tracker_type::tracker_string_pointer:
+            ret_key.type = key_type::string_key;
+            ret_key.string_v = f->as_string();
+            return true;
+        case tracker_type::tracker_uint8:
+            ret_key.type = key_type::uint_key;
+            ret_key.uint_v = get_tracker_value<uint8_t>(f);
+            return true;
+        case tracker_type::tracker_uint16:
+            ret_key.type = key_type::uint_key;
+            ret_key.uint_v = get_tracker_value<uint16_t>(f);
+            return true;
+        case tracker_type::tracker_uint32:
+            ret_key.type = key_type::uint_key;
+            ret_key.uint_v = get_tracker_value<uint32_t>(f);
+            return true;
+        case tracker_type::tracker_uint64:
+            ret_key.type = key_type::uint_key;
+            ret_key.uint_v = get_tracker_value<uint64_t>(f);
+            return true;
+        case tracker_type::tracker_atomic_uint64:
+            ret_key.type = key_type::uint_key;
+            ret_key.uint_v = static_cast<tracker_element_atomic_uint64 *>(f.get())->get();
+            return true;
+        case tracker_type::tracker_mac_addr:
+            ret_key.type = key_type::uint_key;
+            ret_key.uint_v = get_tracker_value<mac_addr>(f).longmac;
+            return true;
+        case tracker_type::tracker_int8:
+            ret_key.type = key_type::int_key;
+            ret_key.int_v = get_tracker_value<int8_t>(f);
+            return true;
+        case tracker_type::tracker_int16:
+            ret_key.type = key_type::int_key;
+            ret_key.int_v = get_tracker_value<int16_t>(f);
+            return true;
+        case tracker_type::tracker_int32:
+            ret_key.type = key_type::int_key;
+            ret_key.int_v = get_tracker_value<int32_t>(f);
+            return true;
+        case tracker_type::tracker_int64:
+            ret_key.type = key_type::int_key;
+            ret_key.int_v = get_tracker_value<int64_t>(f);
+            return true;
+        case tracker_type::tracker_float:
+            ret_key.type = key_type::double_key;
+            ret_key.double_v = get_tracker_value<float>(f);
+            return true;
+        case tracker_type::tracker_double:
+            ret_key.type = key_type::double_key;
+            ret_key.double_v = get_tracker_value<double>(f);
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool device_tracker_view_sort_index::key_less(const sort_key& a, uint64_t a_id,
+        const sort_key& b, uint64_t b_id) {
+    using key_type = sort_key::key_type;
+
+    if (a.type != b.type)
+        return a.type < b.type;
+
+    switch (a.type) {
+        case key_type::uint_key:
+            if (a.uint_v != b.uint_v)
+                return a.uint_v < b.uint_v;
+            break;
+        case key_type::int_key:
+            if (a.int_v != b.int_v)
+                return a.int_v < b.int_v;
+            break;
+        case key_type::double_key:
+            if (a.double_v != b.double_v)
+                return a.double_v < b.double_v;
+            break;
+        case key_type::string_key:
+            {
+                // Same natural ordering as sorting string elements directly
+                auto c = doj::alphanum_comp(a.string_v, b.string_v);
+                if (c != 0)
+                    return c < 0;
+            }
+            break;
+        case key_type::missing_key:
+            break;
+    }
+
+    // Equal keys keep the order devices were created in
+    return a_id < b_id;
+}
+
+size_t device_tracker_view_sort_index::find_block(const sort_key& in_key, uint64_t in_id) const {
+    // First block whose last entry is not less than the key; keys past the end belong in
+    // the last block
+    size_t lo = 0;
+    size_t hi = blocks.size();
+
+    while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        const auto& last = blocks[mid].back();
+
+        if (key_less(last.key, last.id, in_key, in_id))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == blocks.size() && lo > 0)
+        lo--;
+
+    return lo;
+}
+
+void device_tracker_view_sort_index::update(const std::shared_ptr<kis_tracked_device_base>& in_dev,
+        sort_key&& in_key) {
+    // Blocks split when they reach this size, so that inserts only shift a few hundred entries
+    constexpr size_t max_block = 512;
+
+    auto id = in_dev->get_kis_internal_id();
+
+    remove(id);
+
+    keys[id] = in_key;
+    count++;
+
+    if (blocks.size() == 0) {
+        blocks.emplace_back();
+        blocks[0].push_back(entry{std::move(in_key), id, in_dev});
+        return;
+    }
+
+    auto bi = find_block(in_key, id);
+    auto& block = blocks[bi];
+
+    auto pos = std::lower_bound(block.begin(), block.end(), id,
+            [&in_key](const entry& e, uint64_t eid) -> bool {
+                return key_less(e.key, e.id, in_key, eid);
+            });
+
+    block.insert(pos, entry{std::move(in_key), id, in_dev});
+
+    if (block.size() >= max_block) {
+        std::vector<entry> upper;
+        upper.reserve(max_block / 2);
+
+        std::move(block.begin() + (max_block / 2), block.end(), std::back_inserter(upper));
+        block.resize(max_block / 2);
+
+        blocks.insert(blocks.begin() + bi + 1, std::move(upper));
+    }
+}
+
+void device_tracker_view_sort_index::remove(uint64_t in_id) {
+    auto ki = keys.find(in_id);
+
+    if (ki == keys.end())
+        return;
+
+    auto bi = find_block(ki->second, in_id);
+    auto& block = blocks[bi];
+
+    auto pos = std::lower_bound(block.begin(), block.end(), in_id,
+            [&ki](const entry& e, uint64_t eid) -> bool {
+                return key_less(e.key, e.id, ki->second, eid);
+            });
+
+    if (pos != block.end() && pos->id == in_id) {
+        block.erase(pos);
+
+        if (block.size() == 0)
+            blocks.erase(blocks.begin() + bi);
+    }
+
+    keys.erase(ki);
+    count--;
+}
+
+void device_tracker_view_sort_index::window(size_t in_start, size_t in_len, bool in_ascending,
+        const std::shared_ptr<tracker_element_vector>& ret) const {
+    if (in_start >= count)
+        return;
+
+    size_t remaining = count - in_start;
+    if (in_len > 0 && in_len < remaining)
+        remaining = in_len;
+
+    ret->reserve(remaining);
+
+    if (in_ascending) {
+        size_t skip = in_start;
+
+        for (auto bi = blocks.begin(); bi != blocks.end() && remaining > 0; ++bi) {
+            if (skip >= bi->size()) {
+                skip -= bi->size();
+                continue;
+            }
+
+            for (auto ei = bi->begin() + skip; ei != bi->end() && remaining > 0; ++ei, --remaining)
+                ret->push_back(ei->device);
+
+            skip = 0;
+        }
+    } else {
+        size_t skip = in_start;
+
+        for (auto bi = blocks.rbegin(); bi != blocks.rend() && remaining > 0; ++bi) {
+            if (skip >= bi->size()) {
+                skip -= bi->size();
+                continue;
+            }
+
+            for (auto ei = bi->rbegin() + skip; ei != bi->rend() && remaining > 0; ++ei, --remaining)
+                ret->push_back(ei->device);
+
+            skip = 0;
+        }
+    }
+}
+
+
+void device_tracker_view_search_index::make_grams(const std::string& in_str, size_t in_n,
+        gram_kind in_kind, std::vector<uint32_t>& ret) {
+    if (in_str.length() < in_n)
+        return;
+
+    for (size_t i = 0; i + in_n <= in_str.length(); i++) {
+        uint32_t g = 0;
+
+        for (size_t c = 0; c < in_n; c++)
+            g = (g << 8) | static_cast<uint8_t>(in_str[i + c]);
+
+        ret.push_back(g | (static_cast<uint32_t>(in_kind) << 24));
+    }
+}
+
+void device_tracker_view_search_index::entry_grams(const entry& in_entry, std::vector<uint32_t>& ret) {
+    make_grams(in_entry.text, 3, text_trigram, ret);
+    make_grams(in_entry.mac, 3, mac_trigram, ret);
+    make_grams(in_entry.mac, 2, mac_bigram, ret);
+
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+}
+
+void device_tracker_view_search_index::update(const std::shared_ptr<kis_tracked_device_base>& in_dev) {
+    entry e;
+
+    auto f = get_tracker_element_path(path, in_dev);
+
+    if (f != nullptr) {
+        // Take the same text the string match worker compares against
+        switch (f->get_type()) {
+            case tracker_type::tracker_string:
+            case tracker_type::tracker_string_pointer:
+                e.text = get_tracker_value<std::string>(f);
+                break;
+            case tracker_type::tracker_byte_array:
+                e.text = std::static_pointer_cast<tracker_element_byte_array>(f)->get();
+                break;
+            case tracker_type::tracker_mac_addr:
+                {
+                    auto m = get_tracker_value<mac_addr>(f);
+                    e.mac.assign(reinterpret_cast<const char *>(&m.longmac), MAC_LEN_MAX);
+                }
+                break;
+            default:
+                Globalreg::globalreg->entrytracker->search_xform(f, e.text);
+                break;
+        }
+    }
+
+    for (auto& c : e.text)
+        c = std::toupper(c);
+
+    auto id = in_dev->get_kis_internal_id();
+    auto ei = entries.find(id);
+
+    if (ei != entries.end()) {
+        if (ei->second.text == e.text && ei->second.mac == e.mac)
+            return;
+
+        remove(id);
+    }
+
+    // Text too short to hold a trigram can never be found by an indexed search
+    if (e.text.length() < 3 && e.mac.length() == 0)
+        return;
+
+    std::vector<uint32_t> grams;
+    entry_grams(e, grams);
+
+    for (const auto& g : grams)
+        postings[g].insert(id);
+
+    e.device = in_dev;
+    entries[id] = std::move(e);
+}
+
+void device_tracker_view_search_index::remove(uint64_t in_id) {
+    auto ei = entries.find(in_id);
+
+    if (ei == entries.end())
+        return;
+
+    std::vector<uint32_t> grams;
+    entry_grams(ei->second, grams);
+
+    for (const auto& g : grams) {
+        auto pi = postings.find(g);
+
+        if (pi == postings.end())
+            continue;
+
+        pi->second.erase(in_id);
+
+        if (pi->second.size() == 0)
+            postings.erase(pi);
+    }
+
+    entries.erase(ei);
+}
+
+bool device_tracker_view_search_index::query_grams(const std::string& in_query,
+        std::vector<uint32_t>& ret_text_grams, std::vector<uint32_t>& ret_mac_grams) {
+    auto folded = in_query;
+
+    for (auto& c : folded)
+        c = std::toupper(c);
+
+    if (folded.length() < 3)
+        return false;
+
+    make_grams(folded, 3, text_trigram, ret_text_grams);
+
+    // Terms which look like part of a MAC address are also compared to MAC fields, by the
+    // bytes they parse to
+    uint64_t mac_term;
+    unsigned int mac_term_len;
+
+    mac_addr::prepare_search_term(in_query, mac_term, mac_term_len);
+
+    if (mac_term_len == 1)
+        return false;
+
+    if (mac_term_len > 0) {
+        std::string mac_str(reinterpret_cast<const char *>(&mac_term), mac_term_len);
+
+        if (mac_term_len == 2)
+            make_grams(mac_str, 2, mac_bigram, ret_mac_grams);
+        else
+            make_grams(mac_str, 3, mac_trigram, ret_mac_grams);
+    }
+
+    return true;
+}
+
+void device_tracker_view_search_index::match_grams(const std::vector<uint32_t>& in_grams,
+        ankerl::unordered_dense::map<uint64_t, std::shared_ptr<kis_tracked_device_base>>& ret) const {
+    if (in_grams.size() == 0)
+        return;
+
+    // Walk the rarest n-gram and check the devices in it against the others
+    std::vector<const ankerl::unordered_dense::set<uint64_t> *> sets;
+    sets.reserve(in_grams.size());
+
+    for (const auto& g : in_grams) {
+        auto pi = postings.find(g);
+
+        if (pi == postings.end())
+            return;
+
+        sets.push_back(&pi->second);
+    }
+
+    std::sort(sets.begin(), sets.end(),
+            [](const ankerl::unordered_dense::set<uint64_t> *a,
+                const ankerl::unordered_dense::set<uint64_t> *b) -> bool {
+                return a->size() < b->size();
+            });
+
+    for (const auto& id : *sets[0]) {
+        bool all = true;
+
+        for (size_t i = 1; i < sets.size() && all; i++)
+            all = sets[i]->find(id) != sets[i]->end();
+
+        if (!all)
+            continue;
+
+        auto ei = entries.find(id);
+        if (ei != entries.end())
+            ret.emplace(id, ei->second.device);
+    }
+}
+
+void device_tracker_view_search_index::candidates(const std::vector<uint32_t>& in_text_grams,
+        const std::vector<uint32_t>& in_mac_grams,
+        ankerl::unordered_dense::map<uint64_t, std::shared_ptr<kis_tracked_device_base>>& ret) const {
+    match_grams(in_text_grams, ret);
+    match_grams(in_mac_grams, ret);
+}
+
 
 device_tracker_view::device_tracker_view(const std::string& in_id, const std::string& in_description,
         new_device_cb in_new_cb, updated_device_cb in_update_cb) :
@@ -47,6 +469,10 @@ device_tracker_view::device_tracker_view(const std::string& in_id, const std::st
 
     device_list = std::make_shared<tracker_element_vector>();
 
+    sort_mutex.set_name("device_tracker_view sort");
+    sort_synced_time = 0;
+    sort_tracking = false;
+
     register_urls(in_id);
 }
 
@@ -68,6 +494,10 @@ device_tracker_view::device_tracker_view(const std::string& in_id, const std::st
 
     device_list = std::make_shared<tracker_element_vector>();
 
+    sort_mutex.set_name("device_tracker_view sort");
+    sort_synced_time = 0;
+    sort_tracking = false;
+
     register_urls(in_id);
 
     if (in_aux_path.size() == 0)
@@ -89,14 +519,14 @@ void device_tracker_view::register_urls(const std::string& in_id) {
             std::make_shared<kis_net_web_function_endpoint>(
                 [this](std::shared_ptr<kis_net_beast_httpd_connection> con) {
                     return device_endpoint_handler(con);
-                }, devicetracker->get_devicelist_mutex()));
+                }));
 
     uri = fmt::format("/devices/views/{}/last-time/:timestamp/devices", in_id);
     httpd->register_route(uri, {"GET", "POST"}, httpd->RO_ROLE, {},
             std::make_shared<kis_net_web_tracked_endpoint>(
                 [this](std::shared_ptr<kis_net_beast_httpd_connection> con) {
                     return device_time_endpoint(con);
-                }, devicetracker->get_devicelist_mutex()));
+                }));
 
     uri = fmt::format("/devices/views/{}/monitor", in_id);
     httpd->register_websocket_route(uri, httpd->RO_ROLE, {"ws"},
@@ -163,20 +593,17 @@ void device_tracker_view::register_urls(const std::string& in_id) {
                                     timetracker->register_timer(std::chrono::seconds(rate), true,
                                             [this, con, dev_r, dev_k, dev_m, json, ws, &last_tm, rename_map, format_t](int) -> int {
                                                 if (dev_r == "*") {
-                                                    auto worker = device_tracker_view_function_worker([json, last_tm, format_t, ws](std::shared_ptr<kis_tracked_device_base> dev) -> bool {
+                                                    // Only devices seen since the last pass can have changed
+                                                    for (const auto& d : *fetch_devices_since(last_tm)) {
+                                                        auto dev = std::static_pointer_cast<kis_tracked_device_base>(d);
+
                                                         if (dev->get_mod_time() > last_tm) {
                                                             std::stringstream ss;
                                                             Globalreg::globalreg->entrytracker->serialize_with_json_summary(format_t, ss, dev, json);
                                                             ws->write(ss.str());
                                                         }
-
-                                                        return false;
-                                                    });
-
-                                                    do_device_work(worker);
+                                                    }
                                                 } else if (!dev_k.get_error()) {
-                                                    kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex(), "view ws monitor timer serialize lambda");
-
                                                     auto dev = fetch_device(dev_k);
                                                     if (dev != nullptr) {
                                                         if (dev->get_mod_time() > last_tm) {
@@ -186,14 +613,15 @@ void device_tracker_view::register_urls(const std::string& in_id) {
                                                         }
                                                     }
                                                 } else if (!dev_m.error()) {
-                                                    kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex(), "view ws monitor timer serialize lambda");
-
                                                     auto mvec = devicetracker->fetch_devices(dev_m);
 
                                                     for (const auto& i : mvec) {
-                                                        auto pk = device_presence_map.find(i->get_key());
-                                                        if (pk == device_presence_map.end() || pk->second == false)
-                                                            continue;
+                                                        {
+                                                            kis_lock_guard<kis_mutex> lk(view_mutex, "view ws monitor timer serialize lambda");
+                                                            auto pk = device_presence_map.find(i->get_key());
+                                                            if (pk == device_presence_map.end() || pk->second == false)
+                                                                continue;
+                                                        }
 
                                                         if (i->get_mod_time() > last_tm) {
                                                             std::stringstream ss;
@@ -233,18 +661,18 @@ void device_tracker_view::register_urls(const std::string& in_id) {
 }
 
 void device_tracker_view::pre_serialize() {
-    kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex(), kismet::retain_lock, "devicetracker_view serialize");
+    kis_lock_guard<kis_mutex> lk(view_mutex, kismet::retain_lock, "devicetracker_view serialize");
 }
 
 void device_tracker_view::post_serialize() {
-    kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex(), std::adopt_lock, "devicetracker_view post_serialize");
+    kis_lock_guard<kis_mutex> lk(view_mutex, std::adopt_lock, "devicetracker_view post_serialize");
 }
 
 std::shared_ptr<tracker_element_vector> device_tracker_view::do_device_work(device_tracker_view_worker& worker) {
     // Make a copy of the vector in case the worker manipulates the original
     std::shared_ptr<tracker_element_vector> immutable_copy;
     {
-        kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex());
+        kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view do_device_work");
         immutable_copy = std::make_shared<tracker_element_vector>(device_list);
     }
 
@@ -255,7 +683,7 @@ std::shared_ptr<tracker_element_vector> device_tracker_view::do_readonly_device_
     // Make a copy of the vector in case the worker manipulates the original
     std::shared_ptr<tracker_element_vector> immutable_copy;
     {
-        kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex());
+        kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view do_device_work");
         immutable_copy = std::make_shared<tracker_element_vector>(device_list);
     }
 
@@ -267,11 +695,6 @@ std::shared_ptr<tracker_element_vector> device_tracker_view::do_device_work(devi
     auto ret = std::make_shared<tracker_element_vector>();
     ret->reserve(devices->size());
 
-    // Lock the whole device list for the duration; we may already hold this lock if we're inside the webserver
-    // but that's OK
-    kis_lock_guard<kis_mutex> dev_lg(devicetracker->get_devicelist_mutex(),
-            "device_tracker_view do_device_work");
-
     std::for_each(devices->begin(), devices->end(),
             [&](shared_tracker_element val) {
 
@@ -280,6 +703,10 @@ std::shared_ptr<tracker_element_vector> device_tracker_view::do_device_work(devi
 
             auto dev = std::static_pointer_cast<kis_tracked_device_base>(val);
 
+            // Only lock the device we're working on, so packet processing is only held up
+            // for devices which are in the same lock shard
+            device_lock_scope dev_lk(devicetracker.get(), dev->get_macaddr());
+
             bool m;
             m = worker.match_device(dev);
 
@@ -295,59 +722,191 @@ std::shared_ptr<tracker_element_vector> device_tracker_view::do_device_work(devi
     return ret;
 }
 
+device_tracker_view_pool::device_tracker_view_pool(unsigned int n_threads) :
+    shutdown{false} {
+
+    for (unsigned int t = 0; t < n_threads; t++)
+        threads.emplace_back(std::thread([this]() { worker(); }));
+}
+
+device_tracker_view_pool::~device_tracker_view_pool() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        shutdown = true;
+    }
+
+    cv.notify_all();
+
+    for (auto& t : threads) {
+        if (t.joinable())
+            t.join();
+    }
+}
+
+void device_tracker_view_pool::post(std::function<void ()> job) {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        jobs.push_back(std::move(job));
+    }
+
+    cv.notify_one();
+}
+
+void device_tracker_view_pool::worker() {
+    thread_set_process_name("VIEWWORKER");
+
+    while (true) {
+        std::function<void ()> job;
+
+        {
+            std::unique_lock<std::mutex> lk(mutex);
+            cv.wait(lk, [this]() { return shutdown || jobs.size() > 0; });
+
+            if (shutdown)
+                return;
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        job();
+    }
+}
+
 std::shared_ptr<tracker_element_vector> device_tracker_view::do_readonly_device_work(device_tracker_view_worker& worker,
         std::shared_ptr<tracker_element_vector> devices) {
 
-    // read-only workers are currently disabled because it may not be reasonable to solve conflicts
-    // at the per-device level, use the locked worker.
+    // Workers which keep state between devices have to see every device in order on one
+    // thread, as do lists too small to be worth splitting
+    auto n_chunks = std::min<size_t>(devicetracker->get_view_worker_threads(),
+            devices->size() / VIEW_WORKER_MIN_CHUNK);
 
-    return do_device_work(worker, devices);
+    auto pool = devicetracker->get_view_pool();
 
-#if 0
-    auto ret = std::make_shared<tracker_element_vector>();
-    ret->reserve(devices->size());
+    if (!worker.parallel_safe() || n_chunks < 2 || pool == nullptr)
+        return do_device_work(worker, devices);
 
-    kis_lock_guard<kis_mutex> ul_devlist(devicetracker->get_devicelist_mutex(),
-            "device_tracker_view do_readonly_device_work");
+    // Split the list into contiguous chunks so the matches can be merged back in the
+    // original order.  The calling thread and the pool claim chunks until none are left,
+    // so a busy pool only slows the request down; a pool job which starts after every chunk
+    // is claimed returns without touching the worker, so the chunk state is shared with
+    // the jobs, and the request waits for the chunks to finish rather than the jobs.
+    struct chunk_state {
+        std::atomic<size_t> next_chunk{0};
+        size_t remaining;
+        std::mutex mutex;
+        std::condition_variable cv;
 
-    std::for_each(devices->begin(), devices->end(),
-            [&](shared_tracker_element val) {
+        std::vector<std::vector<std::shared_ptr<kis_tracked_device_base>>> matches;
+        std::vector<std::exception_ptr> errors;
+    };
 
-            if (val == nullptr)
-                return;
+    auto state = std::make_shared<chunk_state>();
+    state->remaining = n_chunks;
+    state->matches.resize(n_chunks);
+    state->errors.resize(n_chunks);
 
-            auto dev = std::static_pointer_cast<kis_tracked_device_base>(val);
+    auto chunk_sz = (devices->size() + n_chunks - 1) / n_chunks;
+    auto tracker = devicetracker.get();
+    auto worker_p = &worker;
 
-            auto m = worker.match_device(dev);
+    auto match_chunks = [state, devices, n_chunks, chunk_sz, tracker, worker_p]() {
+        size_t chunk;
 
-            if (m)
-                ret->push_back(dev);
+        while ((chunk = state->next_chunk++) < n_chunks) {
+            auto start = devices->begin() + std::min(chunk * chunk_sz, devices->size());
+            auto end = devices->begin() + std::min((chunk + 1) * chunk_sz, devices->size());
 
-        });
+            try {
+                for (auto i = start; i != end; ++i) {
+                    if (*i == nullptr)
+                        continue;
+
+                    auto dev = std::static_pointer_cast<kis_tracked_device_base>(*i);
+
+                    device_lock_scope dev_lk(tracker, dev->get_macaddr());
+
+                    if (worker_p->match_device(dev))
+                        state->matches[chunk].push_back(dev);
+                }
+            } catch (...) {
+                state->errors[chunk] = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lk(state->mutex);
+            if (--state->remaining == 0)
+                state->cv.notify_all();
+        }
+    };
+
+    for (size_t c = 1; c < n_chunks; c++)
+        pool->post(match_chunks);
+
+    match_chunks();
+
+    {
+        std::unique_lock<std::mutex> lk(state->mutex);
+        state->cv.wait(lk, [&state]() { return state->remaining == 0; });
+    }
+
+    for (const auto& e : state->errors) {
+        if (e != nullptr)
+            std::rethrow_exception(e);
+    }
+
+    auto ret = std::make_shared<tracker_element_vector>();
+
+    size_t n_matched = 0;
+    for (const auto& m : state->matches)
+        n_matched += m.size();
+
+    ret->reserve(n_matched);
+
+    for (const auto& m : state->matches) {
+        for (const auto& d : m)
+            ret->push_back(d);
+    }
 
     worker.set_matched_devices(ret);
 
     worker.finalize();
 
     return ret;
-#endif
 }
 
 std::shared_ptr<kis_tracked_device_base> device_tracker_view::fetch_device(device_key in_key) {
-    kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex(), "device_tracker_view fetch_device");
+    {
+        kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view fetch_device");
 
-    auto present_itr = device_presence_map.find(in_key);
+        auto present_itr = device_presence_map.find(in_key);
 
-    if (present_itr == device_presence_map.end() || present_itr->second == false)
-        return nullptr;
+        if (present_itr == device_presence_map.end() || present_itr->second == false)
+            return nullptr;
+    }
 
     return devicetracker->fetch_device(in_key);
 }
 
+std::shared_ptr<tracker_element_vector> device_tracker_view::fetch_devices_since(time_t in_ts) {
+    auto ret = std::make_shared<tracker_element_vector>();
+    auto recent_vec = devicetracker->fetch_devices_since(in_ts);
+
+    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view fetch_devices_since");
+
+    for (const auto& d : *recent_vec) {
+        auto dev = std::static_pointer_cast<kis_tracked_device_base>(d);
+        auto pk = device_presence_map.find(dev->get_key());
+
+        if (pk != device_presence_map.end() && pk->second)
+            ret->push_back(d);
+    }
+
+    return ret;
+}
+
 void device_tracker_view::new_device(std::shared_ptr<kis_tracked_device_base> device) {
     if (new_cb != nullptr) {
-        // Only called under guard from devicetracker
-        // kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex());
+        kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view new_device");
 
         if (new_cb(device)) {
             auto dpmi = device_presence_map.find(device->get_key());
@@ -355,6 +914,7 @@ void device_tracker_view::new_device(std::shared_ptr<kis_tracked_device_base> de
             if (dpmi == device_presence_map.end()) {
                 device_presence_map[device->get_key()] = true;
                 device_list->push_back(device);
+                sort_pending_nr(device, true);
             }
 
             list_sz->set(device_list->size());
@@ -367,8 +927,7 @@ void device_tracker_view::update_device(std::shared_ptr<kis_tracked_device_base>
     if (update_cb == nullptr)
         return;
 
-    // Only called under guard from devicetracker already
-    // kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex());
+    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view update_device");
 
     bool retain = update_cb(device);
 
@@ -380,6 +939,13 @@ void device_tracker_view::update_device(std::shared_ptr<kis_tracked_device_base>
         device_list->push_back(device);
         device_presence_map[device->get_key()] = true;
         list_sz->set(device_list->size());
+        sort_pending_nr(device, true);
+        return;
+    }
+
+    // Devices we keep may have changed in a way that moves them in the sorted indexes
+    if (retain) {
+        sort_pending_nr(device, true);
         return;
     }
 
@@ -394,13 +960,13 @@ void device_tracker_view::update_device(std::shared_ptr<kis_tracked_device_base>
         }
         device_presence_map.erase(dpmi);
         list_sz->set(device_list->size());
+        sort_pending_nr(device, false);
         return;
     }
 }
 
 void device_tracker_view::remove_device(std::shared_ptr<kis_tracked_device_base> device) {
-    // Only called under guard from devicetracker
-    // kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex());
+    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view remove_device");
 
     auto di = device_presence_map.find(device->get_key());
 
@@ -415,11 +981,12 @@ void device_tracker_view::remove_device(std::shared_ptr<kis_tracked_device_base>
         }
 
         list_sz->set(device_list->size());
+        sort_pending_nr(device, false);
     }
 }
 
 void device_tracker_view::add_device_direct(std::shared_ptr<kis_tracked_device_base> device) {
-    kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex());
+    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view add_device_direct");
 
     auto di = device_presence_map.find(device->get_key());
 
@@ -430,10 +997,11 @@ void device_tracker_view::add_device_direct(std::shared_ptr<kis_tracked_device_b
     device_list->push_back(device);
 
     list_sz->set(device_list->size());
+    sort_pending_nr(device, true);
 }
 
 void device_tracker_view::remove_device_direct(std::shared_ptr<kis_tracked_device_base> device) {
-    kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex());
+    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view remove_device_direct");
 
     auto di = device_presence_map.find(device->get_key());
 
@@ -448,9 +1016,245 @@ void device_tracker_view::remove_device_direct(std::shared_ptr<kis_tracked_devic
         }
 
         list_sz->set(device_list->size());
+        sort_pending_nr(device, false);
     }
 }
 
+void device_tracker_view::sort_pending_nr(const std::shared_ptr<kis_tracked_device_base>& in_dev,
+        bool in_present) {
+    if (!sort_tracking)
+        return;
+
+    sort_pending_map[in_dev->get_kis_internal_id()] = in_present ? in_dev : nullptr;
+}
+
+void device_tracker_view::refresh_indexes_nr(time_t in_now) {
+    // Forget indexes nobody has used in a while
+    for (auto i = sort_index_map.begin(); i != sort_index_map.end(); ) {
+        if (in_now - i->second->last_used > VIEW_SORT_INDEX_IDLE)
+            i = sort_index_map.erase(i);
+        else
+            ++i;
+    }
+
+    for (auto i = search_index_map.begin(); i != search_index_map.end(); ) {
+        if (in_now - i->second->last_used > VIEW_SORT_INDEX_IDLE)
+            i = search_index_map.erase(i);
+        else
+            ++i;
+    }
+
+    if (sort_index_map.size() == 0 && search_index_map.size() == 0) {
+        // Start recording membership changes before we copy the list to build an index, so
+        // nothing is missed in between
+        kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view refresh_indexes");
+        sort_tracking = true;
+        sort_pending_map.clear();
+
+        // The activity index is ordered by packet time, which may be nowhere near the wall
+        // clock (such as when replaying a pcap), so the cursor always comes from the index
+        sort_synced_time = devicetracker->fetch_activity_time();
+        return;
+    }
+
+    // Take the membership changes, then everything seen since the last refresh.  The new
+    // cursor is taken before the devices are fetched, so anything which moves while we
+    // work is picked up next time.
+    ankerl::unordered_dense::map<uint64_t, std::shared_ptr<kis_tracked_device_base>> changed;
+
+    {
+        kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view refresh_indexes");
+        changed.swap(sort_pending_map);
+    }
+
+    auto synced_time = devicetracker->fetch_activity_time();
+
+    for (const auto& d : *fetch_devices_since(sort_synced_time - VIEW_SORT_RESYNC_SLACK)) {
+        auto dev = std::static_pointer_cast<kis_tracked_device_base>(d);
+        changed.emplace(dev->get_kis_internal_id(), dev);
+    }
+
+    for (const auto& c : changed) {
+        if (c.second == nullptr) {
+            for (const auto& si : sort_index_map)
+                si.second->remove(c.first);
+            for (const auto& si : search_index_map)
+                si.second->remove(c.first);
+            continue;
+        }
+
+        device_lock_scope dlk(devicetracker.get(), c.second->get_macaddr());
+
+        for (const auto& si : sort_index_map) {
+            device_tracker_view_sort_index::sort_key key;
+            si.second->make_key(c.second, key);
+            si.second->update(c.second, std::move(key));
+        }
+
+        for (const auto& si : search_index_map)
+            si.second->update(c.second);
+    }
+
+    sort_synced_time = synced_time;
+}
+
+void device_tracker_view::check_index_tracking_nr() {
+    if (sort_index_map.size() > 0 || search_index_map.size() > 0)
+        return;
+
+    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view check_index_tracking");
+    sort_tracking = false;
+    sort_pending_map.clear();
+}
+
+std::shared_ptr<device_tracker_view_sort_index>
+device_tracker_view::refresh_sort_index_nr(const std::vector<int>& in_path) {
+    if (sort_unindexable_set.find(in_path) != sort_unindexable_set.end())
+        return nullptr;
+
+    auto now = time(0);
+
+    auto si = sort_index_map.find(in_path);
+    if (si != sort_index_map.end())
+        si->second->last_used = now;
+
+    refresh_indexes_nr(now);
+
+    si = sort_index_map.find(in_path);
+    if (si != sort_index_map.end())
+        return si->second;
+
+    // Build a new index from the whole view
+    auto index = std::make_shared<device_tracker_view_sort_index>(in_path);
+    index->last_used = now;
+
+    auto build_vec = std::make_shared<tracker_element_vector>();
+
+    {
+        kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view refresh_sort_index");
+        build_vec->set(device_list->begin(), device_list->end());
+    }
+
+    for (const auto& d : *build_vec) {
+        auto dev = std::static_pointer_cast<kis_tracked_device_base>(d);
+        device_tracker_view_sort_index::sort_key key;
+
+        device_lock_scope dlk(devicetracker.get(), dev->get_macaddr());
+
+        if (!index->make_key(dev, key)) {
+            sort_unindexable_set.insert(in_path);
+            index.reset();
+            break;
+        }
+
+        index->update(dev, std::move(key));
+    }
+
+    if (index != nullptr) {
+        if (sort_index_map.size() >= VIEW_SORT_MAX_INDEXES) {
+            auto lru = sort_index_map.begin();
+            for (auto i = sort_index_map.begin(); i != sort_index_map.end(); ++i)
+                if (i->second->last_used < lru->second->last_used)
+                    lru = i;
+            sort_index_map.erase(lru);
+        }
+
+        sort_index_map[in_path] = index;
+    }
+
+    check_index_tracking_nr();
+
+    return index;
+}
+
+std::shared_ptr<tracker_element_vector>
+device_tracker_view::search_candidates_nr(const std::string& in_query,
+        const std::vector<std::vector<int>>& in_paths) {
+    std::vector<uint32_t> text_grams, mac_grams;
+
+    if (!device_tracker_view_search_index::query_grams(in_query, text_grams, mac_grams))
+        return nullptr;
+
+    std::set<std::vector<int>> paths(in_paths.begin(), in_paths.end());
+
+    if (paths.size() > VIEW_SEARCH_MAX_INDEXES)
+        return nullptr;
+
+    auto now = time(0);
+
+    for (const auto& p : paths) {
+        auto si = search_index_map.find(p);
+        if (si != search_index_map.end())
+            si->second->last_used = now;
+    }
+
+    refresh_indexes_nr(now);
+
+    // Build indexes for any fields we haven't searched before, making room by dropping the
+    // indexes unused the longest
+    std::vector<std::shared_ptr<device_tracker_view_search_index>> new_indexes;
+
+    for (const auto& p : paths) {
+        if (search_index_map.find(p) != search_index_map.end())
+            continue;
+
+        while (search_index_map.size() >= VIEW_SEARCH_MAX_INDEXES) {
+            auto lru = search_index_map.begin();
+            for (auto i = search_index_map.begin(); i != search_index_map.end(); ++i)
+                if (i->second->last_used < lru->second->last_used)
+                    lru = i;
+            search_index_map.erase(lru);
+        }
+
+        auto index = std::make_shared<device_tracker_view_search_index>(p);
+        index->last_used = now;
+        search_index_map[p] = index;
+        new_indexes.push_back(index);
+    }
+
+    if (new_indexes.size() > 0) {
+        auto build_vec = std::make_shared<tracker_element_vector>();
+
+        {
+            kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view search_candidates");
+            build_vec->set(device_list->begin(), device_list->end());
+        }
+
+        for (const auto& d : *build_vec) {
+            auto dev = std::static_pointer_cast<kis_tracked_device_base>(d);
+
+            device_lock_scope dlk(devicetracker.get(), dev->get_macaddr());
+
+            for (const auto& i : new_indexes)
+                i->update(dev);
+        }
+    }
+
+    ankerl::unordered_dense::map<uint64_t, std::shared_ptr<kis_tracked_device_base>> matched;
+
+    for (const auto& p : paths)
+        search_index_map[p]->candidates(text_grams, mac_grams, matched);
+
+    // Return the candidates in the order devices were created, which is the order they
+    // appear in the view
+    std::vector<std::pair<uint64_t, std::shared_ptr<kis_tracked_device_base>>> sorted(
+            matched.begin(), matched.end());
+
+    std::sort(sorted.begin(), sorted.end(),
+            [](const std::pair<uint64_t, std::shared_ptr<kis_tracked_device_base>>& a,
+                const std::pair<uint64_t, std::shared_ptr<kis_tracked_device_base>>& b) -> bool {
+                return a.first < b.first;
+            });
+
+    auto ret = std::make_shared<tracker_element_vector>();
+    ret->reserve(sorted.size());
+
+    for (const auto& m : sorted)
+        ret->push_back(m.second);
+
+    return ret;
+}
+
 std::shared_ptr<tracker_element>
 device_tracker_view::device_time_endpoint(std::shared_ptr<kis_net_beast_httpd_connection> con) {
     auto ret = Globalreg::new_from_pool<tracker_element_vector>();
@@ -469,15 +1273,7 @@ device_tracker_view::device_time_endpoint(std::shared_ptr<kis_net_beast_httpd_co
     // Regular expression terms, if any
     auto regex = con->json()["regex"];
 
-    auto worker =
-        device_tracker_view_function_worker([&](std::shared_ptr<kis_tracked_device_base> dev) -> bool {
-                if (dev->get_last_time() < ts)
-                    return false;
-
-                return true;
-                });
-
-    auto next_work_vec = do_device_work(worker);
+    auto next_work_vec = fetch_devices_since(ts - 1);
 
     // Apply a regex filter
     if (!regex.is_null()) {
@@ -496,11 +1292,65 @@ device_tracker_view::device_time_endpoint(std::shared_ptr<kis_net_beast_httpd_co
     return next_work_vec;
 }
 
+// Copy a sort field by value, so it can still be compared once the device is unlocked
+template<typename T>
+shared_tracker_element copy_sort_scalar(const shared_tracker_element& in_elem) {
+    auto r = in_elem->clone_type();
+    static_cast<T *>(r.get())->set(static_cast<T *>(in_elem.get())->get());
+    return r;
+}
+
+static shared_tracker_element copy_sort_element(const shared_tracker_element& in_elem) {
+    if (in_elem == nullptr)
+        return nullptr;
+
+    switch (in_elem->get_type()) {
+        case tracker_type::tracker_string:
+            return copy_sort_scalar<tracker_element_string>(in_elem);
+        case tracker_type::tracker_string_pointer:
+            return copy_sort_scalar<tracker_element_string_ptr>(in_elem);
+        case tracker_type::tracker_int8:
+            return copy_sort_scalar<tracker_element_int8>(in_elem);
+        case tracker_type::tracker_uint8:
+            return copy_sort_scalar<tracker_element_uint8>(in_elem);
+        case tracker_type::tracker_int16:
+            return copy_sort_scalar<tracker_element_int16>(in_elem);
+        case tracker_type::tracker_uint16:
+            return copy_sort_scalar<tracker_element_uint16>(in_elem);
+        case tracker_type::tracker_int32:
+            return copy_sort_scalar<tracker_element_int32>(in_elem);
+        case tracker_type::tracker_uint32:
+            return copy_sort_scalar<tracker_element_uint32>(in_elem);
+        case tracker_type::tracker_int64:
+            return copy_sort_scalar<tracker_element_int64>(in_elem);
+        case tracker_type::tracker_uint64:
+            return copy_sort_scalar<tracker_element_uint64>(in_elem);
+        case tracker_type::tracker_float:
+            return copy_sort_scalar<tracker_element_float>(in_elem);
+        case tracker_type::tracker_double:
+            return copy_sort_scalar<tracker_element_double>(in_elem);
+        case tracker_type::tracker_mac_addr:
+            return copy_sort_scalar<tracker_element_mac_addr>(in_elem);
+        case tracker_type::tracker_uuid:
+            return copy_sort_scalar<tracker_element_uuid>(in_elem);
+        case tracker_type::tracker_byte_array:
+            return copy_sort_scalar<tracker_element_byte_array>(in_elem);
+        case tracker_type::tracker_ipv4_addr:
+            return copy_sort_scalar<tracker_element_ipv4_addr>(in_elem);
+        case tracker_type::tracker_atomic_uint64:
+            return copy_sort_scalar<tracker_element_atomic_uint64>(in_elem);
+        default:
+            // Containers never compare as less than one another, so their contents
+            // are never read by the sort
+            return in_elem;
+    }
+}
+
 void device_tracker_view::device_endpoint_handler(std::shared_ptr<kis_net_beast_httpd_connection> con) {
     std::ostream os(&con->response_stream());
 
-    // Summarization vector based on simplification part of shared data
-    auto summary_vec = std::vector<SharedElementSummary>{};
+    // Compiled field summarization plan, shared with other requests for the same fields
+    shared_summary_plan summary_plan = std::make_shared<tracker_element_summary_plan>();
 
     // Rename cache generated by summarization
     auto rename_map = Globalreg::new_from_pool<tracker_element_serializer::rename_map>();
@@ -545,19 +1395,7 @@ void device_tracker_view::device_endpoint_handler(std::shared_ptr<kis_net_beast_
     try {
         // If the json has a 'fields' record, derive the fields simplification
         auto fields = con->json().value("fields", nlohmann::json::array_t{});
-
-        for (const auto& i : fields) {
-            if (i.is_string()) {
-                summary_vec.push_back(std::make_shared<tracker_element_summary>(i.get<std::string>()));
-            } else if (i.is_array()) {
-                if (i.size() != 2)
-                    throw std::runtime_error("Invalid field map, expected [field, rename]");
-
-                summary_vec.push_back(std::make_shared<tracker_element_summary>(i[0].get<std::string>(), i[1].get<std::string>()));
-            } else {
-                throw std::runtime_error("Invalid field map, exected field or [field, rename]");
-            }
-        }
+        summary_plan = Globalreg::globalreg->entrytracker->fetch_summary_plan(fields);
 
         // Capture timestamp and negative-offset timestamp
         uint64_t raw_ts = con->json().value("last_time", 0);
@@ -638,8 +1476,7 @@ void device_tracker_view::device_endpoint_handler(std::shared_ptr<kis_net_beast_
 
             // Search every field we return
             if (search_term.length() != 0)
-                for (const auto& svi : summary_vec)
-                    search_paths.push_back(svi->resolved_path);
+                search_paths = summary_plan->search_paths;
 
             // We only allow ordering by a single column, we don't do sub-ordering;
             // look for that single column
@@ -661,12 +1498,12 @@ void device_tracker_view::device_endpoint_handler(std::shared_ptr<kis_net_beast_
                     if (column_index[0].is_array()) {
                         // We only allow the first field, but make sure we're not a nested array
                         if (column_index[0].size() > 0) {
-                            order_field = tracker_element_summary(column_index[0][0].get<std::string>()).resolved_path;
+                            order_field = Globalreg::globalreg->entrytracker->fetch_resolved_path(column_index[0][0].get<std::string>());
                         }
                     } else {
                         // Otherwise get the first array
                         if (column_index.size() >= 1) {
-                            order_field = tracker_element_summary(column_index[0].get<std::string>()).resolved_path;
+                            order_field = Globalreg::globalreg->entrytracker->fetch_resolved_path(column_index[0].get<std::string>());
                         }
                     }
                 }
@@ -696,7 +1533,7 @@ void device_tracker_view::device_endpoint_handler(std::shared_ptr<kis_net_beast_
             // Otherwise handle generic sort options
             auto sort_k = con->http_variables().find("sort");
             if (sort_k != con->http_variables().end()) {
-                order_field = tracker_element_summary(sort_k->second).resolved_path;
+                order_field = Globalreg::globalreg->entrytracker->fetch_resolved_path(sort_k->second);
 
                 auto dir_k = con->http_variables().find("sort_dir");
                 if (dir_k != con->http_variables().end() && dir_k->second == "asc")
@@ -711,8 +1548,7 @@ void device_tracker_view::device_endpoint_handler(std::shared_ptr<kis_net_beast_
 
             // Search every field we return
             if (search_term.length() != 0)
-                for (const auto& svi : summary_vec)
-                    search_paths.push_back(svi->resolved_path);
+                search_paths = summary_plan->search_paths;
 
         }
     } catch (const std::exception& e) {
@@ -724,99 +1560,166 @@ void device_tracker_view::device_endpoint_handler(std::shared_ptr<kis_net_beast_
     // Next vector we do work on
     auto next_work_vec = std::make_shared<tracker_element_vector>();
 
-    // Copy the entire vector list, under lock, to the next work vector; this makes it an independent copy
-    // we can sort and manipulate
-    next_work_vec->set(device_list->begin(), device_list->end());
-    total_sz_elem->set(next_work_vec->size());
-
-    // If we have a time filter, apply that first, it's the fastest.
-    if (timestamp_min > 0) {
-        auto worker =
-            device_tracker_view_function_worker([timestamp_min] (std::shared_ptr<kis_tracked_device_base> dev) -> bool {
-                if (dev->get_last_time() < timestamp_min)
-                    return false;
-                return true;
-            });
+    // Sorted requests without other filters are served from the sorted index for the field,
+    // which only has to be walked to the requested page
+    bool indexed = false;
 
-        // Do the work and copy the vector
-        auto ts_vec = do_readonly_device_work(worker, next_work_vec);
-        next_work_vec->set(ts_vec->begin(), ts_vec->end());
-    }
+    if (order_field.size() > 0 && timestamp_min == 0 && search_term.length() == 0 && regex.is_null()) {
+        kis_lock_guard<kis_mutex> lk(sort_mutex, "device_tracker_view device_endpoint_handler");
+
+        auto sort_index = refresh_sort_index_nr(order_field);
+
+        if (sort_index != nullptr) {
+            indexed = true;
 
-    // Apply a string filter
-    if (search_term.length() > 0 && search_paths.size() > 0) {
-        auto worker =
-            device_tracker_view_icasestringmatch_worker(search_term, search_paths);
-        auto s_vec = do_readonly_device_work(worker, next_work_vec);
-        next_work_vec->set(s_vec->begin(), s_vec->end());
+            total_sz_elem->set(sort_index->size());
+            filtered_sz_elem->set(sort_index->size());
+
+            if (in_window_len > 0)
+                max_page_elem->set(ceil(((float) sort_index->size()) / in_window_len));
+
+            if (in_window_start >= sort_index->size())
+                in_window_start = 0;
+
+            sort_index->window(in_window_start, in_window_len, in_order_direction == 0, next_work_vec);
+        }
     }
 
-    // Apply a regex filter
-    if (!regex.is_null()) {
-        try {
+    tracker_element_vector::iterator si;
+    tracker_element_vector::iterator ei;
+
+    if (indexed) {
+        start_elem->set(in_window_start);
+
+        si = next_work_vec->begin();
+        ei = next_work_vec->end();
+
+        length_elem->set(ei - si);
+    } else {
+        if (timestamp_min > 0) {
+            // If we have a time filter, pull only the recent devices from the activity index
+            // instead of copying the whole list
+            {
+                kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view device_endpoint_handler");
+                total_sz_elem->set(device_list->size());
+            }
+
+            next_work_vec = fetch_devices_since(timestamp_min - 1);
+        } else {
+            std::shared_ptr<tracker_element_vector> candidate_vec;
+
+            // Searches start from the devices the search indexes say could match; the string
+            // filter below still checks each of them
+            if (search_term.length() > 0 && search_paths.size() > 0 &&
+                    devicetracker->get_view_search_index()) {
+                kis_lock_guard<kis_mutex> lk(sort_mutex, "device_tracker_view device_endpoint_handler");
+                candidate_vec = search_candidates_nr(search_term, search_paths);
+            }
+
+            if (candidate_vec != nullptr) {
+                {
+                    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view device_endpoint_handler");
+                    total_sz_elem->set(device_list->size());
+                }
+
+                next_work_vec = candidate_vec;
+            } else {
+                // Copy the entire vector list, under lock, to the next work vector; this makes it an
+                // independent copy we can sort and manipulate
+                {
+                    kis_lock_guard<kis_mutex> lk(view_mutex, "device_tracker_view device_endpoint_handler");
+                    next_work_vec->set(device_list->begin(), device_list->end());
+                }
+                total_sz_elem->set(next_work_vec->size());
+            }
+        }
+
+        // Apply a string filter
+        if (search_term.length() > 0 && search_paths.size() > 0) {
             auto worker =
-                device_tracker_view_regex_worker(regex);
-            auto r_vec = do_readonly_device_work(worker, next_work_vec);
-            next_work_vec = r_vec;
-            // next_work_vec->set(r_vec->begin(), r_vec->end());
-        } catch (const std::exception& e) {
-            con->set_status(400);
-            os << "Invalid regex: " << e.what() << "\n";
-            return;
+                device_tracker_view_icasestringmatch_worker(search_term, search_paths);
+            auto s_vec = do_readonly_device_work(worker, next_work_vec);
+            next_work_vec->set(s_vec->begin(), s_vec->end());
+        }
+
+        // Apply a regex filter
+        if (!regex.is_null()) {
+            try {
+                auto worker =
+                    device_tracker_view_regex_worker(regex);
+                auto r_vec = do_readonly_device_work(worker, next_work_vec);
+                next_work_vec = r_vec;
+                // next_work_vec->set(r_vec->begin(), r_vec->end());
+            } catch (const std::exception& e) {
+                con->set_status(400);
+                os << "Invalid regex: " << e.what() << "\n";
+                return;
+            }
         }
-    }
 
-    // Apply the filtered length
-    filtered_sz_elem->set(next_work_vec->size());
+        // Apply the filtered length
+        filtered_sz_elem->set(next_work_vec->size());
 
-    if (in_window_len > 0) {
-        max_page_elem->set(ceil(((float) next_work_vec->size()) / in_window_len));
-    }
+        if (in_window_len > 0) {
+            max_page_elem->set(ceil(((float) next_work_vec->size()) / in_window_len));
+        }
 
-    // Slice from the beginning of the list
-    if (in_window_start >= next_work_vec->size())
-        in_window_start = 0;
+        // Slice from the beginning of the list
+        if (in_window_start >= next_work_vec->size())
+            in_window_start = 0;
 
-    // Update the start
-    start_elem->set(in_window_start);
+        // Update the start
+        start_elem->set(in_window_start);
 
-    tracker_element_vector::iterator si = std::next(next_work_vec->begin(), in_window_start);
-    tracker_element_vector::iterator ei;
+        si = std::next(next_work_vec->begin(), in_window_start);
 
-    if (in_window_len + in_window_start >= next_work_vec->size() || in_window_len == 0)
-        ei = next_work_vec->end();
-    else
-        ei = std::next(next_work_vec->begin(), in_window_start + in_window_len);
+        if (in_window_len + in_window_start >= next_work_vec->size() || in_window_len == 0)
+            ei = next_work_vec->end();
+        else
+            ei = std::next(next_work_vec->begin(), in_window_start + in_window_len);
 
-    // Update the end
-    length_elem->set(ei - si);
+        // Update the end
+        length_elem->set(ei - si);
 
-    // if (in_order_column_num.length() && order_field.size() > 0) {
+        // if (in_order_column_num.length() && order_field.size() > 0) {
 
-    if (order_field.size() > 0) {
-        std::stable_sort(
+        if (order_field.size() > 0) {
+            // Copy the sort field of each device while only that device is locked, then sort
+            // the copies without holding any devices
+            std::vector<std::pair<shared_tracker_element, shared_tracker_element>> keyed_vec;
+            keyed_vec.reserve(next_work_vec->size());
+
+            for (const auto& d : *next_work_vec) {
+                auto dev = std::static_pointer_cast<kis_tracked_device_base>(d);
+                device_lock_scope dlk(devicetracker.get(), dev->get_macaddr());
+                keyed_vec.emplace_back(copy_sort_element(get_tracker_element_path(order_field, d)), d);
+            }
+
+            std::stable_sort(
 #if defined(HAVE_CPP17_PARALLEL)
-            std::execution::par_unseq,
+                std::execution::par_unseq,
 #endif
-            next_work_vec->begin(), next_work_vec->end(),
-                [&](shared_tracker_element a, shared_tracker_element b) -> bool {
-                shared_tracker_element fa;
-                shared_tracker_element fb;
+                keyed_vec.begin(), keyed_vec.end(),
+                    [&](const auto& a, const auto& b) -> bool {
+                    const auto& fa = a.first;
+                    const auto& fb = b.first;
 
-                fa = get_tracker_element_path(order_field, a);
-                fb = get_tracker_element_path(order_field, b);
+                    if (fa == nullptr)
+                        return in_order_direction == 0;
 
-                if (fa == nullptr)
-                    return in_order_direction == 0;
+                    if (fb == nullptr)
+                        return in_order_direction != 0;
 
-                if (fb == nullptr)
-                    return in_order_direction != 0;
+                    if (in_order_direction == 0)
+                        return fast_sort_tracker_element_less(fa, fb);
 
-                if (in_order_direction == 0)
-                    return fast_sort_tracker_element_less(fa, fb);
+                    return fast_sort_tracker_element_less(fb, fa);
+                });
 
-                return fast_sort_tracker_element_less(fb, fa);
-            });
+            auto wi = next_work_vec->begin();
+            for (const auto& k : keyed_vec)
+                *(wi++) = k.second;
+        }
     }
 
     // Summarize into the output element
@@ -824,7 +1727,7 @@ void device_tracker_view::device_endpoint_handler(std::shared_ptr<kis_net_beast_
 
     for (auto i = si; i != ei; ++i) {
         final_devices_vec->push_back(*i);
-        output_devices_elem->push_back(summarize_tracker_element(*i, summary_vec, rename_map));
+        output_devices_elem->push_back(summarize_tracker_element(*i, summary_plan->summary_vec, rename_map));
     }
 
 
@@ -21,8 +21,15 @@
 
 #include "config.h"
 
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "uuid.h"
 #include "trackedelement.h"
@@ -30,6 +37,45 @@
 #include "devicetracker_component.h"
 #include "devicetracker_view_workers.h"
 #include "kis_net_beast_httpd.h"
+#include "unordered_dense.h"
+
+// Maximum number of sorted indexes a view keeps, and how long a sorted or search index is
+// kept without being used
+#define VIEW_SORT_MAX_INDEXES   8
+#define VIEW_SORT_INDEX_IDLE    600
+
+// Maximum number of searched fields a view indexes; searches over more fields than this
+// check every device
+#define VIEW_SEARCH_MAX_INDEXES 32
+
+// Devices seen up to this many seconds before the last index refresh are re-examined, to
+// cover packets which arrive slightly out of order
+#define VIEW_SORT_RESYNC_SLACK  5
+
+// Smallest number of devices given to each thread when a read-only worker is split
+// across threads
+#define VIEW_WORKER_MIN_CHUNK   4096
+
+// Persistent threads which read-only view workers are split across.  One pool is owned by
+// the device tracker and shared by every view, so concurrent requests queue for the same
+// threads instead of each starting their own.
+class device_tracker_view_pool {
+public:
+    device_tracker_view_pool(unsigned int n_threads);
+    ~device_tracker_view_pool();
+
+    void post(std::function<void ()> job);
+
+protected:
+    void worker();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void ()>> jobs;
+    bool shutdown;
+
+    std::vector<std::thread> threads;
+};
 
 // Common view holder mechanism which handles view endpoints, view filtering, and so on.
 //
@@ -52,6 +98,124 @@
 class kis_tracked_device;
 class device_tracker_view;
 
+// Sorted index over one field of the devices in a view.  Views build an index the first
+// time a client sorts by a field and keep it current as devices are seen and as the view
+// membership changes, so a sorted page only costs a walk to the page instead of sorting
+// every device in the view.
+//
+// Entries are held in small sorted blocks; inserting or removing a device only shifts
+// the entries in one block, and finding the Nth entry walks the block sizes.
+class device_tracker_view_sort_index {
+public:
+    // A copy of the field value, so the device can be found and moved when it changes
+    struct sort_key {
+        // Missing fields sort before everything else, as they do when sorting directly
+        enum class key_type : uint8_t {
+            missing_key, uint_key, int_key, double_key, string_key
+        };
+
+        key_type type = key_type::missing_key;
+        uint64_t uint_v = 0;
+        int64_t int_v = 0;
+        double double_v = 0;
+        std::string string_v;
+    };
+
+    device_tracker_view_sort_index(const std::vector<int>& in_path) :
+        last_used{0},
+        path{in_path},
+        count{0} { }
+
+    // Extract the sort key for a device, which must be locked; returns false if the field
+    // is a type which can't be indexed
+    bool make_key(const std::shared_ptr<kis_tracked_device_base>& in_dev, sort_key& ret_key) const;
+
+    // Insert a device, or move it if it's already indexed
+    void update(const std::shared_ptr<kis_tracked_device_base>& in_dev, sort_key&& in_key);
+    void remove(uint64_t in_id);
+
+    size_t size() const {
+        return count;
+    }
+
+    // Copy up to in_len devices starting at in_start, in ascending or descending order; a
+    // length of 0 copies everything after the start
+    void window(size_t in_start, size_t in_len, bool in_ascending,
+            const std::shared_ptr<tracker_element_vector>& ret) const;
+
+    time_t last_used;
+
+protected:
+    struct entry {
+        sort_key key;
+        uint64_t id;
+        std::shared_ptr<kis_tracked_device_base> device;
+    };
+
+    static bool key_less(const sort_key& a, uint64_t a_id, const sort_key& b, uint64_t b_id);
+
+    // Block which holds, or would hold, a key
+    size_t find_block(const sort_key& in_key, uint64_t in_id) const;
+
+    std::vector<int> path;
+    std::vector<std::vector<entry>> blocks;
+    ankerl::unordered_dense::map<uint64_t, sort_key> keys;
+    size_t count;
+};
+
+// Trigram index over the searchable text of one field of the devices in a view.  The text
+// is extracted the same way the case-insensitive string match worker sees it, so looking up
+// a search term returns every device which could match; the worker then checks only those
+// devices instead of every device in the view.
+//
+// MAC address fields are matched by their raw bytes, as partial MAC searches are.
+class device_tracker_view_search_index {
+public:
+    device_tracker_view_search_index(const std::vector<int>& in_path) :
+        last_used{0},
+        path{in_path} { }
+
+    // Index the current text of a device, which must be locked
+    void update(const std::shared_ptr<kis_tracked_device_base>& in_dev);
+    void remove(uint64_t in_id);
+
+    // Turn a search term into the n-grams to look up.  Returns false if the term is too short
+    // to be found through the index.
+    static bool query_grams(const std::string& in_query, std::vector<uint32_t>& ret_text_grams,
+            std::vector<uint32_t>& ret_mac_grams);
+
+    // Add every device which contains all the text n-grams, or all the MAC n-grams
+    void candidates(const std::vector<uint32_t>& in_text_grams, const std::vector<uint32_t>& in_mac_grams,
+            ankerl::unordered_dense::map<uint64_t, std::shared_ptr<kis_tracked_device_base>>& ret) const;
+
+    time_t last_used;
+
+protected:
+    struct entry {
+        // Case-folded text and raw MAC bytes
+        std::string text;
+        std::string mac;
+        std::shared_ptr<kis_tracked_device_base> device;
+    };
+
+    // N-grams are packed with the kind of text in the top byte, so text and MAC bytes never
+    // collide
+    enum gram_kind : uint32_t {
+        text_trigram = 0, mac_trigram = 1, mac_bigram = 2
+    };
+
+    static void make_grams(const std::string& in_str, size_t in_n, gram_kind in_kind,
+            std::vector<uint32_t>& ret);
+    static void entry_grams(const entry& in_entry, std::vector<uint32_t>& ret);
+
+    void match_grams(const std::vector<uint32_t>& in_grams,
+            ankerl::unordered_dense::map<uint64_t, std::shared_ptr<kis_tracked_device_base>>& ret) const;
+
+    std::vector<int> path;
+    ankerl::unordered_dense::map<uint64_t, entry> entries;
+    ankerl::unordered_dense::map<uint32_t, ankerl::unordered_dense::set<uint64_t>> postings;
+};
+
 class device_tracker_view : public tracker_component {
 public:
     // The new device callback is called whenever a new device is created by the devicetracker;
@@ -97,7 +261,9 @@ public:
     // must not call this on a vector which can be altered in another thread.
     virtual std::shared_ptr<tracker_element_vector> do_device_work(device_tracker_view_worker& worker,
             std::shared_ptr<tracker_element_vector> vec);
-    // Do read-only work; this MAY NOT modify devices in the worker!
+    // Do read-only work; this MAY NOT modify devices in the worker!  Workers which are
+    // parallel_safe() are split across the view worker threads for large lists, and the
+    // matches are returned in the original order.
     virtual std::shared_ptr<tracker_element_vector> do_readonly_device_work(device_tracker_view_worker& worker,
             std::shared_ptr<tracker_element_vector> vec);
 
@@ -115,6 +281,10 @@ public:
 	// Look for an existing device record under read-only shared lock
     std::shared_ptr<kis_tracked_device_base> fetch_device(device_key in_key);
 
+    // Devices in this view seen after a given time; this uses the device tracker activity
+    // index and only looks at recently seen devices
+    std::shared_ptr<tracker_element_vector> fetch_devices_since(time_t in_ts);
+
     // Set view to non-indexed so the UI knows not to show it in the primary list
     virtual void set_indexed(bool indexed) {
         view_indexed->set(indexed);
@@ -148,6 +318,45 @@ protected:
     std::shared_ptr<tracker_element_vector> device_list;
     // Map of device presence in our list for fast reference during updates
     std::unordered_map<device_key, bool> device_presence_map;
+    // Protects the device list and presence map; devices must never be locked while holding
+    // this, copy the list first
+    kis_mutex view_mutex;
+
+    // Sorted indexes by field path, built when clients sort, and search indexes, built when
+    // clients search.  sort_mutex is held while refreshing the indexes, which locks devices;
+    // it must never be taken while holding view_mutex or a device.
+    kis_mutex sort_mutex;
+    std::map<std::vector<int>, std::shared_ptr<device_tracker_view_sort_index>> sort_index_map;
+    std::map<std::vector<int>, std::shared_ptr<device_tracker_view_search_index>> search_index_map;
+    // Paths we've found can't be indexed, so we don't retry them every request
+    std::set<std::vector<int>> sort_unindexable_set;
+    // Last time seen of the newest device applied to the indexes
+    time_t sort_synced_time;
+
+    // Membership changes since the indexes were refreshed, where a null device is a removal;
+    // only recorded while indexes exist, and protected by view_mutex
+    bool sort_tracking;
+    ankerl::unordered_dense::map<uint64_t, std::shared_ptr<kis_tracked_device_base>> sort_pending_map;
+
+    // Record a membership change or update for the indexes; must hold view_mutex
+    void sort_pending_nr(const std::shared_ptr<kis_tracked_device_base>& in_dev, bool in_present);
+
+    // Drop idle indexes and apply every change since the last refresh to the rest, or start
+    // recording changes if there are no indexes; must hold sort_mutex
+    void refresh_indexes_nr(time_t in_now);
+
+    // Stop recording changes once the last index is gone; must hold sort_mutex
+    void check_index_tracking_nr();
+
+    // Bring all the indexes up to date and find or build the index for a path; must hold
+    // sort_mutex.  Returns nullptr if the path can't be indexed.
+    std::shared_ptr<device_tracker_view_sort_index> refresh_sort_index_nr(const std::vector<int>& in_path);
+
+    // Bring all the indexes up to date and find the devices which could match a search over
+    // the paths, building search indexes as needed; must hold sort_mutex.  Returns nullptr if
+    // the search can't be served from the indexes.
+    std::shared_ptr<tracker_element_vector> search_candidates_nr(const std::string& in_query,
+            const std::vector<std::vector<int>>& in_paths);
 
     void device_endpoint_handler(std::shared_ptr<kis_net_beast_httpd_connection> con);
     std::shared_ptr<tracker_element> device_time_endpoint(std::shared_ptr<kis_net_beast_httpd_connection> con);
@@ -22,6 +22,9 @@
 #include "devicetracker_component.h"
 #include "util.h"
 
+#include <list>
+#include <unordered_map>
+
 #include "kis_mutex.h"
 #include "kismet_algorithm.h"
 
@@ -54,7 +57,11 @@ device_tracker_view_regex_worker::pcre_filter::pcre_filter(const std::string& in
         throw std::runtime_error(e);
     }
 
+#ifdef PCRE_STUDY_JIT_COMPILE
+    study = pcre_study(re, PCRE_STUDY_JIT_COMPILE, &study_error);
+#else
     study = pcre_study(re, 0, &study_error);
+#endif
     if (study_error != nullptr) {
         pcre_free(re);
         
@@ -79,7 +86,6 @@ device_tracker_view_regex_worker::pcre_filter::pcre_filter(const std::string& in
     int errornumber;
 
     re = NULL;
-    match_data = NULL;
 
     target = in_target;
 
@@ -95,16 +101,25 @@ device_tracker_view_regex_worker::pcre_filter::pcre_filter(const std::string& in
         throw std::runtime_error(e);
     }
 
-	match_data = pcre2_match_data_create_from_pattern(re, NULL);
+    // JIT compiling is much faster to match against, but isn't available on every platform;
+    // if it fails, matching falls back to the interpreter
+    pcre2_jit_compile(re, PCRE2_JIT_COMPLETE);
 }
 
 device_tracker_view_regex_worker::pcre_filter::~pcre_filter() {
-    if (match_data != nullptr)
-        pcre2_match_data_free(match_data);
     if (re != nullptr)
         pcre2_code_free(re);
 }
 
+// Match data can't be shared between threads matching in parallel, so each thread keeps
+// its own.  We only care if a filter matched, so a single ovector pair covers any pattern.
+static pcre2_match_data *regex_worker_match_data() {
+    thread_local std::unique_ptr<pcre2_match_data, decltype(&pcre2_match_data_free)>
+        match_data{pcre2_match_data_create(1, NULL), &pcre2_match_data_free};
+
+    return match_data.get();
+}
+
 #endif
 
 device_tracker_view_regex_worker::device_tracker_view_regex_worker(const std::vector<std::shared_ptr<device_tracker_view_regex_worker::pcre_filter>>& in_filter_vec) {
@@ -117,6 +132,8 @@ device_tracker_view_regex_worker::device_tracker_view_regex_worker(const std::ve
 
 device_tracker_view_regex_worker::device_tracker_view_regex_worker(nlohmann::json& json) {
 #if defined(HAVE_LIBPCRE1) || defined(HAVE_LIBPCRE2)
+    std::vector<std::pair<std::string, std::string>> str_pcre_vec;
+
     for (const auto& i : json) {
         if (!i.is_array())
             throw std::runtime_error("expected array of [field, regex] pairs for regex filter");
@@ -124,11 +141,10 @@ device_tracker_view_regex_worker::device_tracker_view_regex_worker(nlohmann::jso
         if (i.size() != 2)
             throw std::runtime_error("expected array of [field, regex] pairs for regex filter");
 
-        auto worker_filter = 
-            std::make_shared<device_tracker_view_regex_worker::pcre_filter>(i[0].get<std::string>(), i[1].get<std::string>());
-
-        filter_vec.push_back(worker_filter);
+        str_pcre_vec.push_back(std::make_pair(i[0].get<std::string>(), i[1].get<std::string>()));
     }
+
+    add_filters(str_pcre_vec);
 #else
     throw std::runtime_error("Kismet was not compiled with PCRE support");
 #endif
@@ -136,18 +152,163 @@ device_tracker_view_regex_worker::device_tracker_view_regex_worker(nlohmann::jso
 
 device_tracker_view_regex_worker::device_tracker_view_regex_worker(const std::vector<std::pair<std::string, std::string>>& str_pcre_vec) {
 #if defined(HAVE_LIBPCRE1) || defined(HAVE_LIBPCRE2)
+    add_filters(str_pcre_vec);
+#else
+    throw std::runtime_error("Kismet was not compiled with PCRE support");
+#endif
+}
+
+#if defined(HAVE_LIBPCRE1) || defined(HAVE_LIBPCRE2)
+std::shared_ptr<device_tracker_view_regex_worker::pcre_filter>
+device_tracker_view_regex_worker::fetch_filter(const std::string& in_target, const std::string& in_regex) {
+    using filter_lru = std::list<std::string>;
+
+    struct filter_cache {
+        filter_cache() {
+            mutex.set_name("device_tracker_view_regex_worker cache");
+        }
+
+        kis_mutex mutex;
+        filter_lru lru;
+        std::unordered_map<std::string, std::pair<filter_lru::iterator, std::shared_ptr<pcre_filter>>> filters;
+    };
+
+    static filter_cache cache;
+
+    auto key = in_target + '\0' + in_regex;
+
+    {
+        kis_lock_guard<kis_mutex> lk(cache.mutex, "device_tracker_view_regex_worker fetch_filter");
+
+        auto fi = cache.filters.find(key);
+
+        if (fi != cache.filters.end()) {
+            cache.lru.splice(cache.lru.begin(), cache.lru, fi->second.first);
+            return fi->second.second;
+        }
+    }
+
+    // Compile outside of the lock; if two requests compile the same filter at once, the
+    // second simply replaces the first
+    auto filter = std::make_shared<pcre_filter>(in_target, in_regex);
+
+    kis_lock_guard<kis_mutex> lk(cache.mutex, "device_tracker_view_regex_worker fetch_filter");
+
+    auto fi = cache.filters.find(key);
+
+    if (fi != cache.filters.end()) {
+        cache.lru.splice(cache.lru.begin(), cache.lru, fi->second.first);
+        fi->second.second = filter;
+        return filter;
+    }
+
+    while (cache.filters.size() >= VIEW_REGEX_CACHE_MAX) {
+        cache.filters.erase(cache.lru.back());
+        cache.lru.pop_back();
+    }
+
+    cache.lru.push_front(key);
+    cache.filters[key] = std::make_pair(cache.lru.begin(), filter);
+
+    return filter;
+}
+
+void device_tracker_view_regex_worker::add_filters(const std::vector<std::pair<std::string, std::string>>& str_pcre_vec) {
+    // Group the regexes by field, keeping the order fields were first given in
+    std::vector<std::pair<std::string, std::vector<std::string>>> field_vec;
+
     for (const auto& i : str_pcre_vec) {
-        auto field = std::get<0>(i);
-        auto regex = std::get<1>(i);
+        auto fi = std::find_if(field_vec.begin(), field_vec.end(),
+                [&i](const std::pair<std::string, std::vector<std::string>>& f) -> bool {
+                    return f.first == i.first;
+                });
+
+        if (fi == field_vec.end())
+            field_vec.push_back(std::make_pair(i.first, std::vector<std::string>{i.second}));
+        else
+            fi->second.push_back(i.second);
+    }
+
+    // Regexes which refer to their own groups by number or name, or which can swallow the
+    // end of the wrapping group (quoting, extended mode comments, verbs), can't be wrapped
+    // in an alternation without changing what they match
+    auto combinable = [](const std::string& re) -> bool {
+        for (size_t p = 0; p + 1 < re.length(); p++) {
+            if (re[p] == '\\') {
+                auto n = re[p + 1];
+                if (std::isdigit(n) || n == 'g' || n == 'k' || n == 'Q')
+                    return false;
+                p++;
+            } else if (re[p] == '(' && re[p + 1] == '*') {
+                return false;
+            } else if (re[p] == '(' && re[p + 1] == '?' && p + 2 < re.length()) {
+                auto n = re[p + 2];
+                if (std::isdigit(n) || n == 'R' || n == 'P' || n == '&' || n == '|' ||
+                        n == '+' || n == '-' || n == '\'')
+                    return false;
+
+                // Named groups, but not lookbehinds
+                if (n == '<' && p + 3 < re.length() && re[p + 3] != '=' && re[p + 3] != '!')
+                    return false;
+
+                // Option settings which turn on extended mode
+                for (auto o = p + 2; o < re.length() && (std::isalpha(re[o]) || re[o] == '^'); o++) {
+                    if (re[o] == 'x')
+                        return false;
+                }
+            }
+        }
+
+        return true;
+    };
+
+    for (const auto& f : field_vec) {
+        // Every regex is compiled on its own first, so a malformed regex is rejected rather
+        // than being able to change the meaning of the combined form; compiled filters are
+        // cached, so this is cheap for repeated requests
+        std::vector<std::pair<std::string, std::shared_ptr<pcre_filter>>> compiled;
 
-        auto worker_filter = std::make_shared<device_tracker_view_regex_worker::pcre_filter>(field, regex);
+        for (const auto& re : f.second)
+            compiled.push_back(std::make_pair(re, fetch_filter(f.first, re)));
 
-        filter_vec.push_back(worker_filter);
+        std::string combined;
+        size_t n_combined = 0;
+
+        if (compiled.size() > 1) {
+            for (const auto& c : compiled) {
+                if (!combinable(c.first))
+                    continue;
+
+                if (n_combined > 0)
+                    combined += "|";
+
+                combined += "(?:" + c.first + ")";
+                n_combined++;
+            }
+        }
+
+        // Nothing to combine with; use the filters as compiled
+        if (n_combined < 2) {
+            for (const auto& c : compiled)
+                filter_vec.push_back(c.second);
+            continue;
+        }
+
+        try {
+            filter_vec.push_back(fetch_filter(f.first, combined));
+        } catch (const std::runtime_error&) {
+            // Fall back to the individual filters if the combination can't be compiled
+            for (const auto& c : compiled)
+                if (combinable(c.first))
+                    filter_vec.push_back(c.second);
+        }
+
+        for (const auto& c : compiled)
+            if (!combinable(c.first))
+                filter_vec.push_back(c.second);
     }
-#else
-    throw std::runtime_error("Kismet was not compiled with PCRE support");
-#endif
 }
+#endif
 
 bool device_tracker_view_regex_worker::match_device(std::shared_ptr<kis_tracked_device_base> device) {
 #if defined(HAVE_LIBPCRE1) || defined(HAVE_LIBPCRE2)
@@ -189,7 +350,7 @@ bool device_tracker_view_regex_worker::match_device(std::shared_ptr<kis_tracked_
 
 #else
             rc = pcre2_match(i->re, (PCRE2_SPTR8) val.c_str(), val.length(), 
-                    0, 0, i->match_data, NULL);
+                    0, 0, regex_worker_match_data(), NULL);
 #endif
 
             // Stop matching as soon as we find a hit
@@ -38,6 +38,9 @@
 #include <pcre2.h>
 #endif
 
+// Maximum number of compiled regex filters kept for reuse between requests
+#define VIEW_REGEX_CACHE_MAX    256
+
 class device_tracker_view_worker {
 public:
     device_tracker_view_worker() {
@@ -52,6 +55,13 @@ public:
 
     virtual void finalize() { }
 
+    // Workers which only read the device and keep no state between matches may be run
+    // over chunks of the device list in parallel; match_device must be safe to call from
+    // multiple threads at once.
+    virtual bool parallel_safe() const {
+        return false;
+    }
+
 protected:
     friend class device_tracker_view;
 
@@ -97,7 +107,6 @@ public:
         std::string target;
 
         pcre2_code *re;
-        pcre2_match_data *match_data;
 #endif
     };
 
@@ -122,7 +131,20 @@ public:
 
     virtual bool match_device(std::shared_ptr<kis_tracked_device_base> device) override;
 
+    virtual bool parallel_safe() const override {
+        return true;
+    }
+
 protected:
+    // Combine the regexes for each field into a single alternation, so each field is only
+    // scanned once, and fetch the compiled filters
+    void add_filters(const std::vector<std::pair<std::string, std::string>>& str_pcre_vec);
+
+    // Fetch a compiled filter from the cache shared by every regex worker, compiling it if
+    // needed.  std::runtime_error may be thrown if there is a parsing failure
+    static std::shared_ptr<pcre_filter> fetch_filter(const std::string& in_target,
+            const std::string& in_regex);
+
     std::vector<std::shared_ptr<device_tracker_view_regex_worker::pcre_filter>> filter_vec;
 
 };
@@ -146,6 +168,10 @@ public:
 
     virtual bool match_device(std::shared_ptr<kis_tracked_device_base> device) override;
 
+    virtual bool parallel_safe() const override {
+        return true;
+    }
+
 protected:
     std::string query;
     std::vector<std::vector<int>> fieldpaths;
@@ -173,6 +199,10 @@ public:
 
     virtual bool match_device(std::shared_ptr<kis_tracked_device_base> device) override;
 
+    virtual bool parallel_safe() const override {
+        return true;
+    }
+
 protected:
     std::string query;
     std::vector<std::vector<int>> fieldpaths;
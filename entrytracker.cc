@@ -16,6 +16,7 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#include <algorithm>
 #include <string>
 #include <sstream>
 
@@ -27,6 +28,7 @@
 
 entry_tracker::entry_tracker() {
     entry_mutex.set_name("entry_tracker");
+    plan_mutex.set_name("entry_tracker_plan");
     // serializer_mutex.set_name("entry_tracker_serializer");
 
     next_field_num = 1;
@@ -318,6 +320,81 @@ int entry_tracker::serialize_with_json_summary(const std::string& type, std::ost
     return serialize(type, stream, sumelem, name_map);
 }
 
+shared_summary_plan entry_tracker::fetch_summary_plan(const nlohmann::json& in_fields) {
+    auto spec = in_fields.dump();
+
+    {
+        kis_lock_guard<kis_mutex> lk(plan_mutex, "entry_tracker fetch_summary_plan");
+        auto pi = summary_plan_map.find(spec);
+        if (pi != summary_plan_map.end())
+            return pi->second;
+    }
+
+    auto plan = std::make_shared<tracker_element_summary_plan>();
+    bool resolved = true;
+
+    if (!in_fields.is_null()) {
+        if (!in_fields.is_array())
+            throw std::runtime_error("Invalid field map, expected array of fields");
+
+        for (const auto& i : in_fields) {
+            SharedElementSummary sum;
+
+            if (i.is_string()) {
+                sum = std::make_shared<tracker_element_summary>(i.get<std::string>());
+            } else if (i.is_array()) {
+                if (i.size() != 2)
+                    throw std::runtime_error("Invalid field map, expected [field, rename]");
+
+                sum = std::make_shared<tracker_element_summary>(i[0].get<std::string>(),
+                        i[1].get<std::string>());
+            } else {
+                throw std::runtime_error("Invalid field map, exected field or [field, rename]");
+            }
+
+            for (auto id : sum->resolved_path)
+                if (id == 0)
+                    resolved = false;
+
+            plan->search_paths.push_back(sum->resolved_path);
+            plan->summary_vec.push_back(sum);
+        }
+    }
+
+    if (resolved) {
+        kis_lock_guard<kis_mutex> lk(plan_mutex, "entry_tracker fetch_summary_plan");
+
+        if (summary_plan_map.size() >= ENTRYTRACKER_PLAN_CACHE_MAX)
+            summary_plan_map.clear();
+
+        summary_plan_map[spec] = plan;
+    }
+
+    return plan;
+}
+
+std::vector<int> entry_tracker::fetch_resolved_path(const std::string& in_path) {
+    {
+        kis_lock_guard<kis_mutex> lk(plan_mutex, "entry_tracker fetch_resolved_path");
+        auto pi = resolved_path_map.find(in_path);
+        if (pi != resolved_path_map.end())
+            return pi->second;
+    }
+
+    auto path = tracker_element_summary(in_path).resolved_path;
+
+    if (std::find(path.begin(), path.end(), 0) == path.end()) {
+        kis_lock_guard<kis_mutex> lk(plan_mutex, "entry_tracker fetch_resolved_path");
+
+        if (resolved_path_map.size() >= ENTRYTRACKER_PLAN_CACHE_MAX)
+            resolved_path_map.clear();
+
+        resolved_path_map[in_path] = path;
+    }
+
+    return path;
+}
+
 void entry_tracker::register_search_xform(uint16_t in_field_id, std::function<void (std::shared_ptr<tracker_element>,
             std::string& mapped_str)> in_xform) {
 
@@ -37,6 +37,10 @@
 
 class kis_net_beast_httpd_connection;
 
+// Maximum number of distinct request plans we cache; clients use a handful of request shapes,
+// so hitting this means something is generating unique requests and the cache is reset
+#define ENTRYTRACKER_PLAN_CACHE_MAX     1024
+
 // Allocate and track named fields and give each one a custom int
 class entry_tracker : public lifetime_global, public deferred_startup {
 public:
@@ -137,6 +141,15 @@ public:
     int serialize_with_json_summary(const std::string& type, std::ostream& stream, shared_tracker_element elem,
             const nlohmann::json& json_summary);
 
+    // Compile a 'fields' request (a list of field paths or [path, rename] pairs) into a summary
+    // plan.  Clients repeat the same few requests constantly, so plans are cached by the
+    // normalized request; plans with fields which don't exist (yet) aren't cached.  Throws
+    // std::runtime_error on an invalid request.
+    shared_summary_plan fetch_summary_plan(const nlohmann::json& in_fields);
+
+    // Resolve a single field path, such as a sort column, through the same cache
+    std::vector<int> fetch_resolved_path(const std::string& in_path);
+
     // Optional per-field-id transforms for search functions, must use the search workers or be called
     // manually
     void register_search_xform(uint16_t in_field_id, std::function<void (std::shared_ptr<tracker_element>,
@@ -168,6 +181,11 @@ protected:
     ankerl::unordered_dense::map<uint16_t, std::shared_ptr<reserved_field> > field_id_map;
     ankerl::unordered_dense::map<std::string, std::shared_ptr<tracker_element_serializer> > serializer_map;
 
+    // Cached summary plans and resolved paths, bounded by ENTRYTRACKER_PLAN_CACHE_MAX
+    kis_mutex plan_mutex;
+    ankerl::unordered_dense::map<std::string, shared_summary_plan> summary_plan_map;
+    ankerl::unordered_dense::map<std::string, std::vector<int>> resolved_path_map;
+
     // Field IDs to optional search xform function
     ankerl::unordered_dense::map<uint16_t, std::function<void (std::shared_ptr<tracker_element>, 
             std::string& mapped_str)>> search_xform_map;
@@ -21,6 +21,7 @@
 
 #include "config.h"
 
+#include <functional>
 #include <sstream>
 #include <string>
 #include <mutex>
@@ -333,6 +334,9 @@ public:
 
         waiting_ = false;
 
+        if (notify_cb_ != nullptr)
+            notify_cb_();
+
         return 1;
     }
 
@@ -380,6 +384,13 @@ public:
         packet_ = true;
     }
 
+    // Callback when data is available or the stream has ended, for consumers which do not
+    // block in wait(); it is called with the buffer locked and must not block
+    void set_notify_cb(std::function<void ()> cb) {
+        const std::lock_guard<std::recursive_mutex> lock(mutex_);
+        notify_cb_ = cb;
+    }
+
     size_t wait() {
         std::unique_lock<std::recursive_mutex> lk(mutex_);
         if (waiting_)
@@ -438,6 +449,8 @@ protected:
 
     std::atomic<bool> packet_;
 
+    std::function<void ()> notify_cb_;
+
 };
 
 
@@ -408,7 +408,7 @@ bool kis_database_logfile::open_log(const std::string& in_template, const std::s
             packetchain->register_handler([](void *auxdata, const std::shared_ptr<kis_packet>& packet) -> int {
 					auto dbl = reinterpret_cast<kis_database_logfile *>(auxdata);
                     return dbl->log_packet(packet.get());
-                }, this, CHAINPOS_LOGGING, -100);
+                }, this, CHAINPOS_LOGGING, -100, "kismetdb logger");
     } else {
         packet_handler_id = -1;
         _MSG_INFO("Packets will not be saved to the Kismet database log.");
@@ -800,19 +800,8 @@ int kis_database_logfile::log_device(const std::shared_ptr<kis_tracked_device_ba
 
     std::stringstream sstr;
 
-    // We don't have to lock because we're called by a device worker, which locks
-
-#if 0
-    {
-        kis_lock_guard<kis_mutex> lg_dl(devicetracker->get_devicelist_mutex(), "database_logfile::log_device");
-        int r = Globalreg::globalreg->entrytracker->serialize("json", sstr, d, nullptr);
-
-        if (r < 0) {
-            _MSG_ERROR("Failure serializing device key {} to the kisdatabaselog", d->get_key());
-            return 0;
-        }
-    }
-#endif
+    // We don't have to lock because we're called with the device shard held, and the
+    // device locks itself during serialization
 
     int r = Globalreg::globalreg->entrytracker->serialize("json", sstr, d, nullptr);
 
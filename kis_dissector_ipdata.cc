@@ -83,15 +83,15 @@ kis_dissector_ip_data::kis_dissector_ip_data() {
     auto packetchain =
         Globalreg::fetch_mandatory_global_as<packet_chain>();
 
-    packetchain->register_handler(&ipdata_packethook, this,
-            CHAINPOS_DATADISSECT, -100);
-
 	pack_comp_basicdata = 
 		packetchain->register_packet_component("BASICDATA");
 
 	pack_comp_datapayload =
 		packetchain->register_packet_component("DATAPAYLOAD");
 
+    packetchain->register_handler(&ipdata_packethook, this,
+            CHAINPOS_DATADISSECT, -100, "ip data dissector", {{}, {pack_comp_datapayload}});
+
     auto alertracker =
         Globalreg::fetch_mandatory_global_as<alert_tracker>();
 
@@ -37,7 +37,7 @@ kis_dlt_handler::kis_dlt_handler() :
         packetchain->register_handler([](void *auxdata, const std::shared_ptr<kis_packet>& p) -> int {
                 auto dlthandler = reinterpret_cast<kis_dlt_handler *>(auxdata);
                 return dlthandler->handle_packet(p);
-            }, this, CHAINPOS_POSTCAP, 0);
+            }, this, CHAINPOS_POSTCAP, 0, "dlt decapsulation");
 
 	pack_comp_linkframe =
 		packetchain->register_packet_component("LINKFRAME");
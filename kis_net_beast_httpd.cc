@@ -18,12 +18,25 @@
 
 #include "kis_net_beast_httpd.h"
 
+#include <cctype>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <limits>
 #include <random>
 
 #include <stdio.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef SYS_LINUX
+#include <sys/sendfile.h>
+#endif
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
 #include "globalregistry.h"
 
 #include "alertracker.h"
@@ -31,6 +44,7 @@
 #include "configfile.h"
 #include "messagebus.h"
 #include "util.h"
+#include "xxhash.h"
 
 const std::string kis_net_beast_httpd::LOGON_ROLE{"admin"};
 const std::string kis_net_beast_httpd::ANY_ROLE{"any"};
@@ -83,11 +97,20 @@ kis_net_beast_httpd::kis_net_beast_httpd(boost::asio::ip::tcp::endpoint& endpoin
     lifetime_global{},
     deferred_startup{},
     running{false},
+    compression_{false},
+    compression_min_size_{0},
+    gzip_level_{Z_DEFAULT_COMPRESSION},
+    zstd_level_{0},
+    static_cache_bytes{0},
+    static_cache_max{0},
+    static_cache_max_file{0},
+    static_max_age{0},
     endpoint{endpoint},
     acceptor{Globalreg::globalreg->io} {
 
     route_mutex.set_name("kis_net_beast_httpd route vector");
     auth_mutex.set_name("kis_net_beast_httpd auth");
+    static_cache_mutex.set_name("kis_net_beast_httpd static cache");
 }
 
 void kis_net_beast_httpd::trigger_deferred_startup() {
@@ -136,6 +159,35 @@ void kis_net_beast_httpd::trigger_deferred_startup() {
     allow_auth_creation = Globalreg::globalreg->kismet_config->fetch_opt_bool("httpd_allow_auth_creation", true);
     allow_auth_view = Globalreg::globalreg->kismet_config->fetch_opt_bool("httpd_allow_auth_view", true);
 
+    compression_ = Globalreg::globalreg->kismet_config->fetch_opt_bool("httpd_compression", true);
+    compression_min_size_ =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<size_t>("httpd_compression_min_size", 1024);
+    gzip_level_ = Globalreg::globalreg->kismet_config->fetch_opt_as<int>("httpd_gzip_level", 6);
+    zstd_level_ = Globalreg::globalreg->kismet_config->fetch_opt_as<int>("httpd_zstd_level", 3);
+
+    if (gzip_level_ < 1 || gzip_level_ > 9) {
+        auto clamped = std::max(1, std::min(gzip_level_, 9));
+        _MSG_ERROR("(HTTPD) Invalid httpd_gzip_level {}, expected 1-9; using {}",
+                gzip_level_, clamped);
+        gzip_level_ = clamped;
+    }
+
+#ifdef HAVE_LIBZSTD
+    if (zstd_level_ < ZSTD_minCLevel() || zstd_level_ > ZSTD_maxCLevel()) {
+        auto clamped = std::max(ZSTD_minCLevel(), std::min(zstd_level_, ZSTD_maxCLevel()));
+        _MSG_ERROR("(HTTPD) Invalid httpd_zstd_level {}, expected {}-{}; using {}",
+                zstd_level_, ZSTD_minCLevel(), ZSTD_maxCLevel(), clamped);
+        zstd_level_ = clamped;
+    }
+#endif
+
+    static_cache_max =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<size_t>("httpd_static_cache_mb", 32) * 1024 * 1024;
+    static_cache_max_file =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<size_t>("httpd_static_cache_max_file_mb", 8) * 1024 * 1024;
+    static_max_age =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<unsigned int>("httpd_static_max_age", 0);
+
     admin_username = Globalreg::globalreg->kismet_config->fetch_opt("httpd_username");
     admin_password = Globalreg::globalreg->kismet_config->fetch_opt("httpd_password");
 
@@ -189,6 +241,23 @@ void kis_net_beast_httpd::trigger_deferred_startup() {
                 "set a password manually.", MSGFLAG_INFO | MSGFLAG_LOCAL);
     }
 
+    // Per-run key for hashing auth tokens
+    {
+        std::random_device rnd;
+        auto dist = std::uniform_int_distribution<uint8_t>(0, 0xFF);
+        char rdata[32];
+
+        for (auto i = 0; i < 32; i++)
+            rdata[i] = dist(rnd);
+
+        auth_digest_key = std::string(rdata, 32);
+    }
+
+    auth_cache_max =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<size_t>("httpd_auth_cache_size", 1024);
+    auth_cache_ttl =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<time_t>("httpd_auth_cache_ttl", 60);
+
     load_auth();
 
     jwt_auth_key = Globalreg::globalreg->kismet_config->fetch_opt_dfl("httpd_jwt_key", "");
@@ -448,6 +517,14 @@ int kis_net_beast_httpd::start_httpd() {
 
     _MSG_INFO("HTTP server listening on {}:{}", endpoint.address(), endpoint.port());
 
+    auto n_request_threads =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<unsigned int>("httpd_threads", 0);
+
+    if (n_request_threads == 0)
+        n_request_threads = std::max(4U, std::thread::hardware_concurrency());
+
+    request_workers.start(n_request_threads);
+
     running = true;
 
     start_accept();
@@ -461,6 +538,8 @@ int kis_net_beast_httpd::stop_httpd() {
 
     running = false;
 
+    request_workers.stop();
+
     if (acceptor.is_open()) {
         try {
             acceptor.cancel();
@@ -489,35 +568,12 @@ void kis_net_beast_httpd::handle_connection(const boost::system::error_code& ec,
     if (!running)
         return;
 
-	// Spin each connection into its own thread
+    // Each connection reads requests asynchronously and only occupies a request worker
+    // while a request is being processed
     if (!ec) {
-        std::thread conthread([this, tcp_socket = boost::beast::tcp_stream(std::move(socket))]() mutable {
-                thread_set_process_name("BEAST");
-
-                while (tcp_socket.socket().is_open()) {
-					// Reset the timeout every loop through; each request in this
-					// socket pipeline has up to 30 seconds to complete
-					boost::beast::get_lowest_layer(tcp_socket).expires_after(std::chrono::seconds(30));
-
-                    // Associate the socket
-                    auto conn =
-                        std::make_shared<kis_net_beast_httpd_connection>(tcp_socket, shared_from_this());
-
-                    // Run the connection
-                    auto retain = conn->start();
-
-                    if (retain == false)
-                        break;
-                }
-
-                try {
-                    tcp_socket.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_send);
-                } catch (...) {
-                    ;
-                }
-            });
-
-        conthread.detach();
+        auto session =
+            std::make_shared<kis_net_beast_httpd_session>(std::move(socket), shared_from_this());
+        session->start();
     }
 
     // Accept another connection
@@ -683,6 +739,34 @@ std::string kis_net_beast_httpd::resolve_mime_type(const boost::beast::string_vi
 
 }
 
+kis_net_beast_httpd_compressor::encoding kis_net_beast_httpd::select_compression(const boost::beast::string_view& mime_type,
+        const boost::beast::string_view& accept_encoding) const {
+    if (!compression_ || !compressible_mime_type(mime_type))
+        return kis_net_beast_httpd_compressor::encoding::none;
+
+    return kis_net_beast_httpd_compressor::negotiate(accept_encoding);
+}
+
+bool kis_net_beast_httpd::compressible_mime_type(const boost::beast::string_view& mime_type) {
+    auto type = mime_type.substr(0, mime_type.find(';'));
+
+    return type.starts_with("text/") ||
+        boost::beast::iequals(type, "application/json") ||
+        boost::beast::iequals(type, "application/javascript") ||
+        boost::beast::iequals(type, "application/xml") ||
+        boost::beast::iequals(type, "application/vnd.tcpdump.pcap") ||
+        boost::beast::iequals(type, "application/vnd.ms-fontobject") ||
+        boost::beast::iequals(type, "font/ttf") ||
+        boost::beast::iequals(type, "font/otf");
+}
+
+int kis_net_beast_httpd::compression_level(kis_net_beast_httpd_compressor::encoding e) const {
+    if (e == kis_net_beast_httpd_compressor::encoding::zstd)
+        return zstd_level_;
+
+    return gzip_level_;
+}
+
 void kis_net_beast_httpd::register_route(const std::string& route, const std::list<std::string>& verbs,
         const std::string& role, std::shared_ptr<kis_net_web_endpoint> handler) {
 
@@ -705,6 +789,7 @@ void kis_net_beast_httpd::register_route(const std::string& route, const std::li
         b_verbs.emplace_back(boost::beast::http::string_to_verb(v));
 
     route_vec.emplace_back(std::make_shared<kis_net_beast_route>(route, b_verbs, true, roles, handler));
+    rebuild_route_tables_nr();
 }
 
 void kis_net_beast_httpd::register_route(const std::string& route,
@@ -731,6 +816,7 @@ void kis_net_beast_httpd::register_route(const std::string& route,
         b_verbs.emplace_back(boost::beast::http::string_to_verb(v));
 
     route_vec.emplace_back(std::make_shared<kis_net_beast_route>(route, b_verbs, true, roles, extensions, handler));
+    rebuild_route_tables_nr();
 }
 
 void kis_net_beast_httpd::remove_route(const std::string& route) {
@@ -739,6 +825,7 @@ void kis_net_beast_httpd::remove_route(const std::string& route) {
     for (auto i = route_vec.begin(); i != route_vec.end(); ++i) {
         if ((*i)->route() == route) {
             route_vec.erase(i);
+            rebuild_route_tables_nr();
             return;
         }
     }
@@ -753,6 +840,7 @@ void kis_net_beast_httpd::register_unauth_route(const std::string& route,
         b_verbs.emplace_back(boost::beast::http::string_to_verb(v));
     route_vec.emplace_back(std::make_shared<kis_net_beast_route>(route, b_verbs, false,
                 std::list<std::string>{""}, handler));
+    rebuild_route_tables_nr();
 }
 
 void kis_net_beast_httpd::register_unauth_route(const std::string& route,
@@ -765,6 +853,7 @@ void kis_net_beast_httpd::register_unauth_route(const std::string& route,
     route_vec.emplace_back(std::make_shared<kis_net_beast_route>(route, b_verbs, false,
                 std::list<std::string>{""},
                 extensions, handler));
+    rebuild_route_tables_nr();
 }
 
 void kis_net_beast_httpd::register_websocket_route(const std::string& route,
@@ -780,7 +869,7 @@ void kis_net_beast_httpd::register_websocket_route(const std::string& route,
 
     websocket_route_vec.emplace_back(std::make_shared<kis_net_beast_route>(route,
                 std::list<boost::beast::http::verb>{}, true, roles, extensions, handler));
-
+    rebuild_route_tables_nr();
 }
 
 std::string kis_net_beast_httpd::create_auth(const std::string& name, const std::string& role, time_t expiry) {
@@ -810,6 +899,7 @@ std::string kis_net_beast_httpd::create_auth_impl(const std::string& name, const
     auto auth = std::make_shared<kis_net_beast_auth>(token, name, role, expiry);
 
     auth_vec.emplace_back(auth);
+    auth_token_index[auth_token_digest(token)] = auth;
     store_auth();
 
     return token;
@@ -866,6 +956,7 @@ bool kis_net_beast_httpd::remove_auth(const std::string& auth_name) {
 
     for (auto a = auth_vec.begin(); a != auth_vec.end(); ++a) {
         if ((*a)->name() == auth_name) {
+            auth_token_index.erase(auth_token_digest((*a)->token()));
             auth_vec.erase(a);
             store_auth();
             return true;
@@ -875,22 +966,65 @@ bool kis_net_beast_httpd::remove_auth(const std::string& auth_name) {
     return false;
 }
 
+std::string kis_net_beast_httpd::auth_token_digest(const boost::beast::string_view& token) const {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+
+    HMAC(EVP_sha256(), auth_digest_key.data(), static_cast<int>(auth_digest_key.length()),
+            reinterpret_cast<const unsigned char *>(token.data()), token.length(), md, &md_len);
+
+    return std::string(reinterpret_cast<char *>(md), md_len);
+}
+
 std::shared_ptr<kis_net_beast_auth> kis_net_beast_httpd::check_auth_token(const boost::beast::string_view& token) {
-    kis_lock_guard<kis_mutex> lk(auth_mutex, "beast_httpd check_auth_token");
+    auto digest = auth_token_digest(token);
+    auto now = time(0);
+
+    {
+        kis_lock_guard<kis_mutex> lk(auth_mutex, "beast_httpd check_auth_token");
+
+        auto ai = auth_token_index.find(digest);
+        if (ai != auth_token_index.end())
+            return ai->second;
+
+        auto ci = auth_cache_map.find(digest);
+        if (ci != auth_cache_map.end()) {
+            if (ci->second->cache_expires > now) {
+                auth_cache_lru.splice(auth_cache_lru.begin(), auth_cache_lru, ci->second);
+                return ci->second->auth;
+            }
+
+            auth_cache_lru.erase(ci->second);
+            auth_cache_map.erase(ci);
+        }
+    }
 
-    // Step one: is it a JWT token?
+    // Is it a JWT token?  Verify outside the lock, then remember it
     auto authtoken = check_jwt_token(token);
 
-    if (authtoken != nullptr)
+    if (authtoken == nullptr || auth_cache_max == 0)
         return authtoken;
 
-    for (const auto& a : auth_vec) {
-        if (a->check_auth(token))
-            return a;
+    auto cache_expires = now + auth_cache_ttl;
+    if (authtoken->expires() != 0 && authtoken->expires() < cache_expires)
+        cache_expires = authtoken->expires();
+
+    if (cache_expires <= now)
+        return authtoken;
+
+    kis_lock_guard<kis_mutex> lk(auth_mutex, "beast_httpd check_auth_token cache");
 
+    if (auth_cache_map.find(digest) == auth_cache_map.end()) {
+        auth_cache_lru.push_front(auth_cache_entry{digest, authtoken, cache_expires});
+        auth_cache_map[digest] = auth_cache_lru.begin();
+
+        while (auth_cache_lru.size() > auth_cache_max) {
+            auth_cache_map.erase(auth_cache_lru.back().digest);
+            auth_cache_lru.pop_back();
+        }
     }
 
-    return nullptr;
+    return authtoken;
 }
 
 std::shared_ptr<kis_net_beast_auth> kis_net_beast_httpd::check_jwt_token(const boost::beast::string_view& token) {
@@ -951,6 +1085,7 @@ void kis_net_beast_httpd::load_auth() {
     kis_lock_guard<kis_mutex> lk(auth_mutex, "beast_httpd load_auth");
 
     auth_vec.clear();
+    auth_token_index.clear();
 
     auto sessiondb_file =
         Globalreg::globalreg->kismet_config->fetch_opt_path("httpd_session_db",
@@ -970,8 +1105,10 @@ void kis_net_beast_httpd::load_auth() {
         for (const auto& j : json) {
             try {
                 auto auth = std::make_shared<kis_net_beast_auth>(j);
-                if (auth->is_valid())
+                if (auth->is_valid()) {
                     auth_vec.emplace_back(auth);
+                    auth_token_index[auth_token_digest(auth->token())] = auth;
+                }
             } catch (const auth_construction_error& e) {
                 ;
             }
@@ -983,25 +1120,31 @@ void kis_net_beast_httpd::load_auth() {
 }
 
 std::shared_ptr<kis_net_beast_route> kis_net_beast_httpd::find_endpoint(std::shared_ptr<kis_net_beast_httpd_connection> con) {
-    kis_lock_guard<kis_mutex> lk(route_mutex, "beast_httpd find_endpoint");
+    auto table = std::atomic_load(&route_table);
 
-    for (const auto& r : route_vec) {
-        if (r->match_url(static_cast<const std::string>(con->uri()), con->uri_params_, con->http_variables_))
-            return r;
-    }
+    if (table == nullptr)
+        return nullptr;
 
-    return nullptr;
+    return table->find(static_cast<const std::string>(con->uri()), con->uri_params_, con->http_variables_);
 }
 
 std::shared_ptr<kis_net_beast_route> kis_net_beast_httpd::find_websocket_endpoint(std::shared_ptr<kis_net_beast_httpd_connection> con) {
-    kis_lock_guard<kis_mutex> lk(route_mutex, "beast_httpd find_websocket_endpoint");
+    auto table = std::atomic_load(&websocket_route_table);
 
-    for (const auto& r : websocket_route_vec) {
-        if (r->match_url(static_cast<const std::string>(con->uri()), con->uri_params_, con->http_variables_))
-            return r;
-    }
+    if (table == nullptr)
+        return nullptr;
 
-    return nullptr;
+    return table->find(static_cast<const std::string>(con->uri()), con->uri_params_, con->http_variables_);
+}
+
+void kis_net_beast_httpd::rebuild_route_tables_nr() {
+    std::shared_ptr<const kis_net_beast_route_table> table =
+        std::make_shared<kis_net_beast_route_table>(route_vec);
+    std::atomic_store(&route_table, table);
+
+    std::shared_ptr<const kis_net_beast_route_table> ws_table =
+        std::make_shared<kis_net_beast_route_table>(websocket_route_vec);
+    std::atomic_store(&websocket_route_table, ws_table);
 }
 
 void kis_net_beast_httpd::register_static_dir(const std::string& prefix, const std::string& path) {
@@ -1038,16 +1181,12 @@ std::string kis_net_beast_httpd::escape_html(const boost::beast::string_view& ht
 
 bool kis_net_beast_httpd::serve_file(std::shared_ptr<kis_net_beast_httpd_connection> con,
                                      std::string uri) {
-    boost::beast::error_code ec;
-
     if (uri.length() == 0)
         uri = "/index.html";
     else if (uri.back() == '/')
         uri += "index.html";
 
     for (auto sd : static_dir_vec) {
-        ec = {};
-
         if (uri.size() < sd.prefix.size())
             continue;
 
@@ -1079,53 +1218,309 @@ bool kis_net_beast_httpd::serve_file(std::shared_ptr<kis_net_beast_httpd_connect
             continue;
         }
 
-        boost::beast::http::file_body::value_type body;
-        body.open(modified_realpath, boost::beast::file_mode::scan, ec);
+        auto fpath = std::string(modified_realpath);
 
         free(modified_realpath);
         free(base_realpath);
 
-        if (ec == boost::beast::errc::no_such_file_or_directory) {
+        struct stat sb;
+
+        if (stat(fpath.c_str(), &sb) < 0 || !S_ISREG(sb.st_mode))
             continue;
-        } else if (ec) {
-            // _MSG_ERROR("(DEBUG) {} - {}", uri, ec.message());
+
+        auto asset = fetch_static_asset(fpath, sb);
+
+        if (asset == nullptr)
             continue;
+
+        send_static_asset(con, asset, uri);
+
+        return true;
+    }
+
+    return false;
+}
+
+std::shared_ptr<kis_net_beast_httpd::static_asset> kis_net_beast_httpd::fetch_static_asset(const std::string& path,
+        const struct stat& sb) {
+    {
+        kis_lock_guard<kis_mutex> lk(static_cache_mutex, "beast_httpd fetch_static_asset");
+
+        auto ci = static_cache_map.find(path);
+        if (ci != static_cache_map.end()) {
+            auto asset = *ci->second;
+
+            if (asset->size == sb.st_size && asset->mtime == sb.st_mtime && asset->inode == sb.st_ino) {
+                static_cache_lru.splice(static_cache_lru.begin(), static_cache_lru, ci->second);
+                return asset;
+            }
+
+            // Changed on disk
+            static_cache_bytes -= asset->cache_bytes();
+            static_cache_lru.erase(ci->second);
+            static_cache_map.erase(ci);
         }
+    }
 
-        auto const size = body.size();
+    auto asset = std::make_shared<static_asset>();
+
+    asset->path = path;
+    asset->mime_type = resolve_mime_type(path);
+    asset->size = sb.st_size;
+    asset->mtime = sb.st_mtime;
+    asset->inode = sb.st_ino;
+
+    char lastmod[31];
+    struct tm tmstruct;
+    gmtime_r(&sb.st_mtime, &tmstruct);
+    strftime(lastmod, 31, "%a, %d %b %Y %H:%M:%S GMT", &tmstruct);
+    asset->last_modified = lastmod;
+
+    // Large files are sent directly from disk and identified by the file itself
+    if (static_cache_max == 0 || static_cast<size_t>(sb.st_size) > static_cache_max_file) {
+        asset->cached = false;
+        asset->etag = fmt::format("\"{:x}-{:x}-{:x}\"", static_cast<uint64_t>(sb.st_ino),
+                static_cast<uint64_t>(sb.st_size), static_cast<uint64_t>(sb.st_mtime));
+        return asset;
+    }
+
+    std::ifstream f(path, std::ifstream::binary);
+    asset->content.resize(sb.st_size);
 
-        if (con->request().method() == boost::beast::http::verb::head) {
-            boost::beast::http::response<boost::beast::http::empty_body> res{boost::beast::http::status::ok,
-                con->request().version()};
+    if (!f.read(&asset->content[0], sb.st_size))
+        return nullptr;
 
-            con->append_common_headers(res, uri);
+    asset->cached = true;
 
-            res.content_length(size);
+    auto hash = XXH64(asset->content.data(), asset->content.size(), 0);
+    asset->etag = fmt::format("\"{:016x}\"", hash);
 
-            ec = {};
+    // Compress once and keep the variants which are smaller
+    if (compression_ && compressible_mime_type(asset->mime_type) && asset->content.size() > 0) {
+        try {
+            std::string gz;
+            kis_net_beast_httpd_compressor gzc(kis_net_beast_httpd_compressor::encoding::gzip,
+                    HTTPD_STATIC_GZIP_LEVEL);
+            gzc.compress(asset->content.data(), asset->content.size(), gz);
+            gzc.finish(gz);
+
+            if (gz.size() < asset->content.size()) {
+                asset->gzip = std::move(gz);
+                asset->gzip_etag = fmt::format("\"{:016x}-gzip\"", hash);
+            }
 
-            boost::beast::http::write(con->stream(), res, ec);
+#ifdef HAVE_LIBZSTD
+            std::string zs;
+            kis_net_beast_httpd_compressor zsc(kis_net_beast_httpd_compressor::encoding::zstd,
+                    HTTPD_STATIC_ZSTD_LEVEL);
+            zsc.compress(asset->content.data(), asset->content.size(), zs);
+            zsc.finish(zs);
 
-            return true;
+            if (zs.size() < asset->content.size()) {
+                asset->zstd = std::move(zs);
+                asset->zstd_etag = fmt::format("\"{:016x}-zstd\"", hash);
+            }
+#endif
+        } catch (const std::runtime_error& e) {
+            _MSG_ERROR("(HTTPD) Could not compress static file {}: {}", path, e.what());
         }
+    }
 
-        boost::beast::http::response<boost::beast::http::file_body> res{std::piecewise_construct,
-                std::make_tuple(std::move(body)), std::make_tuple(boost::beast::http::status::ok,
-                        con->request().version())};
+    if (asset->cache_bytes() > static_cache_max)
+        return asset;
 
-        con->append_common_headers(res, uri);
-        res.content_length(size);
+    kis_lock_guard<kis_mutex> lk(static_cache_mutex, "beast_httpd fetch_static_asset insert");
 
-        ec = {};
+    // Another request may have loaded it while we were
+    auto ci = static_cache_map.find(path);
+    if (ci != static_cache_map.end()) {
+        static_cache_bytes -= (*ci->second)->cache_bytes();
+        static_cache_lru.erase(ci->second);
+        static_cache_map.erase(ci);
+    }
 
-        boost::beast::http::write(con->stream(), res, ec);
+    static_cache_lru.push_front(asset);
+    static_cache_map[path] = static_cache_lru.begin();
+    static_cache_bytes += asset->cache_bytes();
 
-        return true;
+    while (static_cache_bytes > static_cache_max) {
+        auto evict = static_cache_lru.back();
+        static_cache_bytes -= evict->cache_bytes();
+        static_cache_map.erase(evict->path);
+        static_cache_lru.pop_back();
+    }
+
+    return asset;
+}
+
+// Does an If-None-Match header match an etag; weak comparison, as for any If-None-Match
+static bool static_etag_matches(const boost::beast::string_view& if_none_match, const std::string& etag) {
+    size_t start = 0;
+
+    while (start < if_none_match.length()) {
+        auto end = if_none_match.find(',', start);
+        if (end == boost::beast::string_view::npos)
+            end = if_none_match.length();
+
+        auto tag = if_none_match.substr(start, end - start);
+        start = end + 1;
+
+        while (tag.length() > 0 && std::isspace(static_cast<unsigned char>(tag.front())))
+            tag.remove_prefix(1);
+        while (tag.length() > 0 && std::isspace(static_cast<unsigned char>(tag.back())))
+            tag.remove_suffix(1);
+
+        if (tag.starts_with("W/"))
+            tag.remove_prefix(2);
+
+        if (tag == "*" || tag == etag)
+            return true;
     }
 
     return false;
 }
 
+void kis_net_beast_httpd::send_static_asset(std::shared_ptr<kis_net_beast_httpd_connection> con,
+        std::shared_ptr<static_asset> asset, const std::string& uri) {
+    auto& request = con->request();
+
+    // Pick the precompressed variant the client accepts
+    auto encoding = kis_net_beast_httpd_compressor::encoding::none;
+    const std::string *body = &asset->content;
+    const std::string *etag = &asset->etag;
+
+    if (asset->cached) {
+        encoding = select_compression(asset->mime_type, request[boost::beast::http::field::accept_encoding]);
+
+        if (encoding == kis_net_beast_httpd_compressor::encoding::zstd && asset->zstd.length()) {
+            body = &asset->zstd;
+            etag = &asset->zstd_etag;
+        } else if (encoding == kis_net_beast_httpd_compressor::encoding::gzip && asset->gzip.length()) {
+            body = &asset->gzip;
+            etag = &asset->gzip_etag;
+        } else {
+            encoding = kis_net_beast_httpd_compressor::encoding::none;
+        }
+    }
+
+    auto set_headers = [&](auto& res) {
+        con->append_common_headers(res, uri);
+
+        res.set(boost::beast::http::field::content_type, asset->mime_type);
+        res.set(boost::beast::http::field::last_modified, asset->last_modified);
+        res.set(boost::beast::http::field::etag, *etag);
+
+        // Static content may be cached, but must be revalidated once it is stale
+        if (static_max_age > 0)
+            res.set(boost::beast::http::field::cache_control, fmt::format("max-age={}", static_max_age));
+        else
+            res.set(boost::beast::http::field::cache_control, "no-cache");
+        res.erase(boost::beast::http::field::pragma);
+        res.erase(boost::beast::http::field::expires);
+
+        if (asset->gzip.length() || asset->zstd.length()) {
+            auto vary = res.find(boost::beast::http::field::vary);
+            if (vary != res.end())
+                res.set(boost::beast::http::field::vary, fmt::format("{}, Accept-Encoding", vary->value()));
+            else
+                res.set(boost::beast::http::field::vary, "Accept-Encoding");
+        }
+
+        if (encoding != kis_net_beast_httpd_compressor::encoding::none)
+            res.set(boost::beast::http::field::content_encoding,
+                    kis_net_beast_httpd_compressor::encoding_name(encoding));
+    };
+
+    auto inm = request.find(boost::beast::http::field::if_none_match);
+    if (inm != request.end() && static_etag_matches(inm->value(), *etag)) {
+        auto res = std::make_shared<boost::beast::http::response<boost::beast::http::empty_body>>(
+                boost::beast::http::status::not_modified, request.version());
+
+        set_headers(*res);
+        res->erase(boost::beast::http::field::content_encoding);
+
+        con->write_response(res);
+        return;
+    }
+
+    auto size = asset->cached ? body->size() : static_cast<size_t>(asset->size);
+
+    if (request.method() == boost::beast::http::verb::head || size == 0) {
+        auto res = std::make_shared<boost::beast::http::response<boost::beast::http::empty_body>>(
+                boost::beast::http::status::ok, request.version());
+
+        set_headers(*res);
+        res->content_length(size);
+
+        con->write_response(res);
+        return;
+    }
+
+    if (asset->cached) {
+        // The body points into the cached asset, which has to outlive the write even if it's
+        // evicted from the cache meanwhile
+        struct cached_response {
+            std::shared_ptr<static_asset> asset;
+            boost::beast::http::response<boost::beast::http::buffer_body> res;
+        };
+
+        auto cr = std::make_shared<cached_response>();
+        cr->asset = asset;
+
+        auto res = std::shared_ptr<boost::beast::http::response<boost::beast::http::buffer_body>>(cr, &cr->res);
+
+        res->result(boost::beast::http::status::ok);
+        res->version(request.version());
+
+        set_headers(*res);
+        res->content_length(size);
+
+        res->body().data = (void *) body->data();
+        res->body().size = size;
+        res->body().more = false;
+
+        con->write_response(res);
+        return;
+    }
+
+#ifdef SYS_LINUX
+    // Send large files straight from the page cache
+    int fd = open(asset->path.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        con->do_close();
+        return;
+    }
+
+    auto res = std::make_shared<boost::beast::http::response<boost::beast::http::empty_body>>(
+            boost::beast::http::status::ok, request.version());
+
+    set_headers(*res);
+    res->content_length(size);
+
+    con->write_file_response(res, fd, size);
+#else
+    boost::beast::error_code ec;
+
+    boost::beast::http::file_body::value_type file;
+    file.open(asset->path.c_str(), boost::beast::file_mode::scan, ec);
+
+    if (ec) {
+        con->do_close();
+        return;
+    }
+
+    auto res = std::make_shared<boost::beast::http::response<boost::beast::http::file_body>>(std::piecewise_construct,
+        std::make_tuple(std::move(file)), std::make_tuple(boost::beast::http::status::ok,
+                request.version()));
+
+    set_headers(*res);
+    res->content_length(size);
+
+    con->write_response(res);
+#endif
+}
+
 bool kis_net_beast_httpd::serve_file(std::shared_ptr<kis_net_beast_httpd_connection> con) {
 
     std::string uri;
@@ -1149,143 +1544,590 @@ void kis_net_beast_httpd::strip_uri_prefix(boost::beast::string_view& uri_view)
 
 
 
-kis_net_beast_httpd_connection::kis_net_beast_httpd_connection(boost::beast::tcp_stream& socket,
-        std::shared_ptr<kis_net_beast_httpd> httpd) :
-    httpd{httpd},
-    stream_{socket},
-    login_valid_{false},
-    first_response_write{false} {
-        Globalreg::n_tracked_http_connections.fetch_add(1, std::memory_order_relaxed);
-    }
+kis_net_beast_httpd_compressor::kis_net_beast_httpd_compressor(encoding e, int level) :
+    encoding_{e} {
 
-kis_net_beast_httpd_connection::~kis_net_beast_httpd_connection() {
-    Globalreg::n_tracked_http_connections.fetch_sub(1, std::memory_order_relaxed);
-    if (closure_cb)
-        closure_cb();
-}
+    if (encoding_ == encoding::gzip) {
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
 
-void kis_net_beast_httpd_connection::set_status(unsigned int status) {
-    if (first_response_write)
-        throw std::runtime_error("tried to set status connection already in progress");
+        // 15 window bits, +16 for a gzip header
+        if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("could not initialize gzip compression");
+    }
 
-    response.result(status);
-}
+#ifdef HAVE_LIBZSTD
+    zctx = nullptr;
 
-void kis_net_beast_httpd_connection::set_status(boost::beast::http::status status) {
-    if (first_response_write)
-        throw std::runtime_error("tried to set status connection already in progress");
+    if (encoding_ == encoding::zstd) {
+        zctx = ZSTD_createCCtx();
 
-    response.result(status);
+        if (zctx == nullptr)
+            throw std::runtime_error("could not initialize zstd compression");
+
+        ZSTD_CCtx_setParameter(zctx, ZSTD_c_compressionLevel, level);
+    }
+#endif
 }
 
-void kis_net_beast_httpd_connection::set_mime_type(const std::string& type) {
-    if (first_response_write)
-        throw std::runtime_error("tried to set mime type of connection already in progress");
+kis_net_beast_httpd_compressor::~kis_net_beast_httpd_compressor() {
+    if (encoding_ == encoding::gzip)
+        deflateEnd(&zs);
 
-    response.set(boost::beast::http::field::content_type, type);
+#ifdef HAVE_LIBZSTD
+    if (zctx != nullptr)
+        ZSTD_freeCCtx(zctx);
+#endif
 }
 
-void kis_net_beast_httpd_connection::set_target_file(const std::string& fname) {
-    if (first_response_write)
-        throw std::runtime_error("tried to set file target on connection already in progress");
+void kis_net_beast_httpd_compressor::compress(const char *data, size_t sz, std::string& out) {
+    run(data, sz, out, Z_NO_FLUSH);
+}
 
-    response.set(boost::beast::http::field::content_disposition,
-            fmt::format("attachment; filename=\"{}\"", fname));
+void kis_net_beast_httpd_compressor::flush(std::string& out) {
+    run(nullptr, 0, out, Z_SYNC_FLUSH);
 }
 
-void kis_net_beast_httpd_connection::clear_timeout() {
-    boost::beast::get_lowest_layer(stream_).expires_never();
+void kis_net_beast_httpd_compressor::finish(std::string& out) {
+    run(nullptr, 0, out, Z_FINISH);
 }
 
-void kis_net_beast_httpd_connection::append_header(const std::string& header, const std::string& value) {
-    if (first_response_write)
-        throw std::runtime_error("tried to set a header on a connection already in progress");
+void kis_net_beast_httpd_compressor::run(const char *data, size_t sz, std::string& out, int mode) {
+    if (encoding_ == encoding::gzip) {
+        const size_t block_sz = 16384;
 
-    response.set(header, value);
-}
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        zs.avail_in = static_cast<uInt>(sz);
 
-bool kis_net_beast_httpd_connection::start() {
-    parser_.emplace();
-    parser_->body_limit(100000);
+        // Deflate until it stops filling the output block
+        do {
+            auto pos = out.size();
+            out.resize(pos + block_sz);
 
-    try {
-        boost::beast::http::read(stream_, buffer, *parser_);
-    } catch (const boost::system::system_error& e) {
-        // Silently catch and fail on any error from the transport layer, because we don't
-        // care; we can't deal with a broken client spamming us
-        return do_close();
+            zs.next_out = reinterpret_cast<Bytef *>(&out[pos]);
+            zs.avail_out = static_cast<uInt>(block_sz);
+
+            auto r = deflate(&zs, mode);
+
+            out.resize(pos + block_sz - zs.avail_out);
+
+            if (r == Z_STREAM_ERROR)
+                throw std::runtime_error("gzip compression failed");
+        } while (zs.avail_out == 0);
+
+        return;
     }
 
-    request_ = boost::beast::http::request<boost::beast::http::string_body>(parser_->release());
+#ifdef HAVE_LIBZSTD
+    if (encoding_ == encoding::zstd) {
+        auto block_sz = ZSTD_CStreamOutSize();
 
-    uri_ = request_.target();
-    verb_ = request_.method();
+        ZSTD_EndDirective directive = ZSTD_e_continue;
+        if (mode == Z_SYNC_FLUSH)
+            directive = ZSTD_e_flush;
+        else if (mode == Z_FINISH)
+            directive = ZSTD_e_end;
 
-    httpd->strip_uri_prefix(uri_);
-    auto trimmed_uri = httpd->decode_get_variables(uri_, http_variables_);
+        ZSTD_inBuffer in{data, sz, 0};
 
-    // Fix any double-slashes which will break the parser/splitter
-    std::regex re("/+/");
-    trimmed_uri = std::regex_replace(trimmed_uri, re, "/");
+        while (true) {
+            auto pos = out.size();
+            out.resize(pos + block_sz);
 
-    uri_ = boost::beast::string_view(trimmed_uri);
+            ZSTD_outBuffer ob{&out[pos], block_sz, 0};
 
-    // Process close headers - http 1.0 always closes unless keepalive, 1.1 never closes unless specified
-    bool client_req_close = false;
+            auto remaining = ZSTD_compressStream2(zctx, &ob, &in, directive);
 
-    if (request_.version() == 10)
-        client_req_close = true;
+            out.resize(pos + ob.pos);
 
-    auto client_connection_h = request_.find(boost::beast::http::field::connection);
-    if (client_connection_h != request_.end()) {
-        auto connection_decode = httpd->decode_uri(client_connection_h->value(), true);
+            if (ZSTD_isError(remaining))
+                throw std::runtime_error(fmt::format("zstd compression failed: {}",
+                            ZSTD_getErrorName(remaining)));
 
-        if (request_.version() == 10 && connection_decode == "keep-alive") {
-            client_req_close = false;
-            response.set(boost::beast::http::field::connection, "keep-alive");
+            if (directive == ZSTD_e_continue ? in.pos == in.size : remaining == 0)
+                break;
         }
+    }
+#endif
+}
 
-        if (connection_decode == "close") {
-            client_req_close = true;
+kis_net_beast_httpd_compressor::encoding kis_net_beast_httpd_compressor::negotiate(const boost::beast::string_view& accept_encoding) {
+    // Weights of each encoding; explicitly listed encodings override '*'
+    double q_gzip = -1, q_zstd = -1, q_any = -1;
+
+    size_t start = 0;
+    while (start < accept_encoding.length()) {
+        auto end = accept_encoding.find(',', start);
+        if (end == boost::beast::string_view::npos)
+            end = accept_encoding.length();
+
+        auto item = accept_encoding.substr(start, end - start);
+        start = end + 1;
+
+        double q = 1;
+
+        auto semi = item.find(';');
+        auto name = item.substr(0, semi);
+
+        if (semi != boost::beast::string_view::npos) {
+            auto params = static_cast<std::string>(item.substr(semi + 1));
+            auto qpos = params.find("q=");
+
+            if (qpos != std::string::npos)
+                q = std::strtod(params.c_str() + qpos + 2, nullptr);
         }
+
+        while (name.length() > 0 && std::isspace(static_cast<unsigned char>(name.front())))
+            name.remove_prefix(1);
+        while (name.length() > 0 && std::isspace(static_cast<unsigned char>(name.back())))
+            name.remove_suffix(1);
+
+        if (boost::beast::iequals(name, "gzip") || boost::beast::iequals(name, "x-gzip"))
+            q_gzip = q;
+        else if (boost::beast::iequals(name, "zstd"))
+            q_zstd = q;
+        else if (name == "*")
+            q_any = q;
     }
 
-    // Handle CORS before auth and route finding; always returns
-    if (request_.method() == boost::beast::http::verb::options && httpd->allow_cors()) {
-        response.result(boost::beast::http::status::ok);
+    if (q_gzip < 0)
+        q_gzip = q_any;
+    if (q_zstd < 0)
+        q_zstd = q_any;
 
-        std::string uri_rewrite = "";
-        append_common_headers(response, uri_rewrite);
+#ifdef HAVE_LIBZSTD
+    if (q_zstd > 0 && q_zstd >= q_gzip)
+        return encoding::zstd;
+#endif
 
-        response.set(boost::beast::http::field::content_length, "0");
+    if (q_gzip > 0)
+        return encoding::gzip;
 
-        boost::beast::http::response_serializer<boost::beast::http::buffer_body,
-            boost::beast::http::fields> sr{response};
+    return encoding::none;
+}
 
-        boost::system::error_code error;
-        boost::beast::http::write_header(stream_, sr, error);
+const char *kis_net_beast_httpd_compressor::encoding_name(encoding e) {
+    switch (e) {
+        case encoding::gzip:
+            return "gzip";
+        case encoding::zstd:
+            return "zstd";
+        default:
+            return "identity";
+    }
+}
 
-        if (error)
-            return do_close();
 
-        // Send the completion record for the chunked response
-        response.body().data = nullptr;
-        response.body().size = 0;
-        response.body().more = false;
+// Pool the current thread is working for, and if it has been released from the pool
+static thread_local void *httpd_worker_pool = nullptr;
+static thread_local bool httpd_worker_released = false;
 
-        boost::beast::http::write(stream_, sr, error);
+kis_net_beast_httpd_workers::kis_net_beast_httpd_workers() :
+    state{std::make_shared<pool_state>()} { }
 
-        if (error || client_req_close)
-            return do_close();
+kis_net_beast_httpd_workers::~kis_net_beast_httpd_workers() {
+    stop();
+}
 
-        return true;
-    }
+void kis_net_beast_httpd_workers::start(unsigned int n_threads) {
+    std::lock_guard<std::mutex> lk(state->mutex);
 
-    // Extract the auth cookie
-    auto cookie_h = request_.find(boost::beast::http::field::cookie);
-    if (cookie_h != request_.end()) {
-        auto cookie_decode = httpd->decode_uri(cookie_h->value(), true);
-        httpd->decode_cookies(cookie_decode, cookies_);
+    state->shutdown = false;
+
+    for (unsigned int t = 0; t < n_threads; t++)
+        spawn_worker(state);
+}
+
+void kis_net_beast_httpd_workers::stop() {
+    auto self_id = std::this_thread::get_id();
+
+    std::deque<pool_job> discarded;
+
+    {
+        std::lock_guard<std::mutex> lk(state->mutex);
+        state->shutdown = true;
+        discarded.swap(state->jobs);
+    }
+
+    state->cv.notify_all();
+
+    // Queued requests will never run; close their sessions instead of leaking them
+    for (auto& j : discarded) {
+        try {
+            if (j.cancel)
+                j.cancel();
+        } catch (const std::exception& e) {
+            ;
+        }
+    }
+
+    std::vector<std::thread> abandoned;
+
+    {
+        std::unique_lock<std::mutex> lk(state->mutex);
+
+        auto running = [&](bool include_released) {
+            for (const auto& t : state->threads) {
+                if (t.first == self_id)
+                    continue;
+
+                if (include_released || state->released.find(t.first) == state->released.end())
+                    return true;
+            }
+
+            return false;
+        };
+
+        // Pool threads finish the request they're running and exit
+        state->exit_cv.wait(lk, [&]() { return !running(false); });
+
+        // Released threads run streams until the client goes away; give them a chance to
+        // finish, then stop waiting on them
+        state->exit_cv.wait_for(lk, std::chrono::seconds(5), [&]() { return !running(true); });
+
+        for (auto& t : state->threads)
+            abandoned.push_back(std::move(t.second));
+
+        state->threads.clear();
+        state->released.clear();
+    }
+
+    reap_finished(state);
+
+    for (auto& t : abandoned) {
+        if (t.joinable())
+            t.detach();
+    }
+}
+
+void kis_net_beast_httpd_workers::post(std::function<void ()> job, std::function<void ()> cancel) {
+    {
+        std::lock_guard<std::mutex> lk(state->mutex);
+
+        if (!state->shutdown) {
+            state->jobs.push_back(pool_job{std::move(job), std::move(cancel)});
+            cancel = nullptr;
+        }
+    }
+
+    if (cancel != nullptr) {
+        cancel();
+        return;
+    }
+
+    state->cv.notify_one();
+}
+
+void kis_net_beast_httpd_workers::release_current() {
+    if (httpd_worker_pool != state.get() || httpd_worker_released)
+        return;
+
+    httpd_worker_released = true;
+
+    {
+        std::lock_guard<std::mutex> lk(state->mutex);
+
+        state->released.insert(std::this_thread::get_id());
+
+        if (!state->shutdown)
+            spawn_worker(state);
+    }
+
+    // Released threads exit once their stream ends; join any which already have
+    reap_finished(state);
+}
+
+void kis_net_beast_httpd_workers::spawn_worker(std::shared_ptr<pool_state> state) {
+    // The new thread can't remove itself from the thread map until we release the lock
+    std::thread wt(worker, state);
+    auto id = wt.get_id();
+    state->threads.emplace(id, std::move(wt));
+}
+
+void kis_net_beast_httpd_workers::reap_finished(std::shared_ptr<pool_state> state) {
+    std::vector<std::thread> finished;
+
+    {
+        std::lock_guard<std::mutex> lk(state->mutex);
+        finished.swap(state->finished);
+    }
+
+    for (auto& t : finished) {
+        if (t.get_id() == std::this_thread::get_id())
+            t.detach();
+        else if (t.joinable())
+            t.join();
+    }
+}
+
+void kis_net_beast_httpd_workers::worker(std::shared_ptr<pool_state> state) {
+    thread_set_process_name("BEAST");
+
+    httpd_worker_pool = state.get();
+    httpd_worker_released = false;
+
+    while (true) {
+        pool_job job;
+
+        {
+            std::unique_lock<std::mutex> lk(state->mutex);
+            state->cv.wait(lk, [&state]() { return state->shutdown || state->jobs.size() > 0; });
+
+            if (state->shutdown)
+                break;
+
+            job = std::move(state->jobs.front());
+            state->jobs.pop_front();
+        }
+
+        try {
+            job.run();
+        } catch (const std::exception& e) {
+            ;
+        }
+
+        // A released thread has been replaced in the pool, and leaves once it's done
+        if (httpd_worker_released)
+            break;
+    }
+
+    // Hand our thread to whoever joins the pool next; if stop() has stopped waiting on us,
+    // we've already been detached
+    std::lock_guard<std::mutex> lk(state->mutex);
+
+    auto self_id = std::this_thread::get_id();
+    auto t = state->threads.find(self_id);
+
+    if (t != state->threads.end()) {
+        state->finished.push_back(std::move(t->second));
+        state->threads.erase(t);
+    }
+
+    state->released.erase(self_id);
+    state->exit_cv.notify_all();
+}
+
+
+kis_net_beast_httpd_session::kis_net_beast_httpd_session(boost::asio::ip::tcp::socket&& socket,
+        std::shared_ptr<kis_net_beast_httpd> httpd) :
+    httpd{httpd},
+    stream{std::move(socket)},
+    released{false} { }
+
+void kis_net_beast_httpd_session::start() {
+    boost::asio::dispatch(stream.get_executor(),
+            boost::beast::bind_front_handler(&kis_net_beast_httpd_session::do_read, shared_from_this()));
+}
+
+void kis_net_beast_httpd_session::do_read() {
+    if (!httpd->httpd_running())
+        return close();
+
+    // Each request in this pipeline has up to 30 seconds to arrive
+    stream.expires_after(std::chrono::seconds(30));
+
+    parser.emplace();
+    parser->body_limit(100000);
+
+    boost::beast::http::async_read(stream, buffer, *parser,
+            boost::beast::bind_front_handler(&kis_net_beast_httpd_session::on_read, shared_from_this()));
+}
+
+void kis_net_beast_httpd_session::on_read(const boost::system::error_code& ec,
+        std::size_t bytes_transferred) {
+    // Silently fail on any error from the transport layer, because we don't care; we can't
+    // deal with a broken client spamming us
+    if (ec)
+        return close();
+
+    httpd->request_workers.post([self = shared_from_this()]() {
+                self->handle_request();
+            },
+            [self = shared_from_this()]() {
+                self->request_complete(false);
+            });
+}
+
+void kis_net_beast_httpd_session::handle_request() {
+    auto conn = std::make_shared<kis_net_beast_httpd_connection>(shared_from_this(), httpd);
+
+    bool retain = false;
+
+    try {
+        retain = conn->start();
+    } catch (const std::exception& e) {
+        retain = false;
+    }
+
+    if (!conn->response_async())
+        request_complete(retain);
+}
+
+void kis_net_beast_httpd_session::request_complete(bool retain) {
+    if (released)
+        return;
+
+    boost::asio::post(stream.get_executor(),
+            [self = shared_from_this(), retain]() {
+                if (retain && self->stream.socket().is_open())
+                    self->do_read();
+                else
+                    self->close();
+            });
+}
+
+void kis_net_beast_httpd_session::close() {
+    boost::system::error_code ec;
+    stream.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
+}
+
+
+kis_net_beast_httpd_connection::kis_net_beast_httpd_connection(std::shared_ptr<kis_net_beast_httpd_session> session,
+        std::shared_ptr<kis_net_beast_httpd> httpd) :
+    httpd{httpd},
+    session_{session},
+    stream_{session->stream},
+    response_async_{false},
+    client_req_close_{false},
+    writing_{false},
+    write_done_{false},
+    write_sz_{0},
+    write_scheduled_{false},
+    timeout_cleared_{false},
+    login_valid_{false},
+    first_response_write{false} {
+        Globalreg::n_tracked_http_connections.fetch_add(1, std::memory_order_relaxed);
+    }
+
+kis_net_beast_httpd_connection::~kis_net_beast_httpd_connection() {
+    Globalreg::n_tracked_http_connections.fetch_sub(1, std::memory_order_relaxed);
+    if (closure_cb)
+        closure_cb();
+}
+
+void kis_net_beast_httpd_connection::set_status(unsigned int status) {
+    if (first_response_write)
+        throw std::runtime_error("tried to set status connection already in progress");
+
+    response.result(status);
+}
+
+void kis_net_beast_httpd_connection::set_status(boost::beast::http::status status) {
+    if (first_response_write)
+        throw std::runtime_error("tried to set status connection already in progress");
+
+    response.result(status);
+}
+
+void kis_net_beast_httpd_connection::set_mime_type(const std::string& type) {
+    if (first_response_write)
+        throw std::runtime_error("tried to set mime type of connection already in progress");
+
+    response.set(boost::beast::http::field::content_type, type);
+}
+
+void kis_net_beast_httpd_connection::set_target_file(const std::string& fname) {
+    if (first_response_write)
+        throw std::runtime_error("tried to set file target on connection already in progress");
+
+    response.set(boost::beast::http::field::content_disposition,
+            fmt::format("attachment; filename=\"{}\"", fname));
+}
+
+void kis_net_beast_httpd_connection::clear_timeout() {
+    // Only endpoints which stream indefinitely clear the timeout; give up our request worker
+    // so the stream doesn't hold one of the pool threads
+    httpd->request_workers.release_current();
+
+    timeout_cleared_ = true;
+
+    boost::asio::post(stream_.get_executor(),
+            [self = shared_from_this()]() {
+                boost::beast::get_lowest_layer(self->stream_).expires_never();
+            });
+}
+
+void kis_net_beast_httpd_connection::reset_write_timeout() {
+    if (!timeout_cleared_)
+        boost::beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+}
+
+void kis_net_beast_httpd_connection::append_header(const std::string& header, const std::string& value) {
+    if (first_response_write)
+        throw std::runtime_error("tried to set a header on a connection already in progress");
+
+    response.set(header, value);
+}
+
+bool kis_net_beast_httpd_connection::start() {
+    request_ = boost::beast::http::request<boost::beast::http::string_body>(session_->parser->release());
+
+    uri_ = request_.target();
+    verb_ = request_.method();
+
+    httpd->strip_uri_prefix(uri_);
+    auto trimmed_uri = httpd->decode_get_variables(uri_, http_variables_);
+
+    // Fix any double-slashes which will break the parser/splitter
+    if (trimmed_uri.find("//") != std::string::npos) {
+        std::string collapsed;
+        collapsed.reserve(trimmed_uri.length());
+
+        for (const auto& c : trimmed_uri) {
+            if (c == '/' && collapsed.length() > 0 && collapsed.back() == '/')
+                continue;
+            collapsed.push_back(c);
+        }
+
+        trimmed_uri = std::move(collapsed);
+    }
+
+    uri_ = boost::beast::string_view(trimmed_uri);
+
+    // Process close headers - http 1.0 always closes unless keepalive, 1.1 never closes unless specified
+    bool client_req_close = false;
+
+    if (request_.version() == 10)
+        client_req_close = true;
+
+    auto client_connection_h = request_.find(boost::beast::http::field::connection);
+    if (client_connection_h != request_.end()) {
+        auto connection_decode = httpd->decode_uri(client_connection_h->value(), true);
+
+        if (request_.version() == 10 && connection_decode == "keep-alive") {
+            client_req_close = false;
+            response.set(boost::beast::http::field::connection, "keep-alive");
+        }
+
+        if (connection_decode == "close") {
+            client_req_close = true;
+        }
+    }
+
+    client_req_close_ = client_req_close;
+
+    // Handle CORS before auth and route finding; always returns
+    if (request_.method() == boost::beast::http::verb::options && httpd->allow_cors()) {
+        response.result(boost::beast::http::status::ok);
+
+        std::string uri_rewrite = "";
+        append_common_headers(response, uri_rewrite);
+
+        auto res = std::make_shared<boost::beast::http::response<boost::beast::http::empty_body>>(
+                std::move(response.base()));
+        res->content_length(0);
+
+        write_response(res);
+
+        return false;
+    }
+
+    // Extract the auth cookie
+    auto cookie_h = request_.find(boost::beast::http::field::cookie);
+    if (cookie_h != request_.end()) {
+        auto cookie_decode = httpd->decode_uri(cookie_h->value(), true);
+        httpd->decode_cookies(cookie_decode, cookies_);
 
         auto auth_cookie_k = cookies_.find(httpd->AUTH_COOKIE);
         if (auth_cookie_k != cookies_.end())
@@ -1356,45 +2198,44 @@ bool kis_net_beast_httpd_connection::start() {
         auto route = httpd->find_websocket_endpoint(shared_from_this());
 
         if (route == nullptr) {
-            boost::beast::http::response<boost::beast::http::string_body>
-                res{boost::beast::http::status::not_found, request_.version()};
+            auto res = std::make_shared<boost::beast::http::response<boost::beast::http::string_body>>(
+                boost::beast::http::status::not_found, request_.version());
 
-            res.set(boost::beast::http::field::server, "Kismet");
-            res.set(boost::beast::http::field::content_type, "text/html");
-            res.body() =
+            res->set(boost::beast::http::field::server, "Kismet");
+            res->set(boost::beast::http::field::content_type, "text/html");
+            res->body() =
                 std::string(fmt::format("<html><head><title>404 not found</title></head>"
                             "<body><h1>404 Not Found</h1><br>"
                             "<p>Could not find <code>{}</code></p></body></html>\n",
                             httpd->escape_html(static_cast<std::string>(uri_))));
-            res.prepare_payload();
-
-            boost::system::error_code error;
+            res->prepare_payload();
 
-            boost::beast::http::write(stream_, res, error);
+            write_response(res, true);
 
-            return do_close();
+            return false;
         }
 
         if (!route->match_role(login_valid_, login_role_)) {
-            boost::beast::http::response<boost::beast::http::string_body>
-                res{boost::beast::http::status::unauthorized, request_.version()};
+            auto res = std::make_shared<boost::beast::http::response<boost::beast::http::string_body>>(
+                boost::beast::http::status::unauthorized, request_.version());
 
-            res.set(boost::beast::http::field::server, "Kismet");
-            res.set(boost::beast::http::field::content_type, "text/html");
-            res.body() = std::string("<html><head><title>401 Permission denied</title></head><body>"
+            res->set(boost::beast::http::field::server, "Kismet");
+            res->set(boost::beast::http::field::content_type, "text/html");
+            res->body() = std::string("<html><head><title>401 Permission denied</title></head><body>"
                     "<h1>401 Permission denied</h1><br><p>This resource requires a login or session "
                     "token.</p></body></html>\n");
-            res.prepare_payload();
-
-            boost::system::error_code error;
+            res->prepare_payload();
 
-            boost::beast::http::write(stream_, res, error);
+            write_response(res, true);
 
-            return do_close();
+            return false;
         }
 
         boost::beast::get_lowest_layer(stream_).expires_never();
 
+        // Websockets run until the client goes away; don't hold a request worker
+        httpd->request_workers.release_current();
+
         route->invoke(shared_from_this());
 
         return do_close();
@@ -1405,27 +2246,22 @@ bool kis_net_beast_httpd_connection::start() {
 
     if (route != nullptr) {
         if (!route->match_verb(verb_)) {
-            boost::beast::http::response<boost::beast::http::string_body>
-                res{boost::beast::http::status::method_not_allowed, request_.version()};
-
-            res.set(boost::beast::http::field::server, "Kismet");
-            res.set(boost::beast::http::field::content_type, "text/html");
-            res.body() = std::string("<html><head><title>405 Incorrect method</title></head><body><h1>405 Incorrect method</h1><br><p>This method is not valid for this resource.</p></body></html>\n");
-            res.prepare_payload();
+            auto res = std::make_shared<boost::beast::http::response<boost::beast::http::string_body>>(
+                boost::beast::http::status::method_not_allowed, request_.version());
 
-            boost::system::error_code error;
+            res->set(boost::beast::http::field::server, "Kismet");
+            res->set(boost::beast::http::field::content_type, "text/html");
+            res->body() = std::string("<html><head><title>405 Incorrect method</title></head><body><h1>405 Incorrect method</h1><br><p>This method is not valid for this resource.</p></body></html>\n");
+            res->prepare_payload();
 
-            boost::beast::http::write(stream_, res, error);
+            write_response(res);
 
-            if (error || client_req_close)
-                return do_close();
-
-            return true;
+            return false;
         }
 
         if (!route->match_role(login_valid_, login_role_)) {
-            boost::beast::http::response<boost::beast::http::string_body>
-                res{boost::beast::http::status::unauthorized, request_.version()};
+            auto res = std::make_shared<boost::beast::http::response<boost::beast::http::string_body>>(
+                boost::beast::http::status::unauthorized, request_.version());
 
             // We don't generally want to send a WWW-Authorize header because it makes browsers prompt for logins
             // which interrupts the UI, and curl handles it fine - but wget will not send the auth until it gets
@@ -1435,23 +2271,18 @@ bool kis_net_beast_httpd_connection::start() {
                 auto ua = httpd->decode_uri(ua_h->value(), true);
 
                 if (ua.find_first_of("Wget") == 0) {
-                    res.set(boost::beast::http::field::www_authenticate, "Basic realm=Kismet");
+                    res->set(boost::beast::http::field::www_authenticate, "Basic realm=Kismet");
                 }
             }
 
-            res.set(boost::beast::http::field::server, "Kismet");
-            res.set(boost::beast::http::field::content_type, "text/html");
-            res.body() = std::string("<html><head><title>401 Permission denied</title></head><body><h1>401 Permission denied</h1><br><p>This resource requires a login or session token.</p></body></html>\n");
-            res.prepare_payload();
-
-            boost::system::error_code error;
-
-            boost::beast::http::write(stream_, res, error);
+            res->set(boost::beast::http::field::server, "Kismet");
+            res->set(boost::beast::http::field::content_type, "text/html");
+            res->body() = std::string("<html><head><title>401 Permission denied</title></head><body><h1>401 Permission denied</h1><br><p>This resource requires a login or session token.</p></body></html>\n");
+            res->prepare_payload();
 
-            if (error || client_req_close)
-                return do_close();
+            write_response(res);
 
-            return true;
+            return false;
         }
     } else if (route == nullptr) {
         bool file_served = false;
@@ -1464,28 +2295,27 @@ bool kis_net_beast_httpd_connection::start() {
 
         // If we still didn't serve content, 404
         if (!file_served) {
-            boost::beast::http::response<boost::beast::http::string_body>
-                res{boost::beast::http::status::not_found, request_.version()};
+            auto res = std::make_shared<boost::beast::http::response<boost::beast::http::string_body>>(
+                boost::beast::http::status::not_found, request_.version());
 
-            res.set(boost::beast::http::field::server, "Kismet");
-            res.set(boost::beast::http::field::content_type, "text/html");
-            res.body() =
+            res->set(boost::beast::http::field::server, "Kismet");
+            res->set(boost::beast::http::field::content_type, "text/html");
+            res->body() =
                 std::string(fmt::format("<html><head><title>404 not found</title></head>"
                             "<body><h1>404 Not Found</h1><br>"
                             "<p>Could not find <code>{}</code></p></body></html>\n",
                             httpd->escape_html(static_cast<std::string>(uri_))));
-            res.prepare_payload();
-
-            boost::system::error_code error;
-
-            boost::beast::http::write(stream_, res, error);
+            res->prepare_payload();
 
-            if (error || client_req_close)
-                return do_close();
+            write_response(res);
 
-            return true;
+            return false;
         }
 
+        // Static files are written asynchronously and finish the request themselves
+        if (response_async_)
+            return false;
+
         if (client_req_close)
             return do_close();
 
@@ -1528,107 +2358,342 @@ bool kis_net_beast_httpd_connection::start() {
     response.result(boost::beast::http::status::ok);
     response.set(boost::beast::http::field::transfer_encoding, "chunked");
 
-    // Create the chunked response serializer
-    boost::beast::http::response_serializer<boost::beast::http::buffer_body,
-        boost::beast::http::fields> sr{response};
+    // The response is generated on this request worker and written to the client
+    // asynchronously as it is produced
+    serializer_ = std::make_unique<boost::beast::http::response_serializer<boost::beast::http::buffer_body,
+        boost::beast::http::fields>>(response);
 
+    response_async_ = true;
 
-    // Spawn the generator thread
-    auto generator_launched = std::promise<void>();
-    auto generator_ft = generator_launched.get_future();
+    std::weak_ptr<kis_net_beast_httpd_connection> weak_self = shared_from_this();
+    response_stream_.set_notify_cb([weak_self]() {
+            auto self = weak_self.lock();
+            if (self != nullptr)
+                self->schedule_write();
+        });
 
-    std::thread tr([this, route, generator_launched = std::move(generator_launched),
-            self = shared_from_this()]() mutable {
-        thread_set_process_name("BEAST-WAIT");
+    try {
+        route->invoke(shared_from_this());
+    } catch (const std::exception& e) {
+        try {
+            set_status(500);
+        } catch (...) {
+            ;
+        }
 
-        generator_launched.set_value();
+        std::ostream os(&response_stream_);
+        os << "ERROR: " << e.what();
+    }
 
-        try {
-            route->invoke(self);
-        } catch (const std::exception& e) {
-            try {
-                set_status(500);
-            } catch (...) {
-                ;
-            }
+    response_stream_.complete();
 
-            std::ostream os(&response_stream_);
-            os << "ERROR: " << e.what();
-        }
+    return true;
+}
+
+void kis_net_beast_httpd_connection::schedule_write() {
+    if (write_scheduled_.exchange(true))
+        return;
+
+    boost::asio::post(stream_.get_executor(),
+            [self = shared_from_this()]() {
+                self->write_next();
+            });
+}
 
-        response_stream_.complete();
-    });
-    tr.detach();
+void kis_net_beast_httpd_connection::write_next() {
+    write_scheduled_ = false;
 
-    generator_ft.wait();
+    if (writing_ || write_done_)
+        return;
 
-    boost::system::error_code error;
-    while (response_stream_.size() || response_stream_.running()) {
-        auto sz = response_stream_.size();
+    if (compressor_ != nullptr)
+        return write_compressed();
 
-        if (sz) {
-            // Write the headers once we have body content
-            if (!first_response_write) {
-                boost::beast::http::write_header(stream_, sr, error);
+    if (response_stream_.size() > 0) {
+        // Write the headers once we have body content
+        if (!first_response_write) {
+            auto encoding = httpd->select_compression(response[boost::beast::http::field::content_type],
+                    request_[boost::beast::http::field::accept_encoding]);
 
-                if (error) {
-                    // _MSG_ERROR("(DEBUG) {} {} - Error writing headers - {}", verb_, uri_, error.message());
-                    return do_close();
-                }
-            }
+            // Hold the headers until there's enough content to be worth compressing; long-running
+            // streams are compressed as they go
+            if (encoding != kis_net_beast_httpd_compressor::encoding::none &&
+                    response_stream_.running() && !timeout_cleared_ &&
+                    response_stream_.size() < httpd->compression_min_size())
+                return;
+
+            if (encoding != kis_net_beast_httpd_compressor::encoding::none &&
+                    response.find(boost::beast::http::field::content_encoding) == response.end() &&
+                    (response_stream_.running() || response_stream_.size() >= httpd->compression_min_size()))
+                start_compression(encoding);
 
             // we no longer accept header modifiers
             first_response_write = true;
 
-            char *body_data;
-            auto chunk_sz = response_stream_.get(&body_data);
-
-            response.body().data = (void *) body_data;
-            response.body().size = chunk_sz;
-            response.body().more = true;
+            writing_ = true;
+            reset_write_timeout();
 
-            boost::beast::http::write(stream_, sr, error);
+            boost::beast::http::async_write_header(stream_, *serializer_,
+                    [self = shared_from_this()](const boost::system::error_code& ec, std::size_t) {
+                        self->writing_ = false;
 
-            response_stream_.consume(chunk_sz);
+                        if (ec)
+                            return self->abort_response();
 
-            // _MSG_INFO("(DEBUG) {} {} - Consumed {}/{} running {}", verb_, uri_, sz, response_stream_.size(), response_stream_.running());
+                        self->write_next();
+                    });
 
-            if (error == boost::beast::http::error::need_buffer) {
-                // Beast returns 'need_buffer' when it's completed writing a buffer, configure
-                // as a non-error
-                error = {};
-            } else if (error) {
-                // _MSG_INFO("(DEBUG) {} {} - chunk write error {}", verb_, uri_, error.message());
-                response_stream_.cancel();
-                return do_close();
-            }
+            return;
         }
 
-        // If the buffer has any pending data, regardless of error or completeness,
-        // this will instantly return, otherwise it will stall waiting for it to be
-        // populated
-        response_stream_.wait();
+        char *body_data;
+        write_sz_ = response_stream_.get(&body_data);
+
+        response.body().data = (void *) body_data;
+        response.body().size = write_sz_;
+        response.body().more = true;
+
+        writing_ = true;
+        reset_write_timeout();
+
+        boost::beast::http::async_write(stream_, *serializer_,
+                [self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+                    self->writing_ = false;
+
+                    // Beast returns 'need_buffer' when it's completed writing a buffer, configure
+                    // as a non-error
+                    if (ec == boost::beast::http::error::need_buffer)
+                        ec = {};
+
+                    if (ec)
+                        return self->abort_response();
+
+                    self->response_stream_.consume(self->write_sz_);
+
+                    self->write_next();
+                });
+
+        return;
     }
 
-    // _MSG_INFO("(DEBUG) {} {} - Out of buffer poll loop, remaining {}, running {}", verb_, uri_, response_stream_.size(), response_stream_.running());
+    // Wait to be notified of more content
+    if (response_stream_.running())
+        return;
 
     // Send the completion record for the chunked response
+    write_done_ = true;
+
     response.body().data = nullptr;
     response.body().size = 0;
     response.body().more = false;
 
-    boost::beast::http::write(stream_, sr, error);
+    writing_ = true;
+    reset_write_timeout();
 
-    if (error) {
-        // _MSG_INFO("(DEBUG) {} {} - Error writing conclusion of stream: {}", verb_, uri_, error.message());
-        return do_close();
+    boost::beast::http::async_write(stream_, *serializer_,
+            [self = shared_from_this()](const boost::system::error_code& ec, std::size_t) {
+                self->writing_ = false;
+
+                if (ec || self->client_req_close_) {
+                    self->do_close();
+                    return self->session_->request_complete(false);
+                }
+
+                self->session_->request_complete(true);
+            });
+}
+
+void kis_net_beast_httpd_connection::start_compression(kis_net_beast_httpd_compressor::encoding encoding) {
+    try {
+        compressor_ = std::make_unique<kis_net_beast_httpd_compressor>(encoding,
+                httpd->compression_level(encoding));
+    } catch (const std::runtime_error& e) {
+        _MSG_ERROR("(HTTPD) Could not compress response, sending it uncompressed: {}", e.what());
+        return;
     }
 
-    if (client_req_close)
-        return do_close();
+    response.set(boost::beast::http::field::content_encoding,
+            kis_net_beast_httpd_compressor::encoding_name(encoding));
 
-    return true;
+    auto vary = response.find(boost::beast::http::field::vary);
+    if (vary != response.end())
+        response.set(boost::beast::http::field::vary,
+                fmt::format("{}, Accept-Encoding", vary->value()));
+    else
+        response.set(boost::beast::http::field::vary, "Accept-Encoding");
+}
+
+void kis_net_beast_httpd_connection::write_compressed() {
+    compress_buf_.clear();
+
+    // Check if the stream has ended before draining it, so nothing is left behind
+    auto running = response_stream_.running();
+
+    try {
+        char *body_data;
+        size_t sz;
+
+        while (compress_buf_.size() < 65536 && (sz = response_stream_.get(&body_data)) > 0) {
+            compressor_->compress(body_data, sz, compress_buf_);
+            response_stream_.consume(sz);
+        }
+
+        if (!running && response_stream_.size() == 0) {
+            compressor_->finish(compress_buf_);
+            compressor_.reset();
+        } else if (timeout_cleared_ && response_stream_.size() == 0) {
+            // Don't hold back content from long-running streams
+            compressor_->flush(compress_buf_);
+        }
+    } catch (const std::runtime_error& e) {
+        _MSG_ERROR("(HTTPD) Failed to compress response: {}", e.what());
+        return abort_response();
+    }
+
+    if (compress_buf_.size() == 0) {
+        // Write the completion record once the compressed stream has ended
+        if (compressor_ == nullptr)
+            return write_next();
+
+        return;
+    }
+
+    response.body().data = (void *) compress_buf_.data();
+    response.body().size = compress_buf_.size();
+    response.body().more = true;
+
+    writing_ = true;
+    reset_write_timeout();
+
+    boost::beast::http::async_write(stream_, *serializer_,
+            [self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+                self->writing_ = false;
+
+                if (ec == boost::beast::http::error::need_buffer)
+                    ec = {};
+
+                if (ec)
+                    return self->abort_response();
+
+                self->write_next();
+            });
+}
+
+void kis_net_beast_httpd_connection::abort_response() {
+    if (write_done_)
+        return;
+
+    write_done_ = true;
+
+    response_stream_.cancel();
+    do_close();
+
+    session_->request_complete(false);
+}
+
+#ifdef SYS_LINUX
+struct kis_net_beast_httpd_connection::sendfile_state {
+    sendfile_state(std::shared_ptr<boost::beast::http::response<boost::beast::http::empty_body>> res,
+            int fd, size_t size, boost::beast::tcp_stream::executor_type executor) :
+        res{res},
+        sr{*res},
+        fd{fd},
+        offset{0},
+        size{size},
+        failed{false},
+        timer{executor} { }
+
+    ~sendfile_state() {
+        close(fd);
+    }
+
+    std::shared_ptr<boost::beast::http::response<boost::beast::http::empty_body>> res;
+    boost::beast::http::response_serializer<boost::beast::http::empty_body> sr;
+
+    int fd;
+    off_t offset;
+    size_t size;
+    bool failed;
+
+    // Socket waits aren't covered by the stream timeout
+    boost::asio::steady_timer timer;
+};
+
+void kis_net_beast_httpd_connection::write_file_response(std::shared_ptr<boost::beast::http::response<boost::beast::http::empty_body>> res,
+        int fd, size_t size) {
+    response_async_ = true;
+
+    auto sf = std::make_shared<sendfile_state>(res, fd, size, stream_.get_executor());
+
+    boost::asio::post(stream_.get_executor(),
+            [self = shared_from_this(), sf]() {
+                self->reset_write_timeout();
+
+                boost::beast::http::async_write_header(self->stream_, sf->sr,
+                        [self, sf](const boost::system::error_code& ec, std::size_t) {
+                            if (ec)
+                                sf->failed = true;
+
+                            self->sendfile_next(sf);
+                        });
+            });
+}
+
+void kis_net_beast_httpd_connection::sendfile_next(std::shared_ptr<sendfile_state> sf) {
+    boost::system::error_code ec;
+    stream_.socket().native_non_blocking(true, ec);
+
+    if (ec)
+        sf->failed = true;
+
+    while (!sf->failed && static_cast<size_t>(sf->offset) < sf->size) {
+        auto r = sendfile(stream_.socket().native_handle(), sf->fd, &sf->offset, sf->size - sf->offset);
+
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+
+            // Resume once the client has drained the socket; a client which stops reading
+            // entirely is dropped like any other write timeout
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                sf->timer.expires_after(std::chrono::seconds(30));
+                sf->timer.async_wait([self = shared_from_this()](const boost::system::error_code& ec) {
+                        if (ec)
+                            return;
+
+                        boost::system::error_code cec;
+                        self->stream_.socket().cancel(cec);
+                    });
+
+                stream_.socket().async_wait(boost::asio::ip::tcp::socket::wait_write,
+                        [self = shared_from_this(), sf](const boost::system::error_code& ec) {
+                            sf->timer.cancel();
+
+                            if (ec)
+                                sf->failed = true;
+
+                            self->sendfile_next(sf);
+                        });
+
+                return;
+            }
+
+            break;
+        }
+
+        // Truncated while we were sending it
+        if (r == 0)
+            break;
+    }
+
+    if (sf->failed || static_cast<size_t>(sf->offset) < sf->size || client_req_close_) {
+        do_close();
+        return session_->request_complete(false);
+    }
+
+    session_->request_complete(true);
 }
+#endif
 
 bool kis_net_beast_httpd_connection::do_close() {
     if (closure_cb) {
@@ -1636,6 +2701,9 @@ bool kis_net_beast_httpd_connection::do_close() {
         closure_cb = nullptr;
     }
 
+    if (session_->released)
+        return false;
+
     try {
         stream_.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_send);
     } catch (const std::exception& e) {
@@ -1668,6 +2736,8 @@ kis_net_beast_route::kis_net_beast_route(const std::string& route,
     auto ext_str = std::regex_replace(route, path_re, path_capture_pattern);
     // Match the RE + http variables
     match_re = std::regex(fmt::format("^{}(\\?.*?)?$", ext_str));
+
+    compile_segments();
 }
 
 kis_net_beast_route::kis_net_beast_route(const std::string& route,
@@ -1690,6 +2760,9 @@ kis_net_beast_route::kis_net_beast_route(const std::string& route,
     match_keys.push_back("FILETYPE");
     match_keys.push_back("GETVARS");
 
+    for (const auto& e : extensions)
+        extensions_.push_back(e);
+
     // Generate the file type regex
     auto ft_regex = std::string("\\.(");
     if (extensions.size() == 0) {
@@ -1712,6 +2785,53 @@ kis_net_beast_route::kis_net_beast_route(const std::string& route,
 
     // Match the RE + filetypes + http variables
     match_re = std::regex(fmt::format("^{}{}(\\?.*?)?$", ext_str, ft_regex));
+
+    compile_segments();
+}
+
+void kis_net_beast_route::compile_segments() {
+    segments_valid = true;
+
+    size_t start = 0;
+    while (true) {
+        auto end = route_.find('/', start);
+        auto seg = route_.substr(start, end == std::string::npos ? std::string::npos : end - start);
+
+        auto colon = seg.find(':');
+
+        if (colon == 0) {
+            segments.emplace_back(seg, true);
+        } else if (colon != std::string::npos) {
+            segments_valid = false;
+            segments.clear();
+            return;
+        } else {
+            segments.emplace_back(seg, false);
+        }
+
+        if (end == std::string::npos)
+            break;
+
+        start = end + 1;
+    }
+}
+
+bool kis_net_beast_route::match_extension(const boost::beast::string_view& ext) const {
+    if (ext.length() == 0)
+        return false;
+
+    if (extensions_.size() == 0) {
+        for (const auto& c : ext)
+            if (!std::isalnum(static_cast<unsigned char>(c)))
+                return false;
+        return true;
+    }
+
+    for (const auto& e : extensions_)
+        if (ext == e)
+            return true;
+
+    return false;
 }
 
 bool kis_net_beast_route::match_url(const std::string& url,
@@ -1748,6 +2868,160 @@ bool kis_net_beast_route::match_url(const std::string& url,
     return true;
 }
 
+kis_net_beast_route_table::kis_net_beast_route_table(const std::vector<std::shared_ptr<kis_net_beast_route>>& routes) {
+    for (size_t i = 0; i < routes.size(); i++) {
+        const auto& r = routes[i];
+
+        if (!r->segments_valid) {
+            regex_routes.emplace_back(i, r);
+            continue;
+        }
+
+        auto n = &root;
+
+        for (const auto& seg : r->segments) {
+            if (seg.second) {
+                if (n->param == nullptr)
+                    n->param = std::make_unique<node>();
+                n = n->param.get();
+            } else {
+                auto& child = n->literal[seg.first];
+                if (child == nullptr)
+                    child = std::make_unique<node>();
+                n = child.get();
+            }
+        }
+
+        n->routes.emplace_back(i, r);
+    }
+}
+
+std::shared_ptr<kis_net_beast_route> kis_net_beast_route_table::find(const std::string& url,
+        kis_net_beast_httpd_connection::uri_param_t& uri_params,
+        kis_net_beast_httpd::http_var_map_t& uri_variables) const {
+
+    auto path = boost::beast::string_view(url);
+    auto getvars = boost::beast::string_view{};
+
+    auto q = path.find('?');
+    if (q != boost::beast::string_view::npos) {
+        getvars = path.substr(q);
+        path = path.substr(0, q);
+    }
+
+    std::vector<boost::beast::string_view> url_segments;
+
+    size_t start = 0;
+    while (true) {
+        auto end = path.find('/', start);
+
+        if (end == boost::beast::string_view::npos) {
+            url_segments.push_back(path.substr(start));
+            break;
+        }
+
+        url_segments.push_back(path.substr(start, end - start));
+        start = end + 1;
+    }
+
+    match best;
+    best.order = std::numeric_limits<size_t>::max();
+
+    std::vector<boost::beast::string_view> values;
+    find_node(&root, url_segments, 0, values, best);
+
+    // Routes we couldn't put in the tree only win if they were registered first
+    for (const auto& r : regex_routes) {
+        if (r.first > best.order)
+            break;
+
+        if (r.second->match_url(url, uri_params, uri_variables))
+            return r.second;
+    }
+
+    if (best.route == nullptr)
+        return nullptr;
+
+    size_t v = 0;
+    for (const auto& seg : best.route->segments) {
+        if (!seg.second)
+            continue;
+
+        uri_params.emplace(std::make_pair(seg.first, static_cast<std::string>(best.values[v])));
+        v++;
+    }
+
+    if (best.route->match_types)
+        uri_params.emplace(std::make_pair("FILETYPE", static_cast<std::string>(best.extension)));
+
+    uri_params.emplace(std::make_pair("GETVARS", static_cast<std::string>(getvars)));
+
+    return best.route;
+}
+
+void kis_net_beast_route_table::find_node(const node *n,
+        const std::vector<boost::beast::string_view>& url_segments,
+        size_t pos, std::vector<boost::beast::string_view>& values, match& best) const {
+
+    const auto& seg = url_segments[pos];
+
+    if (pos + 1 < url_segments.size()) {
+        auto l = n->literal.find(static_cast<std::string>(seg));
+        if (l != n->literal.end())
+            find_node(l->second.get(), url_segments, pos + 1, values, best);
+
+        if (n->param != nullptr && seg.length() > 0) {
+            values.push_back(seg);
+            find_node(n->param.get(), url_segments, pos + 1, values, best);
+            values.pop_back();
+        }
+
+        return;
+    }
+
+    // Last segment matches the whole segment for routes without file types, or is split at
+    // a '.' for routes with file types
+    auto try_last = [&](const boost::beast::string_view& name, const boost::beast::string_view& ext) {
+        auto l = n->literal.find(static_cast<std::string>(name));
+        if (l != n->literal.end())
+            match_routes(l->second.get(), ext, values, best);
+
+        if (n->param != nullptr && name.length() > 0) {
+            values.push_back(name);
+            match_routes(n->param.get(), ext, values, best);
+            values.pop_back();
+        }
+    };
+
+    try_last(seg, boost::beast::string_view{});
+
+    for (auto dot = seg.find('.'); dot != boost::beast::string_view::npos; dot = seg.find('.', dot + 1))
+        try_last(seg.substr(0, dot), seg.substr(dot + 1));
+}
+
+void kis_net_beast_route_table::match_routes(const node *n, const boost::beast::string_view& ext,
+        const std::vector<boost::beast::string_view>& values, match& best) const {
+
+    for (const auto& r : n->routes) {
+        if (r.first >= best.order)
+            return;
+
+        if (ext.length() == 0) {
+            if (r.second->match_types)
+                continue;
+        } else {
+            if (!r.second->match_types || !r.second->match_extension(ext))
+                continue;
+        }
+
+        best.order = r.first;
+        best.route = r.second;
+        best.values = values;
+        best.extension = ext;
+        return;
+    }
+}
+
 bool kis_net_beast_route::match_verb(boost::beast::http::verb verb) {
     for (const auto& v : verbs_)
         if (v == verb)
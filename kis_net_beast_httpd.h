@@ -22,11 +22,26 @@
 #include "config.h"
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <list>
+#include <mutex>
 #include <regex>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
 
 #include "boost/asio.hpp"
 #include "boost/beast.hpp"
@@ -50,10 +65,104 @@ template <>struct fmt::formatter<boost::beast::http::verb> : fmt::ostream_format
 template <>struct fmt::formatter<boost::beast::string_view> : fmt::ostream_formatter {};
 
 class kis_net_beast_httpd_connection;
+class kis_net_beast_httpd_session;
 class kis_net_beast_route;
+class kis_net_beast_route_table;
 class kis_net_beast_auth;
 class kis_net_web_endpoint;
 
+// Bounded pool of threads which process HTTP requests.  Connections only hold a thread
+// while a request is being processed; waiting for requests and writing responses is
+// asynchronous.
+//
+// Requests which become long-running streams (websockets, packet streams) call
+// release_current(), which starts a replacement thread for the pool; the released thread
+// exits when its request finishes, so streams never starve the pool.
+//
+// Every thread is tracked and joined by stop(); queued jobs which will never run are
+// cancelled so their sessions are closed.
+class kis_net_beast_httpd_workers {
+public:
+    kis_net_beast_httpd_workers();
+    ~kis_net_beast_httpd_workers();
+
+    void start(unsigned int n_threads);
+    void stop();
+
+    void post(std::function<void ()> job, std::function<void ()> cancel);
+
+    // Called from a request running on a pool thread when it will run indefinitely
+    void release_current();
+
+protected:
+    struct pool_job {
+        std::function<void ()> run;
+        std::function<void ()> cancel;
+    };
+
+    // Shared with the worker threads, which may outlive the pool during shutdown
+    struct pool_state {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::condition_variable exit_cv;
+        std::deque<pool_job> jobs;
+        std::unordered_map<std::thread::id, std::thread> threads;
+        std::unordered_set<std::thread::id> released;
+        // Threads which have exited and are waiting to be joined
+        std::vector<std::thread> finished;
+        bool shutdown = false;
+    };
+
+    static void worker(std::shared_ptr<pool_state> state);
+
+    // Start a worker thread; the state mutex must be held
+    static void spawn_worker(std::shared_ptr<pool_state> state);
+
+    // Join threads which have exited; the state mutex must not be held
+    static void reap_finished(std::shared_ptr<pool_state> state);
+
+    std::shared_ptr<pool_state> state;
+};
+
+// Compression levels for static files, which are only compressed once
+#define HTTPD_STATIC_GZIP_LEVEL     9
+#define HTTPD_STATIC_ZSTD_LEVEL     12
+
+// Streaming compressor for response bodies, producing a gzip or zstd stream as data arrives
+class kis_net_beast_httpd_compressor {
+public:
+    enum class encoding { none, gzip, zstd };
+
+    kis_net_beast_httpd_compressor(encoding e, int level);
+    ~kis_net_beast_httpd_compressor();
+
+    // Compress data, appending any output which is ready
+    void compress(const char *data, size_t sz, std::string& out);
+
+    // Append all the output for the data so far, without ending the stream
+    void flush(std::string& out);
+
+    // End the stream
+    void finish(std::string& out);
+
+    // Pick the encoding from an Accept-Encoding header, preferring zstd when the client
+    // weighs them equally
+    static encoding negotiate(const boost::beast::string_view& accept_encoding);
+
+    static const char *encoding_name(encoding e);
+
+protected:
+    void run(const char *data, size_t sz, std::string& out, int mode);
+
+    encoding encoding_;
+
+    z_stream zs;
+
+#ifdef HAVE_LIBZSTD
+    ZSTD_CCtx *zctx;
+#endif
+};
+
 class kis_net_beast_httpd : public lifetime_global, public deferred_startup,
     public std::enable_shared_from_this<kis_net_beast_httpd> {
 public:
@@ -97,6 +206,15 @@ public:
     std::string resolve_mime_type(const std::string& extension);
     std::string resolve_mime_type(const boost::beast::string_view& extension);
 
+    // Is a mime type worth compressing, ie it isn't compressed already
+    static bool compressible_mime_type(const boost::beast::string_view& mime_type);
+
+    // Pick the compression for a response of this mime type, if the client accepts it
+    kis_net_beast_httpd_compressor::encoding select_compression(const boost::beast::string_view& mime_type,
+            const boost::beast::string_view& accept_encoding) const;
+    int compression_level(kis_net_beast_httpd_compressor::encoding e) const;
+    size_t compression_min_size() const { return compression_min_size_; }
+
     // The majority of routing requires authentication.  Any route that operates outside of
     // authentication must *explicitly* register as unauthenticated.
     void register_route(const std::string& route, const std::list<std::string>& verbs,
@@ -183,13 +301,48 @@ protected:
 
     std::unordered_map<std::string, std::string> mime_map;
 
+    // Response compression; responses smaller than the minimum size are sent as-is
+    bool compression_;
+    size_t compression_min_size_;
+    int gzip_level_;
+    int zstd_level_;
+
+    // Routes in registration order, protected by route_mutex; requests are matched against
+    // the route tables, which are rebuilt whenever a route changes and swapped in atomically
+    // so lookups never lock
     kis_mutex route_mutex;
     std::vector<std::shared_ptr<kis_net_beast_route>> route_vec;
     std::vector<std::shared_ptr<kis_net_beast_route>> websocket_route_vec;
 
+    std::shared_ptr<const kis_net_beast_route_table> route_table;
+    std::shared_ptr<const kis_net_beast_route_table> websocket_route_table;
+
+    // Rebuild the route tables; must hold route_mutex
+    void rebuild_route_tables_nr();
+
     kis_mutex auth_mutex;
     std::vector<std::shared_ptr<kis_net_beast_auth>> auth_vec;
 
+    // Credentials are looked up by a keyed hash of the token, so checking a token neither
+    // scans every key nor compares raw tokens
+    std::string auth_digest_key;
+    std::string auth_token_digest(const boost::beast::string_view& token) const;
+
+    // API tokens by digest, protected by auth_mutex
+    std::unordered_map<std::string, std::shared_ptr<kis_net_beast_auth>> auth_token_index;
+
+    // Recently verified JWT tokens by digest, most recently used first, protected by auth_mutex.
+    // Entries expire after the cache TTL or when the token itself expires, whichever is first
+    struct auth_cache_entry {
+        std::string digest;
+        std::shared_ptr<kis_net_beast_auth> auth;
+        time_t cache_expires;
+    };
+    std::list<auth_cache_entry> auth_cache_lru;
+    std::unordered_map<std::string, std::list<auth_cache_entry>::iterator> auth_cache_map;
+    size_t auth_cache_max;
+    time_t auth_cache_ttl;
+
     class static_content_dir {
     public:
         static_content_dir(const std::string& prefix, const std::string& path) :
@@ -201,6 +354,39 @@ protected:
     };
     std::vector<static_content_dir> static_dir_vec;
 
+    // Static files, loaded once and revalidated against the file on every request.  Files up to
+    // static_cache_max_file are held in memory with precompressed variants, in an LRU bounded by
+    // static_cache_max bytes; larger files are sent from disk
+    struct static_asset {
+        std::string path;
+        std::string mime_type;
+        std::string last_modified;
+
+        off_t size;
+        time_t mtime;
+        ino_t inode;
+
+        // Strong etags for each variant of the content
+        std::string etag, gzip_etag, zstd_etag;
+
+        bool cached;
+        std::string content, gzip, zstd;
+
+        size_t cache_bytes() const { return content.size() + gzip.size() + zstd.size(); }
+    };
+
+    kis_mutex static_cache_mutex;
+    std::list<std::shared_ptr<static_asset>> static_cache_lru;
+    std::unordered_map<std::string, std::list<std::shared_ptr<static_asset>>::iterator> static_cache_map;
+    size_t static_cache_bytes;
+    size_t static_cache_max;
+    size_t static_cache_max_file;
+    unsigned int static_max_age;
+
+    std::shared_ptr<static_asset> fetch_static_asset(const std::string& path, const struct stat& sb);
+    void send_static_asset(std::shared_ptr<kis_net_beast_httpd_connection> con,
+            std::shared_ptr<static_asset> asset, const std::string& uri);
+
 
     boost::asio::ip::tcp::endpoint endpoint;
     boost::asio::ip::tcp::acceptor acceptor;
@@ -209,6 +395,11 @@ protected:
     void start_accept();
     void handle_connection(const boost::system::error_code& ec, boost::asio::ip::tcp::socket socket);
 
+    friend class kis_net_beast_httpd_session;
+    friend class kis_net_beast_httpd_connection;
+
+    kis_net_beast_httpd_workers request_workers;
+
     bool use_ssl;
     bool serve_files;
 
@@ -237,19 +428,55 @@ protected:
 
 
 
+// A client TCP connection; reads requests asynchronously and hands each complete request
+// to the request workers.  Idle keep-alive connections do not hold a thread.
+class kis_net_beast_httpd_session : public std::enable_shared_from_this<kis_net_beast_httpd_session> {
+public:
+    kis_net_beast_httpd_session(boost::asio::ip::tcp::socket&& socket,
+            std::shared_ptr<kis_net_beast_httpd> httpd);
+
+    void start();
+
+    // Called once a request has been completely answered; reads the next request if the
+    // connection is being kept alive
+    void request_complete(bool retain);
+
+protected:
+    friend class kis_net_beast_httpd_connection;
+
+    void do_read();
+    void on_read(const boost::system::error_code& ec, std::size_t bytes_transferred);
+    void handle_request();
+    void close();
+
+    std::shared_ptr<kis_net_beast_httpd> httpd;
+
+    boost::beast::tcp_stream stream;
+    boost::beast::flat_buffer buffer;
+    boost::optional<boost::beast::http::request_parser<boost::beast::http::string_body>> parser;
+
+    // Set when a websocket takes over the stream, after which the session is done with it
+    bool released;
+};
+
 // Central entity which tracks everything about a connection, parsed variables, generator thread, etc.
 class kis_net_beast_httpd_connection : public std::enable_shared_from_this<kis_net_beast_httpd_connection> {
 public:
     friend class kis_net_beast_httpd;
 
-    kis_net_beast_httpd_connection(boost::beast::tcp_stream& stream,
+    kis_net_beast_httpd_connection(std::shared_ptr<kis_net_beast_httpd_session> session,
             std::shared_ptr<kis_net_beast_httpd> httpd);
     virtual ~kis_net_beast_httpd_connection();
 
     using uri_param_t = std::unordered_map<std::string, std::string>;
 
+    // Process the request read by the session.  Returns if the connection should be kept
+    // open; when the response is written asynchronously, the session is told once it
+    // completes instead.
     bool start();
 
+    bool response_async() const { return response_async_; }
+
     boost::beast::http::request<boost::beast::http::string_body>& request() { return request_; }
     boost::beast::http::verb& verb() { return verb_; }
 
@@ -262,7 +489,10 @@ public:
     boost::beast::tcp_stream& stream() { return stream_; }
 
     // Relinquish raw stream entirely
-    boost::beast::tcp_stream release_stream() { return std::move(stream_); }
+    boost::beast::tcp_stream release_stream() {
+        session_->released = true;
+        return std::move(stream_);
+    }
 
     // Stream suitable for std::ostream
     future_chainbuf& response_stream() { return response_stream_; }
@@ -302,18 +532,42 @@ public:
 
 protected:
     std::shared_ptr<kis_net_beast_httpd> httpd;
+    std::shared_ptr<kis_net_beast_httpd_session> session_;
 
     std::function<void ()> closure_cb;
 
     boost::beast::tcp_stream& stream_;
-    boost::beast::flat_buffer buffer;
 
-    boost::optional<boost::beast::http::request_parser<boost::beast::http::string_body>> parser_;
     boost::beast::http::request<boost::beast::http::string_body> request_;
 
     boost::beast::http::response<boost::beast::http::buffer_body> response;
     future_chainbuf response_stream_;
 
+    // Asynchronous chunked writer for generated responses; the write state is only touched
+    // from the stream strand
+    std::unique_ptr<boost::beast::http::response_serializer<boost::beast::http::buffer_body,
+        boost::beast::http::fields>> serializer_;
+    bool response_async_;
+    bool client_req_close_;
+    bool writing_;
+    bool write_done_;
+    size_t write_sz_;
+    std::atomic<bool> write_scheduled_;
+    std::atomic<bool> timeout_cleared_;
+
+    void schedule_write();
+    void write_next();
+    void abort_response();
+    void reset_write_timeout();
+
+    // Compressed responses are written from compress_buf_ instead of directly from the
+    // response stream
+    std::unique_ptr<kis_net_beast_httpd_compressor> compressor_;
+    std::string compress_buf_;
+
+    void start_compression(kis_net_beast_httpd_compressor::encoding encoding);
+    void write_compressed();
+
     // Request type
     boost::beast::http::verb verb_;
 
@@ -334,6 +588,38 @@ protected:
 
     bool do_close();
 
+    // Write a complete, self-contained response from the stream strand and finish the request
+    // once it's sent, so slow clients never hold a request worker
+    template<class Response>
+    void write_response(std::shared_ptr<Response> res, bool close = false) {
+        response_async_ = true;
+
+        boost::asio::post(stream_.get_executor(),
+                [self = shared_from_this(), res, close]() {
+                    self->reset_write_timeout();
+
+                    boost::beast::http::async_write(self->stream_, *res,
+                            [self, res, close](const boost::system::error_code& ec, std::size_t) {
+                                if (ec || close || self->client_req_close_) {
+                                    self->do_close();
+                                    return self->session_->request_complete(false);
+                                }
+
+                                self->session_->request_complete(true);
+                            });
+                });
+    }
+
+#ifdef SYS_LINUX
+    // Static file bodies are sent from the page cache with sendfile, resuming each time the
+    // socket becomes writable
+    struct sendfile_state;
+
+    void write_file_response(std::shared_ptr<boost::beast::http::response<boost::beast::http::empty_body>> res,
+            int fd, size_t size);
+    void sendfile_next(std::shared_ptr<sendfile_state> sf);
+#endif
+
     template<class Response>
     void append_common_headers(Response& r, boost::beast::string_view uri) {
         // Append the common headers
@@ -684,6 +970,15 @@ public:
     std::string& route() { return route_; }
 
 protected:
+    friend class kis_net_beast_route_table;
+
+    // Split the route into path segments for the route table; routes which use a parameter
+    // inside a path segment can't be represented and fall back to the regex
+    void compile_segments();
+
+    // Does a file extension match the extensions this route accepts
+    bool match_extension(const boost::beast::string_view& ext) const;
+
     std::shared_ptr<kis_net_web_endpoint> handler;
 
     std::string route_;
@@ -702,6 +997,54 @@ protected:
     std::vector<std::string> match_keys;
 
     std::regex match_re;
+
+    // Path segments, and if each is a parameter
+    std::vector<std::pair<std::string, bool>> segments;
+    bool segments_valid;
+
+    // Accepted file extensions; empty accepts any alphanumeric extension
+    std::vector<std::string> extensions_;
+};
+
+// Path trie of routes, built when routes are registered.  Each path segment is either a
+// literal or a parameter; the last segment may carry a file extension.  When more than one
+// route matches a URL, the route registered first wins, as it would checking each route
+// in order.
+class kis_net_beast_route_table {
+public:
+    kis_net_beast_route_table(const std::vector<std::shared_ptr<kis_net_beast_route>>& routes);
+
+    // Find the route for a URL, populating the uri parameters of the route
+    std::shared_ptr<kis_net_beast_route> find(const std::string& url,
+            kis_net_beast_httpd_connection::uri_param_t& uri_params,
+            kis_net_beast_httpd::http_var_map_t& uri_variables) const;
+
+protected:
+    struct node {
+        std::unordered_map<std::string, std::unique_ptr<node>> literal;
+        std::unique_ptr<node> param;
+
+        // Routes ending at this node, by registration order
+        std::vector<std::pair<size_t, std::shared_ptr<kis_net_beast_route>>> routes;
+    };
+
+    struct match {
+        size_t order;
+        std::shared_ptr<kis_net_beast_route> route;
+        std::vector<boost::beast::string_view> values;
+        boost::beast::string_view extension;
+    };
+
+    void find_node(const node *n, const std::vector<boost::beast::string_view>& url_segments,
+            size_t pos, std::vector<boost::beast::string_view>& values, match& best) const;
+
+    void match_routes(const node *n, const boost::beast::string_view& ext,
+            const std::vector<boost::beast::string_view>& values, match& best) const;
+
+    node root;
+
+    // Routes which can't be placed in the trie, matched by regex in order
+    std::vector<std::pair<size_t, std::shared_ptr<kis_net_beast_route>>> regex_routes;
 };
 
 struct auth_construction_error : public std::exception {
@@ -105,7 +105,8 @@ bool kis_ppi_logfile::open_log(const std::string& in_template, const std::string
 
     lk.unlock();
 
-	packetchain->register_handler(&kis_ppi_logfile::packet_handler, this, CHAINPOS_LOGGING, -100);
+	packetchain->register_handler(&kis_ppi_logfile::packet_handler, this, CHAINPOS_LOGGING, -100,
+            "ppi logger");
 
     return true;
 }
@@ -190,7 +190,8 @@ bool kis_wiglecsv_logfile::open_log(const std::string& in_template, const std::s
 
     lk.unlock();
 
-    packetchain->register_handler(&kis_wiglecsv_logfile::packet_handler, this, CHAINPOS_LOGGING, -100);
+    packetchain->register_handler(&kis_wiglecsv_logfile::packet_handler, this, CHAINPOS_LOGGING, -100,
+            "wiglecsv logger");
 
     return true;
 }
@@ -270,10 +271,10 @@ int kis_wiglecsv_logfile::packet_handler(CHAINCALL_PARMS) {
             return 1;
     }
 
-    // Lock the device tracker while we log this packet because we need to interact
+    // Lock the device while we log this packet because we need to interact
     // with the device internals
 
-    kis_lock_guard<kis_mutex> device_lk(wigle->devicetracker->get_devicelist_mutex());
+    device_lock_scope device_lk(wigle->devicetracker, dev->get_macaddr());
 
     // Break into per-phy handling
     if (wigle->dot11_phy->device_is_a(dev)) {
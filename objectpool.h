@@ -19,33 +19,43 @@
 #ifndef __OBJECTPOOL_H__
 #define __OBJECTPOOL_H__ 
 
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <stack>
 #include <thread>
 #include <mutex>
+#include <vector>
 
 #include "kis_mutex.h"
 
+// Pool of reusable objects.  Objects are returned to the pool when the last reference is
+// released, after calling the reset function.
+//
+// A pool may optionally keep a small per-thread cache of free objects in front of the shared
+// pool; acquiring and releasing objects then only touch the pool mutex when a thread cache
+// runs empty or overflows, at which point half a cache worth of objects is moved to or from
+// the shared pool at once.  This keeps threads which mostly allocate (capture) and threads
+// which mostly release (packet processing) balanced without taking the lock on every object.
 template <class T>
 class shared_object_pool {
 private:
     struct pool_deleter {
     public:
-        explicit pool_deleter(std::weak_ptr<shared_object_pool<T>* > pool, 
-                std::function<void (T*)> reset) : 
-            pool_(pool),
-            reset_(reset) { }
+        explicit pool_deleter(std::weak_ptr<shared_object_pool<T>* > pool) :
+            pool_(pool) { }
 
         void operator()(T* ptr) {
             if (auto pool_ptr = pool_.lock()) {
                 try {
-                    reset_(ptr);
-                    (*pool_ptr.get())->add(std::unique_ptr<T>{ptr});
-                    return;
+                    // The pool takes ownership of the object
+                    (*pool_ptr.get())->release(ptr);
                 } catch(...) {
 
                 }
+
+                return;
             }
 
             std::default_delete<T>{}(ptr);
@@ -53,7 +63,28 @@ private:
 
     private:
         std::weak_ptr<shared_object_pool<T>* > pool_;
-        std::function<void (T*)> reset_;
+    };
+
+    // Per-thread free list; bound to a single pool at a time, and returns its objects to
+    // that pool (if it still exists) when it is rebound or the thread exits
+    struct thread_cache {
+        ~thread_cache() {
+            flush();
+        }
+
+        void flush() {
+            if (objects.size() == 0)
+                return;
+
+            if (auto pool_ptr = pool.lock())
+                (*pool_ptr.get())->add_bulk(objects, 0);
+
+            objects.clear();
+        }
+
+        const shared_object_pool<T> *owner = nullptr;
+        std::weak_ptr<shared_object_pool<T>* > pool;
+        std::vector<std::unique_ptr<T>> objects;
     };
 
 public:
@@ -62,11 +93,13 @@ public:
     shared_object_pool() : 
         this_(new shared_object_pool<T>*(this)),
         max_sz{0},
+        cache_sz{0},
         reset_{[](T*) {}} { }
 
     shared_object_pool(size_t maxsz) :
         this_(new shared_object_pool<T>*(this)),
         max_sz{maxsz},
+        cache_sz{0},
         reset_([](T*) {}) { }
 
     virtual ~shared_object_pool() { }
@@ -76,6 +109,12 @@ public:
         max_sz = sz;
     }
 
+    // Number of free objects each thread may cache locally; 0 disables thread caching.  Like
+    // the reset function, this should be set before the pool is in use.
+    void set_thread_cache(size_t sz) {
+        cache_sz.store(sz, std::memory_order_relaxed);
+    }
+
     void set_reset(std::function<void (T*)> reset) {
         kis_lock_guard<kis_mutex> lg(pool_mutex);
         reset_ = reset;
@@ -84,7 +123,7 @@ public:
     void add(std::unique_ptr<T> t) {
         kis_lock_guard<kis_mutex> lg(pool_mutex);
 
-        if (max_sz == 0 || (max_sz != 0 && size() < max_sz)) {
+        if (max_sz == 0 || (max_sz != 0 && pool_.size() < max_sz)) {
             pool_.push(std::move(t));
         } 
     }
@@ -98,13 +137,29 @@ public:
     }
 
     ptr_type acquire() {
+        if (cache_sz.load(std::memory_order_relaxed) != 0) {
+            auto& cache = local_cache();
+
+            if (cache.objects.empty())
+                refill(cache);
+
+            if (!cache.objects.empty()) {
+                ptr_type tmp(cache.objects.back().release(),
+                        pool_deleter{std::weak_ptr<shared_object_pool<T>*>{this_}});
+                cache.objects.pop_back();
+                return tmp;
+            }
+
+            return ptr_type(new T(), pool_deleter{std::weak_ptr<shared_object_pool<T>*>{this_}});
+        }
+
         kis_lock_guard<kis_mutex> lg(pool_mutex);
         if (pool_.empty()) {
             return ptr_type(new T(), 
-                    pool_deleter{std::weak_ptr<shared_object_pool<T>*>{this_}, reset_});
+                    pool_deleter{std::weak_ptr<shared_object_pool<T>*>{this_}});
         } else {
             ptr_type tmp(pool_.top().release(),
-                    pool_deleter{std::weak_ptr<shared_object_pool<T>*>{this_}, reset_});
+                    pool_deleter{std::weak_ptr<shared_object_pool<T>*>{this_}});
             pool_.pop();
             return tmp;
         }
@@ -121,10 +176,69 @@ public:
     }
 
 private:
+    // Reset an object and return it to the calling thread's cache, or the shared pool
+    void release(T *ptr) {
+        std::unique_ptr<T> t{ptr};
+
+        reset_(t.get());
+
+        const auto csz = cache_sz.load(std::memory_order_relaxed);
+
+        if (csz != 0) {
+            auto& cache = local_cache();
+
+            cache.objects.push_back(std::move(t));
+
+            if (cache.objects.size() > csz)
+                add_bulk(cache.objects, csz / 2);
+
+            return;
+        }
+
+        add(std::move(t));
+    }
+
+    // Move objects from the end of a cache into the shared pool until the cache holds
+    // keep objects; anything over the pool maximum is freed
+    void add_bulk(std::vector<std::unique_ptr<T>>& objects, size_t keep) {
+        kis_lock_guard<kis_mutex> lg(pool_mutex);
+
+        while (objects.size() > keep) {
+            if (max_sz == 0 || pool_.size() < max_sz)
+                pool_.push(std::move(objects.back()));
+            objects.pop_back();
+        }
+    }
+
+    // Pull up to half a cache worth of objects from the shared pool
+    void refill(thread_cache& cache) {
+        const auto want = std::max<size_t>(1, cache_sz.load(std::memory_order_relaxed) / 2);
+
+        kis_lock_guard<kis_mutex> lg(pool_mutex);
+
+        while (cache.objects.size() < want && !pool_.empty()) {
+            cache.objects.push_back(std::move(pool_.top()));
+            pool_.pop();
+        }
+    }
+
+    thread_cache& local_cache() {
+        thread_local thread_cache cache;
+
+        if (cache.owner != this) {
+            cache.flush();
+            cache.owner = this;
+            cache.pool = this_;
+        }
+
+        return cache;
+    }
+
     std::shared_ptr<shared_object_pool<T>* > this_;
     std::stack<std::unique_ptr<T> > pool_;
     kis_mutex pool_mutex;
     size_t max_sz;
+    std::atomic<size_t> cache_sz;
     std::function<void (T*)> reset_;
 };
 
@@ -38,12 +38,14 @@
 
 
 kis_packet::kis_packet() {
+    assignment_bucket = -1;
     packet_no = 0;
 	error = 0;
     crc_ok = 0;
     checksum_valid = false;
 	filtered = 0;
     duplicate = 0;
+    shed_priority = packet_shed_normal;
     hash = 0;
 
     assignment_id = 0;
@@ -67,12 +69,14 @@ kis_packet::~kis_packet() {
 
 void kis_packet::reset() {
     assignment_id = 0;
+    assignment_bucket = -1;
     packet_no = 0;
     error = 0;
     crc_ok = false;
     checksum_valid = false;
     filtered = 0;
     duplicate = 0;
+    shed_priority = packet_shed_normal;
 
     common_info.reset();
 
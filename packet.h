@@ -325,6 +325,10 @@ public:
     // packets from the same device the same identifier as consistently as possible.
     uint32_t assignment_id;
 
+    // Assignment bucket the packet was queued under, or -1 if it was queued to the
+    // least busy thread; used by the packet chain to track packets in flight
+    int32_t assignment_bucket;
+
     // Unique number of this packet
     uint64_t packet_no;
 
@@ -345,6 +349,9 @@ public:
     // Are we a duplicate?
     int duplicate;
 
+    // Load shedding priority, from kis_packet_shed_priority
+    int shed_priority;
+
     // What hash has been calculated, if any?
     uint32_t hash;
 
@@ -0,0 +1,232 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __PACKET_DEDUPE_H__
+#define __PACKET_DEDUPE_H__
+
+#include "config.h"
+
+#include <memory>
+#include <vector>
+
+#include <stdint.h>
+
+#include "kis_mutex.h"
+
+class kis_packet;
+
+// Duplicate packet detection table.
+//
+// Packets are keyed by a 64-bit content hash; the table is split into shards by
+// the high bits of the hash so that packet threads rarely contend on the same lock,
+// and each shard is an open-addressed, linear-probed table sized to at least twice
+// the number of entries it holds, so lookups are O(1) regardless of the dedupe
+// window.
+//
+// Entries are aged out in FIFO order once a shard holds its share of the window,
+// and entries older than the maximum age are treated as misses and replaced.
+
+class packet_dedupe_table {
+public:
+    struct dedupe_entry {
+        dedupe_entry() :
+            hash{0},
+            packno{0},
+            ts{0} { }
+
+        uint64_t hash;
+        uint64_t packno;
+        uint64_t ts;
+        std::shared_ptr<kis_packet> original;
+    };
+
+    // Window is the total number of unique packets remembered, max_age is the
+    // number of seconds an entry remains valid (0 for no time limit)
+    packet_dedupe_table(size_t window, unsigned int max_age, unsigned int n_shards = 16) :
+        max_age{max_age} {
+
+        // Shard count must be a power of 2 so we can select by the high bits of the hash
+        unsigned int s = 1;
+        shard_bits = 0;
+        while (s < n_shards) {
+            s <<= 1;
+            shard_bits++;
+        }
+
+        if (window < s)
+            window = s;
+
+        auto per_shard = (window + s - 1) / s;
+
+        shards.reserve(s);
+        for (unsigned int i = 0; i < s; i++)
+            shards.push_back(std::make_unique<shard>(per_shard));
+    }
+
+    // Look up a packet hash.  If a live entry exists, the original packet and packet
+    // number are returned.  Otherwise the packet is recorded with in_packno and nullptr
+    // is returned.
+    std::shared_ptr<kis_packet> lookup_or_insert(uint64_t hash, uint64_t now,
+            const std::shared_ptr<kis_packet>& in_pack, uint64_t in_packno, uint64_t& ret_packno) {
+
+        // A zero hash marks an empty slot, nudge any real zero hash
+        if (hash == 0)
+            hash = 1;
+
+        auto& s = select_shard(hash);
+
+        kis_lock_guard<kis_mutex> lk(s.mutex, "dedupe");
+
+        auto pos = s.find(hash);
+        auto& e = s.slots[pos];
+
+        if (e.hash == hash) {
+            if (max_age == 0 || now - e.ts <= max_age) {
+                ret_packno = e.packno;
+                return e.original;
+            }
+
+            // Stale entry; replace it in place and re-queue it for fifo expiry, the
+            // old fifo record will be ignored because the packet number changes
+            e.packno = in_packno;
+            e.ts = now;
+            e.original = in_pack;
+            s.push_fifo(hash, in_packno);
+
+            ret_packno = in_packno;
+            return nullptr;
+        }
+
+        e.hash = hash;
+        e.packno = in_packno;
+        e.ts = now;
+        e.original = in_pack;
+        s.push_fifo(hash, in_packno);
+
+        ret_packno = in_packno;
+        return nullptr;
+    }
+
+    void clear() {
+        for (auto& s : shards) {
+            kis_lock_guard<kis_mutex> lk(s->mutex, "dedupe clear");
+            s->clear();
+        }
+    }
+
+protected:
+    struct fifo_record {
+        uint64_t hash;
+        uint64_t packno;
+    };
+
+    struct shard {
+        shard(size_t window) :
+            window{window},
+            fifo_pos{0},
+            fifo_len{0} {
+
+            mutex.set_name("packet_dedupe shard");
+
+            size_t cap = 16;
+            while (cap < window * 2)
+                cap <<= 1;
+
+            mask = cap - 1;
+            slots.resize(cap);
+            fifo.resize(window);
+        }
+
+        // Find the slot holding a hash, or the empty slot it would be inserted into
+        size_t find(uint64_t hash) const {
+            auto pos = static_cast<size_t>(hash) & mask;
+
+            while (slots[pos].hash != 0 && slots[pos].hash != hash)
+                pos = (pos + 1) & mask;
+
+            return pos;
+        }
+
+        // Remove a slot and shift any following entries in the probe run back,
+        // which keeps the table tombstone-free
+        void erase(size_t pos) {
+            auto hole = pos;
+            auto next = (pos + 1) & mask;
+
+            while (slots[next].hash != 0) {
+                auto home = static_cast<size_t>(slots[next].hash) & mask;
+
+                // Move the entry into the hole if its home slot is not cyclically
+                // between the hole and its current position
+                if (((next - home) & mask) >= ((next - hole) & mask)) {
+                    slots[hole] = std::move(slots[next]);
+                    hole = next;
+                }
+
+                next = (next + 1) & mask;
+            }
+
+            slots[hole] = dedupe_entry{};
+        }
+
+        // Record an insertion, expiring the oldest entry if the window is full
+        void push_fifo(uint64_t hash, uint64_t packno) {
+            if (fifo_len == window) {
+                auto& old = fifo[fifo_pos];
+                auto pos = find(old.hash);
+
+                if (slots[pos].hash == old.hash && slots[pos].packno == old.packno)
+                    erase(pos);
+            } else {
+                fifo_len++;
+            }
+
+            fifo[fifo_pos] = fifo_record{hash, packno};
+            fifo_pos = (fifo_pos + 1) % window;
+        }
+
+        void clear() {
+            for (auto& s : slots)
+                s = dedupe_entry{};
+            fifo_pos = 0;
+            fifo_len = 0;
+        }
+
+        kis_mutex mutex;
+
+        size_t window;
+        size_t mask;
+        std::vector<dedupe_entry> slots;
+
+        std::vector<fifo_record> fifo;
+        size_t fifo_pos;
+        size_t fifo_len;
+    };
+
+    shard& select_shard(uint64_t hash) {
+        if (shard_bits == 0)
+            return *shards[0];
+        return *shards[hash >> (64 - shard_bits)];
+    }
+
+    unsigned int max_age;
+    unsigned int shard_bits;
+    std::vector<std::unique_ptr<shard>> shards;
+};
+
+#endif
@@ -33,6 +33,10 @@
 
 #include <execution>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 #include "alertracker.h"
 #include "configfile.h"
 #include "globalregistry.h"
@@ -42,11 +46,25 @@
 #include "packetchain.h"
 
 #include "crc32.h"
+#include "xxhash.h"
+
+// Cheap monotonic tick source for sampling handler latency; the TSC where we have
+// one, otherwise the steady clock in ns
+static inline uint64_t handler_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+std::atomic<size_t> packet_chain::next_component_pool_slot{0};
 
 class SortLinkPriority {
 public:
-    inline bool operator() (const packet_chain::pc_link* x,
-                            const packet_chain::pc_link* y) const {
+    inline bool operator() (const std::shared_ptr<packet_chain::pc_link>& x,
+                            const std::shared_ptr<packet_chain::pc_link>& y) const {
         if (x->priority < y->priority)
             return 1;
         return 0;
@@ -56,11 +74,11 @@ public:
 packet_chain::packet_chain() {
     packetcomp_mutex.set_name("packetchain packet_comp");
     packetchain_mutex.set_name("packetchain packetchain");
-    pack_no_mutex.set_name("packetchain packetno");
 
     unique_packet_no = 1;
 
-    dedupe_list_pos = 0;
+    chain_version = 0;
+    std::atomic_store(&chain_snapshot, std::shared_ptr<const handler_chains>(std::make_shared<handler_chains>()));
 
     Globalreg::enable_pool_type<kis_tracked_packet>([](auto *a) { a->reset(); });
 
@@ -75,6 +93,24 @@ packet_chain::packet_chain() {
     packet_queue_drop =
         Globalreg::globalreg->kismet_config->fetch_opt_uint("packet_backlog_limit", 8192);
 
+    auto shed_low_pct =
+        std::min(Globalreg::globalreg->kismet_config->fetch_opt_uint("packet_shed_low_percent", 50), 100U);
+    auto shed_normal_pct =
+        std::min(Globalreg::globalreg->kismet_config->fetch_opt_uint("packet_shed_normal_percent", 80), 100U);
+
+    // Lower priorities never outlast higher ones
+    shed_low_pct = std::min(shed_low_pct, shed_normal_pct);
+
+    packet_shed_limit[packet_shed_low] = (uint64_t) packet_queue_drop * shed_low_pct / 100;
+    packet_shed_limit[packet_shed_normal] = (uint64_t) packet_queue_drop * shed_normal_pct / 100;
+    packet_shed_limit[packet_shed_high] = packet_queue_drop;
+
+    auto dedupe_size =
+        Globalreg::globalreg->kismet_config->fetch_opt_uint("packet_dedup_size", 2048);
+    auto dedupe_age =
+        Globalreg::globalreg->kismet_config->fetch_opt_uint("packet_dedup_age", 5);
+    dedupe_table = std::make_unique<packet_dedupe_table>(dedupe_size, dedupe_age);
+
     auto entrytracker =
         Globalreg::fetch_mandatory_global_as<entry_tracker>();
 
@@ -124,6 +160,15 @@ packet_chain::packet_chain() {
     packet_drop_rrd =
         std::make_shared<kis_tracked_rrd<>>(packet_drop_rrd_id);
 
+    const std::array<std::string, packet_shed_max> shed_names{"low", "normal", "high"};
+    for (unsigned int i = 0; i < packet_shed_max; i++) {
+        auto id =
+            entrytracker->register_field(fmt::format("kismet.packetchain.dropped_{}_packets_rrd", shed_names[i]),
+                    tracker_element_factory<kis_tracked_rrd<>>(),
+                    fmt::format("{} priority packets shed from the backlog rrd", shed_names[i]));
+        packet_shed_drop_rrd[i] = std::make_shared<kis_tracked_rrd<>>(id);
+    }
+
     packet_processed_rrd_id =
         entrytracker->register_field("kismet.packetchain.processed_packets_rrd",
                 tracker_element_factory<kis_tracked_rrd<>>(),
@@ -140,8 +185,77 @@ packet_chain::packet_chain() {
     packet_stats_map->insert(packet_queue_rrd);
     packet_stats_map->insert(packet_drop_rrd);
     packet_stats_map->insert(packet_processed_rrd);
+    for (const auto& r : packet_shed_drop_rrd)
+        packet_stats_map->insert(r);
+
+    packet_peak_counter =
+        std::make_unique<sharded_rrd_counter<decltype(packet_peak_rrd)::element_type>>(packet_peak_rrd);
+    packet_rate_counter = std::make_unique<sharded_rrd_counter<kis_tracked_rrd<>>>(packet_rate_rrd);
+    packet_error_counter = std::make_unique<sharded_rrd_counter<kis_tracked_rrd<>>>(packet_error_rrd);
+    packet_dupe_counter = std::make_unique<sharded_rrd_counter<kis_tracked_rrd<>>>(packet_dupe_rrd);
+    packet_queue_counter =
+        std::make_unique<sharded_rrd_counter<kis_tracked_rrd<kis_tracked_rrd_extreme_aggregator>,
+            sharded_counter_max>>(packet_queue_rrd);
+    packet_drop_counter = std::make_unique<sharded_rrd_counter<kis_tracked_rrd<>>>(packet_drop_rrd);
+    packet_processed_counter = std::make_unique<sharded_rrd_counter<kis_tracked_rrd<>>>(packet_processed_rrd);
+    for (unsigned int i = 0; i < packet_shed_max; i++)
+        packet_shed_drop_counter[i] = std::make_unique<sharded_rrd_counter<kis_tracked_rrd<>>>(packet_shed_drop_rrd[i]);
+
+    handler_sample_rate =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<unsigned int>("packet_handler_sample_rate", 16);
+    handler_ticks_base = handler_ticks();
+    handler_clock_base = std::chrono::steady_clock::now();
+
+    handler_stats_record_id =
+        entrytracker->register_field("kismet.packetchain.handler",
+                tracker_element_factory<packet_chain_handler_stats_record>(),
+                "packet chain handler statistics");
+
+    async_logging =
+        Globalreg::globalreg->kismet_config->fetch_opt_bool("packet_async_logging", false);
+    async_log_queue_max =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<size_t>("packet_log_queue_size", 4096);
+    if (async_log_queue_max == 0)
+        async_log_queue_max = 1;
+
+    auto policy = Globalreg::globalreg->kismet_config->fetch_opt_dfl("packet_log_overflow", "block");
+    if (policy == "drop_oldest") {
+        async_log_policy = log_overflow_policy::drop_oldest;
+    } else if (policy == "drop_newest") {
+        async_log_policy = log_overflow_policy::drop_newest;
+    } else {
+        if (policy != "block")
+            _MSG_ERROR("Unknown packet_log_overflow policy '{}', expected block, drop_oldest, "
+                    "or drop_newest; using block", policy);
+        async_log_policy = log_overflow_policy::block;
+    }
+
+    logger_stats_record_id =
+        entrytracker->register_field("kismet.packetchain.logger",
+                tracker_element_factory<packet_chain_logger_stats_record>(),
+                "packet chain async logger statistics");
+    logger_stats_vec_id =
+        entrytracker->register_field("kismet.packetchain.loggers",
+                tracker_element_factory<tracker_element_vector>(),
+                "packet chain async loggers");
+
+    thread_stats_record_id =
+        entrytracker->register_field("kismet.packetchain.thread",
+                tracker_element_factory<packet_chain_thread_stats_record>(),
+                "packet processing thread statistics");
+
+    packet_threads = nullptr;
+    n_packet_threads = 0;
+    n_assignment_buckets = 0;
+
+    pool_thread_cache =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<size_t>("packet_pool_thread_cache", 64);
+
+    for (auto& p : component_pools)
+        p.store(nullptr, std::memory_order_relaxed);
 
     packet_pool.set_max(1024);
+    packet_pool.set_thread_cache(pool_thread_cache);
     packet_pool.set_reset([](kis_packet *p) { p->reset(); });
 
     auto httpd = Globalreg::fetch_mandatory_global_as<kis_net_beast_httpd>();
@@ -151,7 +265,10 @@ packet_chain::packet_chain() {
     // RRDs from different data sources, like chain-level packet processing and worker mutex
     // locked buffer queuing.
     httpd->register_route("/packetchain/packet_stats", {"GET", "POST"}, httpd->RO_ROLE, {},
-            std::make_shared<kis_net_web_tracked_endpoint>(packet_stats_map));
+            std::make_shared<kis_net_web_tracked_endpoint>(
+                [this](std::shared_ptr<kis_net_beast_httpd_connection> con) -> std::shared_ptr<tracker_element> {
+                    return packet_stats_endp_handler();
+                }));
     httpd->register_route("/packetchain/packet_peak", {"GET", "POST"}, httpd->RO_ROLE, {},
             std::make_shared<kis_net_web_tracked_endpoint>(packet_peak_rrd));
     httpd->register_route("/packetchain/packet_rate", {"GET", "POST"}, httpd->RO_ROLE, {},
@@ -164,6 +281,17 @@ packet_chain::packet_chain() {
             std::make_shared<kis_net_web_tracked_endpoint>(packet_drop_rrd));
     httpd->register_route("/packetchain/packet_processed", {"GET", "POST"}, httpd->RO_ROLE, {},
             std::make_shared<kis_net_web_tracked_endpoint>(packet_processed_rrd));
+    httpd->register_route("/packetchain/handler_stats", {"GET", "POST"}, httpd->RO_ROLE, {},
+            std::make_shared<kis_net_web_tracked_endpoint>(
+                [this](std::shared_ptr<kis_net_beast_httpd_connection> con) -> std::shared_ptr<tracker_element> {
+                    return handler_stats_endp_handler();
+                }));
+
+    httpd->register_route("/packetchain/thread_stats", {"GET", "POST"}, httpd->RO_ROLE, {},
+            std::make_shared<kis_net_web_tracked_endpoint>(
+                [this](std::shared_ptr<kis_net_beast_httpd_connection> con) -> std::shared_ptr<tracker_element> {
+                    return thread_stats_endp_handler();
+                }));
 
     packetchain_shutdown = false;
 
@@ -174,6 +302,9 @@ packet_chain::packet_chain() {
         timetracker->register_timer(std::chrono::seconds(1), true,
                 [this](int) -> int {
 
+                flush_packet_counters(Globalreg::globalreg->last_tv_sec);
+                rebalance_packet_threads();
+
                 auto evt = eventbus->get_eventbus_event(event_packetstats());
                 evt->get_event_content()->insert(event_packetstats(), packet_stats_map);
                 eventbus->publish(evt);
@@ -185,14 +316,6 @@ packet_chain::packet_chain() {
 	pack_comp_decap = register_packet_component("DECAP");
     pack_comp_l1_agg = register_packet_component("RADIODATA_AGG");
 	pack_comp_datasource = register_packet_component("KISDATASRC");
-
-    postcap_chain_update = false;
-    llcdissect_chain_update = false;
-    decrypt_chain_update = false;
-    datadissect_chain_update = false;
-    classifier_chain_update = false;
-    tracker_chain_update = false;
-    logging_chain_update = false;
 }
 
 packet_chain::~packet_chain() {
@@ -223,6 +346,13 @@ packet_chain::~packet_chain() {
         packet_threads = nullptr;
     }
 
+    {
+        // Nothing feeds the loggers now; let them finish their queues
+        std::shared_ptr<const handler_chains> chains;
+        for (const auto& pcl : fetch_chains(chains)->chains[CHAINPOS_LOGGING])
+            stop_async_logger(pcl);
+    }
+
     {
         // kis_lock_guard<kis_shared_mutex> lk(packetchain_mutex, "~packet_chain");
         auto lk = std::unique_lock(packetchain_mutex);
@@ -230,13 +360,10 @@ packet_chain::~packet_chain() {
         Globalreg::globalreg->remove_global("PACKETCHAIN");
         Globalreg::globalreg->packetchain = NULL;
 
-        postcap_chain.clear();
-        llcdissect_chain.clear();
-        decrypt_chain.clear();
-        datadissect_chain.clear();
-        classifier_chain.clear();
-        tracker_chain.clear();
-        logging_chain.clear();
+        auto chains = std::make_shared<handler_chains>();
+        chains->version = chain_version + 1;
+        std::atomic_store(&chain_snapshot, std::shared_ptr<const handler_chains>(chains));
+        chain_version = chains->version;
     }
 
 }
@@ -248,15 +375,53 @@ void packet_chain::start_processing() {
         n_packet_threads = std::max(4, static_cast<int>(std::thread::hardware_concurrency() / 4));
     }
 
+    // Workers pull up to packet_batch_size packets at a time; each chain stage can
+    // hand handlers smaller slices via packet_batch_size_[stage]
+    dequeue_batch_size =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<unsigned int>("packet_batch_size", 32);
+    if (dequeue_batch_size == 0)
+        dequeue_batch_size = 1;
+
+    for (unsigned int c = 0; c < CHAINPOS_MAX; c++) {
+        stage_batch_size[c] =
+            Globalreg::globalreg->kismet_config->fetch_opt_as<unsigned int>(
+                    fmt::format("packet_batch_size_{}", chain_name(c)), dequeue_batch_size);
+        if (stage_batch_size[c] == 0)
+            stage_batch_size[c] = 1;
+    }
+
+    n_assignment_buckets =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<unsigned int>("packet_thread_buckets", 1024);
+    n_assignment_buckets = std::max(n_assignment_buckets, n_packet_threads);
+
+    rebalance_threads =
+        Globalreg::globalreg->kismet_config->fetch_opt_bool("packet_thread_rebalance", true);
+    rebalance_ratio =
+        Globalreg::globalreg->kismet_config->fetch_opt_as<double>("packet_thread_rebalance_ratio", 1.25);
+    if (rebalance_ratio < 1)
+        rebalance_ratio = 1;
+
+    bucket_state = std::make_unique<std::atomic<uint64_t>[]>(n_assignment_buckets);
+    bucket_packets = std::make_unique<std::atomic<uint32_t>[]>(n_assignment_buckets);
+
+    for (size_t b = 0; b < n_assignment_buckets; b++) {
+        bucket_state[b].store(static_cast<uint64_t>(b % n_packet_threads) << 32, std::memory_order_relaxed);
+        bucket_packets[b].store(0, std::memory_order_relaxed);
+    }
+
+    last_rebalance = std::chrono::steady_clock::now();
+
     packet_threads = new packet_thread*[n_packet_threads];
 
-    for (unsigned int n = 0; n < n_packet_threads; n++) {
+    for (unsigned int n = 0; n < n_packet_threads; n++)
         packet_threads[n] = new packet_thread();
+
+    for (unsigned int n = 0; n < n_packet_threads; n++) {
         packet_threads[n]->packet_thread =
             std::thread([this, n]() {
             auto name = fmt::format("PACKET {}/{}", n, n_packet_threads);
             thread_set_process_name(name);
-            packet_queue_processor(&packet_threads[n]->packet_queue);
+            packet_queue_processor(packet_threads[n]);
         });
     }
 }
@@ -303,99 +468,77 @@ std::shared_ptr<kis_packet> packet_chain::generate_packet() {
     // return std::make_shared<kis_packet>();
 }
 
-void packet_chain::packet_queue_processor(moodycamel::BlockingConcurrentQueue<std::shared_ptr<kis_packet>> *packet_queue) {
-    std::shared_ptr<kis_packet> packet;
+void packet_chain::packet_queue_processor(packet_thread *thread) {
+    auto packet_queue = &thread->packet_queue;
 
-    while (!packetchain_shutdown &&
-            !Globalreg::globalreg->spindown &&
-            !Globalreg::globalreg->fatal_condition &&
-            !Globalreg::globalreg->complete) {
+    std::vector<std::shared_ptr<kis_packet>> dequeued(dequeue_batch_size);
+    std::vector<std::shared_ptr<kis_packet>> batch;
+    std::shared_ptr<const handler_chains> chains;
 
-        packet_queue->wait_dequeue(packet);
+    batch.reserve(dequeue_batch_size);
 
-        if (packet == nullptr)
-            break;
+    bool shutdown = false;
 
-        // Lock the packet chain and update any processing queues by replacing
-        // the old queue with the new one.
-
-        kis_unique_lock<kis_shared_mutex> lk(packetchain_mutex, "packet processor");
-
-        if (llcdissect_chain_update) {
-            llcdissect_chain = llcdissect_chain_new;
-            llcdissect_chain_new.clear();
-            llcdissect_chain_update = false;
-        }
-
-        if (decrypt_chain_update) {
-            decrypt_chain = decrypt_chain_new;
-            decrypt_chain_new.clear();
-            decrypt_chain_update = false;
-        }
+    while (!shutdown &&
+            !packetchain_shutdown &&
+            !Globalreg::globalreg->spindown &&
+            !Globalreg::globalreg->fatal_condition &&
+            !Globalreg::globalreg->complete) {
 
-        if (datadissect_chain_update) {
-            datadissect_chain = datadissect_chain_new;
-            datadissect_chain_new.clear();
-            datadissect_chain_update = false;
-        }
+        auto n_dequeued = packet_queue->wait_dequeue_bulk(dequeued.begin(), dequeue_batch_size);
 
-        if (classifier_chain_update) {
-            classifier_chain = classifier_chain_new;
-            classifier_chain_new.clear();
-            classifier_chain_update = false;
-        }
+        const auto busy_start = std::chrono::steady_clock::now();
 
-        if (tracker_chain_update) {
-            tracker_chain = tracker_chain_new;
-            tracker_chain_new.clear();
-            tracker_chain_update = false;
-        }
+        // Pick up the current handler chains; this only touches the shared snapshot
+        // when a handler has been added or removed since the last batch
+        const auto& chainset = *fetch_chains(chains);
 
-        if (logging_chain_update) {
-            logging_chain = logging_chain_new;
-            logging_chain_new.clear();
-            logging_chain_update = false;
-        }
+        for (size_t i = 0; i < n_dequeued; i++) {
+            auto& packet = dequeued[i];
 
-        lk.unlock();
+            // Finish whatever we've already pulled from the queue, then exit
+            if (packet == nullptr) {
+                shutdown = true;
+                break;
+            }
 
-        // These can only be perturbed inside a sync, which can only occur when
-        // the worker thread is in the sync block above, so we shouldn't
-        // need to worry about the integrity of these vectors while running
+            // Lock the individual packet to make sure no competing processing threads
+            // manipulate it (such as via dupe packet collision) while we're processing;
+            // the lock is held until the batch completes the chain
+            packet->mutex.lock();
 
-        /* Postcap is now handled before it gets into the per-thread chain
-           for (const auto& pcl : postcap_chain) {
-           if (pcl->callback != nullptr)
-           pcl->callback(pcl->auxdata, packet);
-           else if (pcl->l_callback != nullptr)
-           pcl->l_callback(packet);
-           }
-           */
+            const auto& chunk = packet->fetch<kis_datachunk>(pack_comp_decap, pack_comp_linkframe);
 
-        // Lock the individual packet to make sure no competing processing threads
-        // manipulate it (such as via dupe packet collision) while we're processing
-        packet->mutex.lock();
+            if (chunk != nullptr && chunk->data() != nullptr && chunk->length() != 0) {
+                packet->hash = crc32_fast(chunk->data(), chunk->length(), 0);
 
-        const auto& chunk = packet->fetch<kis_datachunk>(pack_comp_decap, pack_comp_linkframe);
+                // The crc32 is what gets logged; dedupe is keyed on a 64bit hash to
+                // keep collisions negligible at large window sizes
+                auto dedupe_hash = XXH64(chunk->data(), chunk->length(), 0);
 
-        if (chunk != nullptr && chunk->data() != nullptr && chunk->length() != 0) {
-            packet->hash = crc32_fast(chunk->data(), chunk->length(), 0);
+                uint64_t packno;
+                auto original = dedupe_table->lookup_or_insert(dedupe_hash,
+                        Globalreg::globalreg->last_tv_sec, packet, unique_packet_no++, packno);
 
-            // Lock the hash list, gating all hash comparisons
-            auto no_lk = kis_unique_lock<kis_shared_mutex>(pack_no_mutex, "hash handler");
+                packet->packet_no = packno;
 
-            for (const auto& p : dedupe_list) {
-                if (p.hash == packet->hash) {
+                if (original != nullptr) {
                     packet->duplicate = true;
-                    packet->packet_no = p.packno;
-                    packet->original = p.original_pkt;
+                    packet->original = original;
 
                     // We have to wait until everything is done being changed in the packet
-                    // before we can copy the duplicate decoded state over, grab the lock that
-                    // is released at the end of the chain
-                    kis_lock_guard<kis_mutex> lg(p.original_pkt->mutex);
+                    // before we can copy the duplicate decoded state over.  If the original is
+                    // still pending in our own batch, or is held by another thread, run what we
+                    // have first; we must never block on a packet lock while holding the locks
+                    // of other packets in the dedupe table.
+                    if (std::find(batch.begin(), batch.end(), original) != batch.end() ||
+                            !original->mutex.try_lock()) {
+                        process_packet_batch(chainset, batch);
+                        original->mutex.lock();
+                    }
+
                     for (unsigned int c = 0; c < MAX_PACKET_COMPONENTS; c++) {
-                        auto cp = p.original_pkt->content_vec[c];
+                        auto cp = original->content_vec[c];
                         if (cp != nullptr) {
                             if (cp->unique())
                                 continue;
@@ -404,8 +547,10 @@ void packet_chain::packet_queue_processor(moodycamel::BlockingConcurrentQueue<st
                         }
                     }
 
+                    original->mutex.unlock();
+
                     // Merge the signal levels
-					// TODO fix for new embedded l1 data
+                    // TODO fix for new embedded l1 data
 #if 0
                     if (packet->has(pack_comp_l1) && packet->has(pack_comp_datasource)) {
                         auto l1 = packet->original->fetch<kis_layer1_packinfo>(pack_comp_l1);
@@ -414,67 +559,473 @@ void packet_chain::packet_queue_processor(moodycamel::BlockingConcurrentQueue<st
                         radio_agg->source_l1_map[datasrc->ref_source->get_source_uuid()] = l1;
                     }
 #endif
-
-                    break;
                 }
             }
 
-            // Assign a new packet number and cache it in the dedupe
-            if (!packet->duplicate) {
-                auto listpos = dedupe_list_pos++ % 1024;
-                packet->packet_no = unique_packet_no++;
-                dedupe_list[listpos].hash = packet->hash;
-                dedupe_list[listpos].packno = unique_packet_no++;
-                dedupe_list[listpos].original_pkt = packet;
-            }
+            batch.push_back(std::move(packet));
         }
 
-        // run the rest of the packet chain
+        process_packet_batch(chainset, batch);
 
-        for (const auto& pcl : llcdissect_chain) {
-            if (pcl->callback != nullptr)
-                pcl->callback(pcl->auxdata, packet);
-        }
+        // Release anything left in the dequeue buffer
+        for (size_t i = 0; i < n_dequeued; i++)
+            dequeued[i].reset();
+
+        thread->packets.fetch_add(n_dequeued, std::memory_order_relaxed);
+        thread->busy_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - busy_start).count(), std::memory_order_relaxed);
+    }
+}
+
+void packet_chain::process_packet_batch(const handler_chains& chainset,
+        std::vector<std::shared_ptr<kis_packet>>& batch) {
+
+    if (batch.size() == 0)
+        return;
+
+    // Each stage completes for the entire batch before the next stage starts; handlers
+    // within a stage still run in priority order for each slice of the batch
+    for (int c = CHAINPOS_LLCDISSECT; c < CHAINPOS_MAX; c++) {
+        const auto slice_sz = stage_batch_size[c];
 
-        for (const auto& pcl : decrypt_chain) {
-            if (pcl->callback != nullptr)
-                pcl->callback(pcl->auxdata, packet);
+        for (size_t offt = 0; offt < batch.size(); offt += slice_sz) {
+            const auto slice_len = std::min(slice_sz, batch.size() - offt);
+            const auto slice = batch.data() + offt;
+
+            dispatch_slice(chainset, c, slice, slice_len);
         }
+    }
+
+    unsigned int n_error = 0, n_dupe = 0;
+
+    for (const auto& packet : batch) {
+        if (packet->error)
+            n_error++;
+
+        if (packet->duplicate)
+            n_dupe++;
+
+        packet->mutex.unlock();
+
+        release_packet_bucket(packet.get());
+    }
+
+    if (n_error)
+        packet_error_counter->add(n_error);
 
-        for (const auto& pcl : datadissect_chain) {
-            if (pcl->callback != nullptr)
-                pcl->callback(pcl->auxdata, packet);
+    if (n_dupe)
+        packet_dupe_counter->add(n_dupe);
+
+    packet_processed_counter->add(batch.size());
+
+    batch.clear();
+}
+
+void packet_chain::flush_packet_counters(time_t now) {
+    packet_peak_counter->flush(now);
+    packet_rate_counter->flush(now);
+    packet_error_counter->flush(now);
+    packet_dupe_counter->flush(now);
+    packet_queue_counter->flush(now);
+    packet_drop_counter->flush(now);
+    packet_processed_counter->flush(now);
+    for (const auto& c : packet_shed_drop_counter)
+        c->flush(now);
+}
+
+unsigned int packet_chain::assign_packet_thread(const std::shared_ptr<kis_packet>& in_pack) {
+    // Packets with no assignment id have no device affinity and go to whichever thread
+    // has the shortest queue.
+    uint32_t assignment_id = in_pack->assignment_id;
+
+    if (assignment_id == 0) {
+        unsigned int processing_id = 0;
+        size_t min_qsize = packet_threads[0]->packet_queue.size_approx();
+
+        for (unsigned int t = 1; t < n_packet_threads && min_qsize != 0; t++) {
+            auto qsize = packet_threads[t]->packet_queue.size_approx();
+            if (qsize < min_qsize) {
+                min_qsize = qsize;
+                processing_id = t;
+            }
         }
 
-        for (const auto& pcl : classifier_chain) {
-            if (pcl->callback != nullptr)
-                pcl->callback(pcl->auxdata, packet);
+        in_pack->assignment_bucket = -1;
+        return processing_id;
+    }
+
+    auto bucket = assignment_id % n_assignment_buckets;
+
+    // Counting the packet in flight and reading the bucket thread is one atomic
+    // operation, so a bucket can't be migrated between the two
+    auto state = bucket_state[bucket].fetch_add(1, std::memory_order_acq_rel);
+    bucket_packets[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    in_pack->assignment_bucket = bucket;
+
+    return state >> 32;
+}
+
+void packet_chain::release_packet_bucket(kis_packet *in_pack) {
+    if (in_pack->assignment_bucket < 0)
+        return;
+
+    bucket_state[in_pack->assignment_bucket].fetch_sub(1, std::memory_order_acq_rel);
+    in_pack->assignment_bucket = -1;
+}
+
+void packet_chain::rebalance_packet_threads() {
+    if (packet_threads == nullptr || n_packet_threads == 0)
+        return;
+
+    std::lock_guard<std::mutex> lk(thread_stats_mutex);
+
+    auto now = std::chrono::steady_clock::now();
+    auto interval_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_rebalance).count();
+    last_rebalance = now;
+
+    if (interval_ns <= 0)
+        return;
+
+    // Packets each thread processed over the interval
+    std::vector<uint64_t> load(n_packet_threads, 0);
+    uint64_t total_load = 0;
+
+    for (unsigned int t = 0; t < n_packet_threads; t++) {
+        auto pt = packet_threads[t];
+
+        auto busy_ns = pt->busy_ns.load(std::memory_order_relaxed);
+        auto packets = pt->packets.load(std::memory_order_relaxed);
+
+        load[t] = packets - pt->last_packets;
+        total_load += load[t];
+
+        pt->utilization = std::min(100.0, 100.0 * (busy_ns - pt->last_busy_ns) / interval_ns);
+        pt->packet_rate = static_cast<double>(load[t]) * 1000000000 / interval_ns;
+
+        pt->last_busy_ns = busy_ns;
+        pt->last_packets = packets;
+    }
+
+    // Packets per bucket over the interval, grouped by the thread which owns the bucket
+    std::vector<std::vector<std::pair<uint32_t, size_t>>> thread_buckets(n_packet_threads);
+
+    for (size_t b = 0; b < n_assignment_buckets; b++) {
+        auto packets = bucket_packets[b].exchange(0, std::memory_order_relaxed);
+        auto t = bucket_state[b].load(std::memory_order_relaxed) >> 32;
+
+        if (packets != 0)
+            thread_buckets[t].push_back(std::make_pair(packets, b));
+    }
+
+    if (!rebalance_threads || n_packet_threads < 2)
+        return;
+
+    auto mean_load = static_cast<double>(total_load) / n_packet_threads;
+
+    auto hot = std::max_element(load.begin(), load.end()) - load.begin();
+    auto cold = std::min_element(load.begin(), load.end()) - load.begin();
+
+    // Ignore light traffic and threads within the allowed imbalance
+    if (load[hot] < 100 || load[hot] <= mean_load * rebalance_ratio)
+        return;
+
+    // Move the coldest buckets first, and only while a move narrows the gap between
+    // the hot and cold threads; a single busy device can't be split, so its bucket
+    // stays put and the buckets around it move instead
+    auto& candidates = thread_buckets[hot];
+    std::sort(candidates.begin(), candidates.end());
+
+    for (const auto& c : candidates) {
+        if (load[hot] <= mean_load * rebalance_ratio)
+            break;
+
+        if (load[hot] < load[cold] + (2 * c.first))
+            break;
+
+        // Only move a bucket with nothing queued or processing
+        uint64_t expected = static_cast<uint64_t>(hot) << 32;
+        uint64_t desired = static_cast<uint64_t>(cold) << 32;
+
+        if (!bucket_state[c.second].compare_exchange_strong(expected, desired, std::memory_order_acq_rel))
+            continue;
+
+        load[hot] -= c.first;
+        load[cold] += c.first;
+
+        packet_threads[hot]->buckets_out++;
+        packet_threads[cold]->buckets_in++;
+    }
+}
+
+std::shared_ptr<tracker_element> packet_chain::thread_stats_endp_handler() {
+    auto ret = std::make_shared<tracker_element_vector>();
+
+    if (packet_threads == nullptr)
+        return ret;
+
+    std::vector<uint32_t> buckets(n_packet_threads, 0);
+    for (size_t b = 0; b < n_assignment_buckets; b++)
+        buckets[bucket_state[b].load(std::memory_order_relaxed) >> 32]++;
+
+    std::lock_guard<std::mutex> lk(thread_stats_mutex);
+
+    for (unsigned int t = 0; t < n_packet_threads; t++) {
+        auto pt = packet_threads[t];
+        auto rec = std::make_shared<packet_chain_thread_stats_record>(thread_stats_record_id);
+
+        rec->set_thread_id(t);
+        rec->set_queue_len(pt->packet_queue.size_approx());
+        rec->set_utilization(pt->utilization);
+        rec->set_packet_rate(pt->packet_rate);
+        rec->set_packets(pt->packets.load(std::memory_order_relaxed));
+        rec->set_buckets(buckets[t]);
+        rec->set_buckets_in(pt->buckets_in);
+        rec->set_buckets_out(pt->buckets_out);
+
+        ret->push_back(rec);
+    }
+
+    return ret;
+}
+
+void packet_chain::packet_dlts(const std::shared_ptr<kis_packet>& in_pack,
+        unsigned int& lf_dlt, unsigned int& dc_dlt, bool& has_lf, bool& has_dc) {
+    // Look at the components directly; this runs for every packet at every stage and
+    // doesn't need to copy the shared pointers
+    auto lf = static_cast<kis_datachunk *>(in_pack->content_vec[pack_comp_linkframe].get());
+    auto dc = static_cast<kis_datachunk *>(in_pack->content_vec[pack_comp_decap].get());
+
+    has_lf = lf != nullptr;
+    has_dc = dc != nullptr;
+    lf_dlt = has_lf ? lf->dlt : 0;
+    dc_dlt = has_dc ? dc->dlt : 0;
+}
+
+bool packet_chain::handler_accepts(const std::shared_ptr<pc_link>& pcl,
+        const std::shared_ptr<kis_packet>& in_pack) {
+    auto mask = pcl->component_mask;
+
+    while (mask != 0) {
+        auto c = __builtin_ctzll(mask);
+        if (in_pack->content_vec[c] == nullptr)
+            return false;
+        mask &= mask - 1;
+    }
+
+    if (pcl->dlts.size() == 0)
+        return true;
+
+    unsigned int lf_dlt, dc_dlt;
+    bool has_lf, has_dc;
+    packet_dlts(in_pack, lf_dlt, dc_dlt, has_lf, has_dc);
+
+    for (const auto& d : pcl->dlts) {
+        if ((has_lf && d == lf_dlt) || (has_dc && d == dc_dlt))
+            return true;
+    }
+
+    return false;
+}
+
+void packet_chain::dispatch_slice(const handler_chains& chains, int in_chain,
+        const std::shared_ptr<kis_packet> *in_packs, size_t n_packs) {
+    // Packets which pass a handler filter, when only part of the slice does
+    thread_local std::vector<std::shared_ptr<kis_packet>> filtered;
+
+    const auto timed = sample_handler_timing();
+
+    // Decapsulation happens in the postcap chain, so after that the linktypes of a
+    // packet are fixed and a slice with one set of linktypes can use the dispatch
+    // table directly
+    const std::vector<std::shared_ptr<pc_link>> *handlers = &chains.chains[in_chain];
+    bool dispatched = false;
+
+    if (in_chain != CHAINPOS_POSTCAP && chains.n_dlt_index > 1) {
+        size_t key = 0;
+
+        for (size_t p = 0; p < n_packs; p++) {
+            unsigned int lf_dlt, dc_dlt;
+            bool has_lf, has_dc;
+            packet_dlts(in_packs[p], lf_dlt, dc_dlt, has_lf, has_dc);
+
+            size_t lf_idx = 0, dc_idx = 0;
+
+            if (has_lf) {
+                auto i = chains.dlt_index.find(lf_dlt);
+                if (i != chains.dlt_index.end())
+                    lf_idx = i->second;
+            }
+
+            if (has_dc) {
+                auto i = chains.dlt_index.find(dc_dlt);
+                if (i != chains.dlt_index.end())
+                    dc_idx = i->second;
+            }
+
+            auto pkey = (lf_idx * chains.n_dlt_index) + dc_idx;
+
+            if (p == 0) {
+                key = pkey;
+                dispatched = true;
+            } else if (pkey != key) {
+                dispatched = false;
+                break;
+            }
         }
 
-        for (const auto& pcl : tracker_chain) {
-            if (pcl->callback != nullptr)
-                pcl->callback(pcl->auxdata, packet);
+        if (dispatched)
+            handlers = &chains.dispatch[in_chain][key];
+    }
+
+    for (const auto& pcl : *handlers) {
+        auto packs = in_packs;
+        auto n = n_packs;
+
+        if (pcl->component_mask != 0 || (!dispatched && pcl->dlts.size() != 0)) {
+            filtered.clear();
+
+            for (size_t p = 0; p < n_packs; p++) {
+                if (handler_accepts(pcl, in_packs[p]))
+                    filtered.push_back(in_packs[p]);
+            }
+
+            if (filtered.size() == 0)
+                continue;
+
+            if (filtered.size() != n_packs) {
+                packs = filtered.data();
+                n = filtered.size();
+            }
         }
 
-        for (const auto& pcl : logging_chain) {
-            if (pcl->callback != nullptr)
-                pcl->callback(pcl->auxdata, packet);
+        if (pcl->logger != nullptr)
+            enqueue_async_logger(pcl, packs, n);
+        else
+            invoke_handler(pcl, packs, n, timed);
+    }
+
+    filtered.clear();
+}
+
+bool packet_chain::sample_handler_timing() {
+    thread_local unsigned int sample_counter = 0;
+
+    if (handler_sample_rate == 0)
+        return false;
+
+    return (++sample_counter % handler_sample_rate) == 0;
+}
+
+void packet_chain::invoke_handler(const std::shared_ptr<pc_link>& pcl,
+        const std::shared_ptr<kis_packet> *in_packs, size_t n_packs, bool timed) {
+
+    if (pcl->batch_callback != nullptr) {
+        if (timed) {
+            auto start = handler_ticks();
+            pcl->batch_callback(pcl->auxdata, in_packs, n_packs);
+            pcl->stats->record((handler_ticks() - start) / n_packs);
+        } else {
+            pcl->batch_callback(pcl->auxdata, in_packs, n_packs);
+        }
+    } else if (pcl->callback != nullptr) {
+        if (timed) {
+            for (size_t p = 0; p < n_packs; p++) {
+                auto start = handler_ticks();
+                pcl->callback(pcl->auxdata, in_packs[p]);
+                pcl->stats->record(handler_ticks() - start);
+            }
+        } else {
+            for (size_t p = 0; p < n_packs; p++)
+                pcl->callback(pcl->auxdata, in_packs[p]);
         }
+    }
 
-        packet->mutex.unlock();
+    pcl->stats->packets.fetch_add(n_packs, std::memory_order_relaxed);
+}
 
-        uint64_t now = Globalreg::globalreg->last_tv_sec;
+std::shared_ptr<tracker_element> packet_chain::handler_stats_endp_handler() {
+    // Derive the tick rate from the elapsed cycle counter since startup
+    auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - handler_clock_base).count();
+    auto elapsed_ticks = handler_ticks() - handler_ticks_base;
 
-        if (packet->error)
-            packet_error_rrd->add_sample(1, now);
+    double ns_per_tick = 1;
+    if (elapsed_ticks != 0 && elapsed_ns > 0)
+        ns_per_tick = static_cast<double>(elapsed_ns) / elapsed_ticks;
 
-        if (packet->duplicate)
-            packet_dupe_rrd->add_sample(1, now);
+    auto ret = std::make_shared<tracker_element_vector>();
+
+    std::shared_ptr<const handler_chains> chains;
+    fetch_chains(chains);
+
+    for (int c = CHAINPOS_POSTCAP; c < CHAINPOS_MAX; c++) {
+        unsigned int pos = 0;
+
+        for (const auto& pcl : chains->chains[c]) {
+            auto rec = std::make_shared<packet_chain_handler_stats_record>(handler_stats_record_id);
+
+            rec->set_name(pcl->name);
+            rec->set_chain(chain_name(c));
+            rec->set_chain_position(pos++);
+            rec->set_priority(pcl->priority);
+            rec->set_handler_id(pcl->id);
+            rec->set_batch(pcl->batch_callback != nullptr);
+
+            const auto& st = pcl->stats;
+
+            rec->set_packets(st->packets.load(std::memory_order_relaxed));
+
+            // Snapshot the histogram; concurrent updates may make the totals differ
+            // slightly, so percentiles are computed from the snapshot itself
+            std::array<uint64_t, handler_stats::n_buckets> buckets;
+            uint64_t total = 0;
+            for (unsigned int b = 0; b < handler_stats::n_buckets; b++) {
+                buckets[b] = st->buckets[b].load(std::memory_order_relaxed);
+                total += buckets[b];
+            }
+
+            rec->set_samples(total);
+
+            if (total != 0) {
+                rec->set_latency_mean_ns((st->sample_ticks.load(std::memory_order_relaxed) * ns_per_tick) /
+                        st->samples.load(std::memory_order_relaxed));
+                rec->set_latency_max_ns(st->max_ticks.load(std::memory_order_relaxed) * ns_per_tick);
+
+                auto percentile = [&](double pct) -> double {
+                    uint64_t target = std::max<uint64_t>(1, std::ceil(total * pct));
+                    uint64_t seen = 0;
+
+                    for (unsigned int b = 0; b < handler_stats::n_buckets; b++) {
+                        seen += buckets[b];
+                        if (seen >= target)
+                            return handler_stats::bucket_floor(b) * ns_per_tick;
+                    }
+
+                    return 0;
+                };
+
+                rec->set_latency_p50_ns(percentile(0.50));
+                rec->set_latency_p90_ns(percentile(0.90));
+                rec->set_latency_p99_ns(percentile(0.99));
+
+                auto bucket_ns = rec->get_latency_bucket_ns();
+                auto bucket_count = rec->get_latency_bucket_count();
 
-        packet_processed_rrd->add_sample(1, now);
+                for (unsigned int b = 0; b < handler_stats::n_buckets; b++) {
+                    if (buckets[b] == 0)
+                        continue;
 
-        continue;
+                    bucket_ns->push_back(handler_stats::bucket_floor(b) * ns_per_tick);
+                    bucket_count->push_back(buckets[b]);
+                }
+            }
+
+            ret->push_back(rec);
+        }
     }
+
+    return ret;
 }
 
 int packet_chain::process_packet(std::shared_ptr<kis_packet> in_pack) {
@@ -484,43 +1035,28 @@ int packet_chain::process_packet(std::shared_ptr<kis_packet> in_pack) {
     time_t now = (time_t) Globalreg::globalreg->last_tv_sec;
 
     // Total packet rate always gets added, even when we drop, so we can compare
-    packet_rate_rrd->add_sample(1, now);
-    packet_peak_rrd->add_sample(1, now);
+    packet_rate_counter->add(1);
+    packet_peak_counter->add(1);
 
-    // Import the new postcap chain, if it has been modified
-    kis_unique_lock<kis_shared_mutex> lk(packetchain_mutex, "process_packet");
-    if (postcap_chain_update) {
-        postcap_chain = postcap_chain_new;
-        postcap_chain_new.clear();
-        postcap_chain_update = false;
-    }
-    lk.unlock();
+    // Postcap runs in whatever capture thread injected the packet, so each thread
+    // keeps its own cached copy of the chain snapshot
+    thread_local std::shared_ptr<const handler_chains> postcap_chains;
 
     // Run the post-capture processing
-    for (const auto& pcl : postcap_chain) {
-        if (pcl->callback != nullptr)
-            pcl->callback(pcl->auxdata, in_pack);
-    }
+    dispatch_slice(*fetch_chains(postcap_chains), CHAINPOS_POSTCAP, &in_pack, 1);
 
     // assign it to a thread
-    unsigned int processing_id;
-
-    // If there is no assignment id, randomly assign the packet to a thread.
-    // Otherwise transform the assignment id to a consistent thread.
-    // If the packet is a duplicate, assign it to the same thread as the original.
-    if (in_pack->assignment_id == 0) {
-        if (in_pack->original != nullptr) {
-            processing_id = in_pack->original->assignment_id % n_packet_threads;
-        } else {
-            processing_id = rand() % n_packet_threads;
-        }
-    } else {
-        processing_id = in_pack->assignment_id % n_packet_threads;
-    }
+    auto processing_id = assign_packet_thread(in_pack);
 
     auto qsize = packet_threads[processing_id]->packet_queue.size_approx();
 
-    if (packet_queue_drop != 0 && qsize > packet_queue_drop) {
+    // Shed packets by priority as the backlog grows; the lowest priority packets hit
+    // their watermark first, and high priority packets are only dropped at the limit
+    auto shed_priority = in_pack->shed_priority;
+    if (shed_priority < packet_shed_low || shed_priority >= packet_shed_max)
+        shed_priority = packet_shed_normal;
+
+    if (packet_queue_drop != 0 && qsize > packet_shed_limit[shed_priority]) {
         time_t offt = now - last_packet_drop_user_warning;
 
         if (offt > 30) {
@@ -530,14 +1066,18 @@ int packet_chain::process_packet(std::shared_ptr<kis_packet> in_pack) {
                 Globalreg::fetch_mandatory_global_as<alert_tracker>();
             alertracker->raise_one_shot("PACKETLOST",
                     "SYSTEM", kis_alert_severity::high,
-                    fmt::format("The packet queue has exceeded the maximum size of {}; Kismet "
-                        "will start dropping packets.  Your system may not have enough CPU to keep "
-                        "up with the packet rate in your environment or other processes may be "
-                        "taking up the CPU.  You can increase the packet backlog with the "
-                        "packet_backlog_limit configuration parameter.", packet_queue_drop), -1);
+                    fmt::format("The packet queue has grown to {} of the maximum size of {}; Kismet "
+                        "is dropping packets, starting with the lowest priority packets.  Your system "
+                        "may not have enough CPU to keep up with the packet rate in your environment "
+                        "or other processes may be taking up the CPU.  You can increase the packet "
+                        "backlog with the packet_backlog_limit configuration parameter.",
+                        qsize, packet_queue_drop), -1);
         }
 
-        packet_drop_rrd->add_sample(1, now);
+        packet_drop_counter->add(1);
+        packet_shed_drop_counter[shed_priority]->add(1);
+
+        release_packet_bucket(in_pack.get());
 
         return 1;
     }
@@ -562,336 +1102,380 @@ int packet_chain::process_packet(std::shared_ptr<kis_packet> in_pack) {
 
     // Queue the packet to the target thread
     packet_threads[processing_id]->packet_queue.enqueue(in_pack);
-    packet_queue_rrd->add_sample(qsize, now);
+    packet_queue_counter->add(qsize);
 
     return 1;
 }
 
-int packet_chain::register_int_handler(pc_callback in_cb, void *in_aux, int in_chain, int in_prio) {
-
-    kis_lock_guard<kis_shared_mutex> lk(packetchain_mutex, "register_int_handler");
+void packet_chain::update_chain(int in_chain,
+        const std::function<void (std::vector<std::shared_ptr<pc_link>>&)>& mutator) {
+    auto chains = std::make_shared<handler_chains>(*std::atomic_load(&chain_snapshot));
 
-    auto link = new pc_link;
+    mutator(chains->chains[in_chain]);
+    build_dispatch(*chains);
 
-    // Generate packet, we'll nuke it if it's invalid later
-    link->priority = in_prio;
-    link->callback = in_cb;
-    link->auxdata = in_aux;
-    link->id = next_handlerid++;
+    // Publish the snapshot before the version, so any worker which sees the new
+    // version is guaranteed to load the new snapshot
+    chains->version = chain_version + 1;
+    std::atomic_store_explicit(&chain_snapshot, std::shared_ptr<const handler_chains>(chains),
+            std::memory_order_release);
+    chain_version.store(chains->version, std::memory_order_release);
+}
 
-    switch (in_chain) {
-        case CHAINPOS_POSTCAP:
-            if (!postcap_chain_update) {
-                postcap_chain_update = true;
-                postcap_chain_new = postcap_chain;
-            }
+void packet_chain::build_dispatch(handler_chains& chains) {
+    chains.dlt_index.clear();
 
-            postcap_chain_new.push_back(link);
-            stable_sort(postcap_chain_new.begin(), postcap_chain_new.end(),
-                    SortLinkPriority());
-            break;
+    // Index 0 is every DLT no handler asked for
+    std::vector<unsigned int> dlts{0};
 
-        case CHAINPOS_LLCDISSECT:
-            if (!llcdissect_chain_update) {
-                llcdissect_chain_update = true;
-                llcdissect_chain_new = llcdissect_chain;
+    for (const auto& chain : chains.chains) {
+        for (const auto& pcl : chain) {
+            for (const auto& d : pcl->dlts) {
+                if (chains.dlt_index.find(d) == chains.dlt_index.end()) {
+                    chains.dlt_index[d] = dlts.size();
+                    dlts.push_back(d);
+                }
             }
+        }
+    }
 
-            llcdissect_chain_new.push_back(link);
-            stable_sort(llcdissect_chain_new.begin(), llcdissect_chain_new.end(),
-                    SortLinkPriority());
-            break;
+    chains.n_dlt_index = dlts.size();
 
-        case CHAINPOS_DECRYPT:
-            if (!decrypt_chain_update) {
-                decrypt_chain_update = true;
-                decrypt_chain_new = decrypt_chain;
-            }
+    for (int c = 0; c < CHAINPOS_MAX; c++) {
+        auto& dispatch = chains.dispatch[c];
 
-            decrypt_chain_new.push_back(link);
-            stable_sort(decrypt_chain_new.begin(), decrypt_chain_new.end(),
-                    SortLinkPriority());
-            break;
+        dispatch.clear();
+        dispatch.resize(chains.n_dlt_index * chains.n_dlt_index);
 
-        case CHAINPOS_DATADISSECT:
-            if (!datadissect_chain_update) {
-                datadissect_chain_update = true;
-                datadissect_chain_new = datadissect_chain;
-            }
+        for (size_t lf = 0; lf < chains.n_dlt_index; lf++) {
+            for (size_t dc = 0; dc < chains.n_dlt_index; dc++) {
+                auto& list = dispatch[(lf * chains.n_dlt_index) + dc];
 
-            datadissect_chain_new.push_back(link);
-            stable_sort(datadissect_chain_new.begin(), datadissect_chain_new.end(),
-                    SortLinkPriority());
-            break;
+                for (const auto& pcl : chains.chains[c]) {
+                    if (pcl->dlts.size() == 0) {
+                        list.push_back(pcl);
+                        continue;
+                    }
 
-        case CHAINPOS_CLASSIFIER:
-            if (!classifier_chain_update) {
-                classifier_chain_update = true;
-                classifier_chain_new = classifier_chain;
+                    for (const auto& d : pcl->dlts) {
+                        if ((lf != 0 && d == dlts[lf]) || (dc != 0 && d == dlts[dc])) {
+                            list.push_back(pcl);
+                            break;
+                        }
+                    }
+                }
             }
+        }
+    }
+}
 
-            classifier_chain_new.push_back(link);
-            stable_sort(classifier_chain_new.begin(), classifier_chain_new.end(),
-                    SortLinkPriority());
-            break;
+int packet_chain::register_int_handler(pc_callback in_cb, pc_batch_callback in_batch_cb,
+        void *in_aux, int in_chain, int in_prio, const std::string& in_name,
+        const pc_filter& in_filter) {
+    if (in_chain < CHAINPOS_POSTCAP || in_chain >= CHAINPOS_MAX) {
+        _MSG("packet_chain::register_handler requested unknown chain", MSGFLAG_ERROR);
+        return -1;
+    }
 
-        case CHAINPOS_TRACKER:
-            if (!tracker_chain_update) {
-                tracker_chain_update = true;
-                tracker_chain_new = tracker_chain;
-            }
+    kis_lock_guard<kis_shared_mutex> lk(packetchain_mutex, "register_int_handler");
 
-            tracker_chain_new.push_back(link);
-            stable_sort(tracker_chain_new.begin(), tracker_chain_new.end(),
-                    SortLinkPriority());
-            break;
+    auto link = std::make_shared<pc_link>();
 
-        case CHAINPOS_LOGGING:
-            if (!logging_chain_update) {
-                logging_chain_update = true;
-                logging_chain_new = logging_chain;
-            }
+    link->priority = in_prio;
+    link->callback = in_cb;
+    link->batch_callback = in_batch_cb;
+    link->auxdata = in_aux;
+    link->id = next_handlerid++;
+    link->stats = std::make_shared<handler_stats>();
 
-            logging_chain_new.push_back(link);
-            stable_sort(logging_chain_new.begin(), logging_chain_new.end(),
-                    SortLinkPriority());
-            break;
+    link->dlts = in_filter.dlts;
+    link->component_mask = 0;
 
-        default:
-            _MSG("packet_chain::register_handler requested unknown chain", MSGFLAG_ERROR);
+    for (const auto& c : in_filter.components) {
+        if (c < 0 || c >= MAX_PACKET_COMPONENTS) {
+            _MSG_ERROR("packet_chain::register_handler given invalid packet component {} "
+                    "for handler {}", c, in_name);
             return -1;
+        }
+
+        link->component_mask |= (1ULL << c);
     }
 
+    if (in_name.length() != 0)
+        link->name = in_name;
+    else
+        link->name = fmt::format("{} handler {}", chain_name(in_chain), link->id);
+
+    if (in_chain == CHAINPOS_LOGGING && async_logging)
+        start_async_logger(link);
+
+    update_chain(in_chain, [&link](std::vector<std::shared_ptr<pc_link>>& chain) {
+            chain.push_back(link);
+            std::stable_sort(chain.begin(), chain.end(), SortLinkPriority());
+        });
+
     return link->id;
 }
 
-int packet_chain::register_handler(pc_callback in_cb, void *in_aux, int in_chain, int in_prio) {
-    return register_int_handler(in_cb, in_aux, in_chain, in_prio);
+int packet_chain::register_handler(pc_callback in_cb, void *in_aux, int in_chain, int in_prio,
+        const std::string& in_name, const pc_filter& in_filter) {
+    return register_int_handler(in_cb, nullptr, in_aux, in_chain, in_prio, in_name, in_filter);
+}
+
+int packet_chain::register_batch_handler(pc_batch_callback in_cb, void *in_aux, int in_chain, int in_prio,
+        const std::string& in_name, const pc_filter& in_filter) {
+    return register_int_handler(nullptr, in_cb, in_aux, in_chain, in_prio, in_name, in_filter);
+}
+
+int packet_chain::remove_handler_if(int in_chain,
+        const std::function<bool (const std::shared_ptr<pc_link>&)>& match) {
+    if (in_chain < CHAINPOS_POSTCAP || in_chain >= CHAINPOS_MAX) {
+        _MSG("packet_chain::remove_handler requested unknown chain", MSGFLAG_ERROR);
+        return -1;
+    }
+
+    std::vector<std::shared_ptr<pc_link>> removed;
+
+    {
+        kis_lock_guard<kis_shared_mutex> lk(packetchain_mutex, "remove_handler");
+
+        update_chain(in_chain, [&match, &removed](std::vector<std::shared_ptr<pc_link>>& chain) {
+                auto i = std::stable_partition(chain.begin(), chain.end(),
+                        [&match](const std::shared_ptr<pc_link>& l) { return !match(l); });
+                removed.insert(removed.end(), i, chain.end());
+                chain.erase(i, chain.end());
+            });
+    }
+
+    // Loggers flush what they already have queued, outside of the chain lock so
+    // that a logger can still register or remove handlers while it finishes
+    for (const auto& pcl : removed)
+        stop_async_logger(pcl);
+
+    return 1;
 }
 
 int packet_chain::remove_handler(int in_id, int in_chain) {
-    kis_lock_guard<kis_shared_mutex> lk(packetchain_mutex, "remove_handler");
+    return remove_handler_if(in_chain,
+            [in_id](const std::shared_ptr<pc_link>& l) { return l->id == in_id; });
+}
 
-    unsigned int x;
+int packet_chain::remove_handler(pc_callback in_cb, int in_chain) {
+    return remove_handler_if(in_chain,
+            [in_cb](const std::shared_ptr<pc_link>& l) { return l->callback == in_cb; });
+}
 
-    switch (in_chain) {
-        case CHAINPOS_POSTCAP:
-            if (!postcap_chain_update) {
-                postcap_chain_update = true;
-                postcap_chain_new = postcap_chain;
-            }
+int packet_chain::remove_handler(pc_batch_callback in_cb, int in_chain) {
+    return remove_handler_if(in_chain,
+            [in_cb](const std::shared_ptr<pc_link>& l) { return l->batch_callback == in_cb; });
+}
 
-            for (x = 0; x < postcap_chain_new.size(); x++) {
-                if (postcap_chain_new[x]->id == in_id) {
-                    delete(*(postcap_chain_new.begin() + x));
-                    postcap_chain_new.erase(postcap_chain_new.begin() + x);
-                }
-            }
-            break;
+int packet_chain::set_logging_policy(int in_id, log_overflow_policy in_policy, size_t in_queue_max) {
+    std::shared_ptr<const handler_chains> chains;
 
-        case CHAINPOS_LLCDISSECT:
-            if (!llcdissect_chain_update) {
-                llcdissect_chain_update = true;
-                llcdissect_chain_new = llcdissect_chain;
-            }
+    for (const auto& pcl : fetch_chains(chains)->chains[CHAINPOS_LOGGING]) {
+        if (pcl->id != in_id)
+            continue;
 
-            for (x = 0; x < llcdissect_chain_new.size(); x++) {
-                if (llcdissect_chain_new[x]->id == in_id) {
-                    delete(*(llcdissect_chain_new.begin() + x));
-                    llcdissect_chain_new.erase(llcdissect_chain_new.begin() + x);
-                }
-            }
-            break;
+        if (pcl->logger == nullptr)
+            return 0;
 
-        case CHAINPOS_DECRYPT:
-            if (!decrypt_chain_update) {
-                decrypt_chain_update = true;
-                decrypt_chain_new = decrypt_chain;
-            }
+        {
+            std::lock_guard<std::mutex> lk(pcl->logger->mutex);
+            pcl->logger->policy = in_policy;
+            if (in_queue_max != 0)
+                pcl->logger->max_queue = in_queue_max;
+        }
 
-            for (x = 0; x < decrypt_chain_new.size(); x++) {
-                if (decrypt_chain_new[x]->id == in_id) {
-                    delete(*(decrypt_chain_new.begin() + x));
-                    decrypt_chain_new.erase(decrypt_chain_new.begin() + x);
-                }
-            }
-            break;
+        pcl->logger->cv.notify_all();
 
-        case CHAINPOS_DATADISSECT:
-            if (!datadissect_chain_update) {
-                datadissect_chain_update = true;
-                datadissect_chain_new = datadissect_chain;
-            }
+        return 1;
+    }
 
-            for (x = 0; x < datadissect_chain_new.size(); x++) {
-                if (datadissect_chain_new[x]->id == in_id) {
-                    delete(*(datadissect_chain_new.begin() + x));
-                    datadissect_chain_new.erase(datadissect_chain_new.begin() + x);
-                }
-            }
-            break;
+    return -1;
+}
 
-        case CHAINPOS_CLASSIFIER:
-            if (!classifier_chain_update) {
-                classifier_chain_update = true;
-                classifier_chain_new = classifier_chain;
-            }
+void packet_chain::start_async_logger(const std::shared_ptr<pc_link>& pcl) {
+    pcl->logger = std::make_shared<async_logger>(async_log_policy, async_log_queue_max);
+    pcl->logger->thread = std::thread([this, pcl]() {
+            thread_set_process_name(fmt::format("LOG {}", pcl->id));
+            async_logger_processor(pcl);
+        });
+}
 
-            for (x = 0; x < classifier_chain_new.size(); x++) {
-                if (classifier_chain_new[x]->id == in_id) {
-                    delete(*(classifier_chain_new.begin() + x));
-                    classifier_chain_new.erase(classifier_chain_new.begin() + x);
-                }
-            }
-            break;
+void packet_chain::stop_async_logger(const std::shared_ptr<pc_link>& pcl) {
+    auto logger = pcl->logger;
 
-        case CHAINPOS_TRACKER:
-            if (!tracker_chain_update) {
-                tracker_chain_update = true;
-                tracker_chain_new = tracker_chain;
-            }
+    if (logger == nullptr)
+        return;
 
-            for (x = 0; x < tracker_chain_new.size(); x++) {
-                if (tracker_chain_new[x]->id == in_id) {
-                    delete(*(tracker_chain_new.begin() + x));
-                    tracker_chain_new.erase(tracker_chain_new.begin() + x);
-                }
+    {
+        std::lock_guard<std::mutex> lk(logger->mutex);
+        logger->stopping = true;
+    }
+
+    logger->cv.notify_all();
+
+    if (!logger->thread.joinable())
+        return;
+
+    // A logger removing itself from inside its own callback can't wait for itself
+    if (logger->thread.get_id() == std::this_thread::get_id())
+        logger->thread.detach();
+    else
+        logger->thread.join();
+}
+
+void packet_chain::enqueue_async_logger(const std::shared_ptr<pc_link>& pcl,
+        const std::shared_ptr<kis_packet> *in_packs, size_t n_packs) {
+    auto& logger = pcl->logger;
+
+    {
+        std::unique_lock<std::mutex> lk(logger->mutex);
+
+        for (size_t p = 0; p < n_packs; p++) {
+            if (logger->policy == log_overflow_policy::block &&
+                    logger->queue.size() >= logger->max_queue) {
+                logger->blocked.fetch_add(1, std::memory_order_relaxed);
+
+                // The logger may not have been told about what we queued so far
+                logger->cv.notify_all();
+                logger->cv.wait(lk, [&logger]() {
+                        return logger->stopping || logger->queue.size() < logger->max_queue ||
+                            logger->policy != log_overflow_policy::block;
+                    });
             }
-            break;
 
-        case CHAINPOS_LOGGING:
-            if (!logging_chain_update) {
-                logging_chain_update = true;
-                logging_chain_new = logging_chain;
+            if (logger->stopping) {
+                logger->dropped.fetch_add(n_packs - p, std::memory_order_relaxed);
+                break;
             }
 
-            for (x = 0; x < logging_chain_new.size(); x++) {
-                if (logging_chain_new[x]->id == in_id) {
-                    delete(*(logging_chain_new.begin() + x));
-                    logging_chain_new.erase(logging_chain_new.begin() + x);
-                }
+            if (logger->queue.size() >= logger->max_queue) {
+                logger->dropped.fetch_add(1, std::memory_order_relaxed);
+
+                if (logger->policy == log_overflow_policy::drop_newest)
+                    continue;
+
+                logger->queue.pop_front();
             }
-            break;
 
-        default:
-            _MSG("packet_chain::remove_handler requested unknown chain",
-                    MSGFLAG_ERROR);
-            return -1;
+            logger->queue.push_back(in_packs[p]);
+            logger->queued.fetch_add(1, std::memory_order_relaxed);
+        }
     }
 
-    return 1;
+    logger->cv.notify_all();
 }
 
-int packet_chain::remove_handler(pc_callback in_cb, int in_chain) {
-    kis_lock_guard<kis_shared_mutex> lk(packetchain_mutex, "remove_handler");
+void packet_chain::async_logger_processor(std::shared_ptr<pc_link> pcl) {
+    static constexpr size_t max_log_batch = 64;
 
-    unsigned int x;
+    auto& logger = pcl->logger;
 
-    switch (in_chain) {
-        case CHAINPOS_POSTCAP:
-            if (!postcap_chain_update) {
-                postcap_chain_update = true;
-                postcap_chain_new = postcap_chain;
-            }
+    std::vector<std::shared_ptr<kis_packet>> batch;
+    batch.reserve(max_log_batch);
 
-            for (x = 0; x < postcap_chain_new.size(); x++) {
-                if (postcap_chain_new[x]->callback == in_cb) {
-                    delete(*(postcap_chain_new.begin() + x));
-                    postcap_chain_new.erase(postcap_chain_new.begin() + x);
-                }
-            }
-            break;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lk(logger->mutex);
 
-        case CHAINPOS_LLCDISSECT:
-            if (!llcdissect_chain_update) {
-                llcdissect_chain_update = true;
-                llcdissect_chain_new = llcdissect_chain;
-            }
+            logger->cv.wait(lk, [&logger]() {
+                    return logger->stopping || !logger->queue.empty();
+                });
 
-            for (x = 0; x < llcdissect_chain_new.size(); x++) {
-                if (llcdissect_chain_new[x]->callback == in_cb) {
-                    delete(*(llcdissect_chain_new.begin() + x));
-                    llcdissect_chain_new.erase(llcdissect_chain_new.begin() + x);
-                }
-            }
-            break;
+            // Stopping drains the queue before exiting
+            if (logger->queue.empty())
+                break;
 
-        case CHAINPOS_DECRYPT:
-            if (!decrypt_chain_update) {
-                decrypt_chain_update = true;
-                decrypt_chain_new = decrypt_chain;
+            while (!logger->queue.empty() && batch.size() < max_log_batch) {
+                batch.push_back(std::move(logger->queue.front()));
+                logger->queue.pop_front();
             }
+        }
 
-            for (x = 0; x < decrypt_chain_new.size(); x++) {
-                if (decrypt_chain_new[x]->callback == in_cb) {
-                    delete(*(decrypt_chain_new.begin() + x));
-                    decrypt_chain_new.erase(decrypt_chain_new.begin() + x);
-                }
-            }
-            break;
+        // Wake any packet threads blocked on a full queue
+        logger->cv.notify_all();
 
-        case CHAINPOS_DATADISSECT:
-            if (!datadissect_chain_update) {
-                datadissect_chain_update = true;
-                datadissect_chain_new = datadissect_chain;
-            }
+        invoke_handler(pcl, batch.data(), batch.size(), sample_handler_timing());
+        logger->logged.fetch_add(batch.size(), std::memory_order_relaxed);
 
-            for (x = 0; x < datadissect_chain_new.size(); x++) {
-                if (datadissect_chain_new[x]->callback == in_cb) {
-                    delete(*(datadissect_chain_new.begin() + x));
-                    datadissect_chain_new.erase(datadissect_chain_new.begin() + x);
-                }
-            }
-            break;
+        batch.clear();
+    }
+}
 
-        case CHAINPOS_CLASSIFIER:
-            if (!classifier_chain_update) {
-                classifier_chain_update = true;
-                classifier_chain_new = classifier_chain;
-            }
+std::string packet_chain::log_overflow_policy_name(log_overflow_policy in_policy) {
+    switch (in_policy) {
+        case log_overflow_policy::block:
+            return "block";
+        case log_overflow_policy::drop_oldest:
+            return "drop_oldest";
+        case log_overflow_policy::drop_newest:
+            return "drop_newest";
+        default:
+            return "unknown";
+    }
+}
 
-            for (x = 0; x < classifier_chain_new.size(); x++) {
-                if (classifier_chain_new[x]->callback == in_cb) {
-                    delete(*(classifier_chain_new.begin() + x));
-                    classifier_chain_new.erase(classifier_chain_new.begin() + x);
-                }
-            }
-            break;
+std::shared_ptr<tracker_element> packet_chain::packet_stats_endp_handler() {
+    // The RRDs are shared directly, as they protect themselves; the logger stats are
+    // built fresh for every request
+    auto ret = std::make_shared<tracker_element_map>();
 
-        case CHAINPOS_TRACKER:
-            if (!tracker_chain_update) {
-                tracker_chain_update = true;
-                tracker_chain_new = tracker_chain;
-            }
+    for (const auto& i : *packet_stats_map)
+        ret->insert(i.second);
 
-            for (x = 0; x < tracker_chain_new.size(); x++) {
-                if (tracker_chain_new[x]->callback == in_cb) {
-                    delete(*(tracker_chain_new.begin() + x));
-                    tracker_chain_new.erase(tracker_chain_new.begin() + x);
-                }
-            }
-            break;
+    auto loggers = std::make_shared<tracker_element_vector>(logger_stats_vec_id);
 
-        case CHAINPOS_LOGGING:
-            if (!logging_chain_update) {
-                logging_chain_update = true;
-                logging_chain_new = logging_chain;
-            }
+    std::shared_ptr<const handler_chains> chains;
+    for (const auto& pcl : fetch_chains(chains)->chains[CHAINPOS_LOGGING]) {
+        const auto& logger = pcl->logger;
 
-            for (x = 0; x < logging_chain_new.size(); x++) {
-                if (logging_chain_new[x]->callback == in_cb) {
-                    delete(*(logging_chain_new.begin() + x));
-                    logging_chain_new.erase(logging_chain_new.begin() + x);
-                }
-            }
-            break;
+        if (logger == nullptr)
+            continue;
 
-        default:
-            _MSG("packet_chain::remove_handler requested unknown chain",
-                    MSGFLAG_ERROR);
-            return -1;
+        auto rec = std::make_shared<packet_chain_logger_stats_record>(logger_stats_record_id);
+
+        rec->set_name(pcl->name);
+        rec->set_handler_id(pcl->id);
+
+        {
+            std::lock_guard<std::mutex> lk(logger->mutex);
+            rec->set_overflow_policy(log_overflow_policy_name(logger->policy));
+            rec->set_queue_len(logger->queue.size());
+            rec->set_queue_max(logger->max_queue);
+        }
+
+        rec->set_queued(logger->queued.load(std::memory_order_relaxed));
+        rec->set_logged(logger->logged.load(std::memory_order_relaxed));
+        rec->set_dropped(logger->dropped.load(std::memory_order_relaxed));
+        rec->set_blocked(logger->blocked.load(std::memory_order_relaxed));
+
+        loggers->push_back(rec);
     }
 
-    return 1;
+    ret->insert(loggers);
+
+    return ret;
 }
 
+std::string packet_chain::chain_name(int in_chain) {
+    switch (in_chain) {
+        case CHAINPOS_POSTCAP:
+            return "postcap";
+        case CHAINPOS_LLCDISSECT:
+            return "llcdissect";
+        case CHAINPOS_DECRYPT:
+            return "decrypt";
+        case CHAINPOS_DATADISSECT:
+            return "datadissect";
+        case CHAINPOS_CLASSIFIER:
+            return "classifier";
+        case CHAINPOS_TRACKER:
+            return "tracker";
+        case CHAINPOS_LOGGING:
+            return "logging";
+        default:
+            return "unknown";
+    }
+}
@@ -30,6 +30,11 @@
 #endif
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -43,6 +48,8 @@
 #include "kis_mutex.h"
 #include "kis_net_beast_httpd.h"
 #include "objectpool.h"
+#include "packet_dedupe.h"
+#include "sharded_counter.h"
 #include "unordered_dense.h"
 #include "timetracker.h"
 #include "trackedelement.h"
@@ -97,12 +104,273 @@
 #define CHAINPOS_TRACKER		7
 #define CHAINPOS_LOGGING        8
 
+// Number of chain slots; chains are indexed directly by CHAINPOS_
+#define CHAINPOS_MAX            9
+
 #define CHAINCALL_PARMS \
     void *auxdata __attribute__ ((unused)), \
     const std::shared_ptr<kis_packet>& in_pack
 
+// Batch handlers receive a contiguous run of packets which have all completed
+// the previous chain stage
+#define CHAINCALL_BATCH_PARMS \
+    void *auxdata __attribute__ ((unused)), \
+    const std::shared_ptr<kis_packet> *in_packs, size_t n_packs
+
+// Load shedding priority of a packet, usually assigned during postcap.  When the
+// packet backlog grows, low priority packets are dropped first and high priority
+// packets last.
+enum kis_packet_shed_priority {
+    packet_shed_low = 0,
+    packet_shed_normal = 1,
+    packet_shed_high = 2,
+    packet_shed_max = 3
+};
+
 class kis_packet;
 
+// Per-handler statistics record, generated on demand for the handler_stats endpoint
+class packet_chain_handler_stats_record : public tracker_component {
+public:
+    packet_chain_handler_stats_record() :
+        tracker_component() {
+        register_fields();
+        reserve_fields(NULL);
+    }
+
+    packet_chain_handler_stats_record(int in_id) :
+        tracker_component(in_id) {
+        register_fields();
+        reserve_fields(NULL);
+    }
+
+    packet_chain_handler_stats_record(int in_id, std::shared_ptr<tracker_element_map> e) :
+        tracker_component(in_id) {
+        register_fields();
+        reserve_fields(e);
+    }
+
+    virtual uint32_t get_signature() const override {
+        return adler32_checksum("packet_chain_handler_stats_record");
+    }
+
+    virtual std::shared_ptr<tracker_element> clone_type() noexcept override {
+        using this_t = typename std::remove_pointer<decltype(this)>::type;
+        auto r = std::make_shared<this_t>();
+        r->set_id(this->get_id());
+        return r;
+    }
+
+    __Proxy(name, std::string, std::string, std::string, name);
+    __Proxy(chain, std::string, std::string, std::string, chain);
+    __Proxy(chain_position, uint32_t, uint32_t, uint32_t, chain_position);
+    __Proxy(priority, int32_t, int32_t, int32_t, priority);
+    __Proxy(handler_id, int32_t, int32_t, int32_t, handler_id);
+    __Proxy(batch, uint8_t, bool, bool, batch);
+
+    __Proxy(packets, uint64_t, uint64_t, uint64_t, packets);
+    __Proxy(samples, uint64_t, uint64_t, uint64_t, samples);
+
+    __Proxy(latency_mean_ns, double, double, double, latency_mean_ns);
+    __Proxy(latency_p50_ns, double, double, double, latency_p50_ns);
+    __Proxy(latency_p90_ns, double, double, double, latency_p90_ns);
+    __Proxy(latency_p99_ns, double, double, double, latency_p99_ns);
+    __Proxy(latency_max_ns, double, double, double, latency_max_ns);
+
+    __ProxyTrackable(latency_bucket_ns, tracker_element_vector_double, latency_bucket_ns);
+    __ProxyTrackable(latency_bucket_count, tracker_element_vector_double, latency_bucket_count);
+
+protected:
+    virtual void register_fields() override {
+        tracker_component::register_fields();
+
+        register_field("kismet.packetchain.handler.name", "Handler name", &name);
+        register_field("kismet.packetchain.handler.chain", "Packet chain stage", &chain);
+        register_field("kismet.packetchain.handler.chain_position",
+                "Position of handler within the chain stage", &chain_position);
+        register_field("kismet.packetchain.handler.priority", "Handler priority", &priority);
+        register_field("kismet.packetchain.handler.id", "Handler ID", &handler_id);
+        register_field("kismet.packetchain.handler.batch", "Handler accepts packet batches", &batch);
+        register_field("kismet.packetchain.handler.packets",
+                "Packets processed by handler", &packets);
+        register_field("kismet.packetchain.handler.samples",
+                "Number of timed latency samples", &samples);
+        register_field("kismet.packetchain.handler.latency_mean_ns",
+                "Mean sampled per-packet latency (ns)", &latency_mean_ns);
+        register_field("kismet.packetchain.handler.latency_p50_ns",
+                "50th percentile sampled per-packet latency (ns)", &latency_p50_ns);
+        register_field("kismet.packetchain.handler.latency_p90_ns",
+                "90th percentile sampled per-packet latency (ns)", &latency_p90_ns);
+        register_field("kismet.packetchain.handler.latency_p99_ns",
+                "99th percentile sampled per-packet latency (ns)", &latency_p99_ns);
+        register_field("kismet.packetchain.handler.latency_max_ns",
+                "Maximum sampled per-packet latency (ns)", &latency_max_ns);
+        register_field("kismet.packetchain.handler.latency_bucket_ns",
+                "Latency histogram bucket lower bounds (ns), non-empty buckets only",
+                &latency_bucket_ns);
+        register_field("kismet.packetchain.handler.latency_bucket_count",
+                "Latency histogram bucket counts, matching latency_bucket_ns",
+                &latency_bucket_count);
+    }
+
+    std::shared_ptr<tracker_element_string> name;
+    std::shared_ptr<tracker_element_string> chain;
+    std::shared_ptr<tracker_element_uint32> chain_position;
+    std::shared_ptr<tracker_element_int32> priority;
+    std::shared_ptr<tracker_element_int32> handler_id;
+    std::shared_ptr<tracker_element_uint8> batch;
+    std::shared_ptr<tracker_element_uint64> packets;
+    std::shared_ptr<tracker_element_uint64> samples;
+    std::shared_ptr<tracker_element_double> latency_mean_ns;
+    std::shared_ptr<tracker_element_double> latency_p50_ns;
+    std::shared_ptr<tracker_element_double> latency_p90_ns;
+    std::shared_ptr<tracker_element_double> latency_p99_ns;
+    std::shared_ptr<tracker_element_double> latency_max_ns;
+    std::shared_ptr<tracker_element_vector_double> latency_bucket_ns;
+    std::shared_ptr<tracker_element_vector_double> latency_bucket_count;
+};
+
+// Per-logger statistics record for asynchronous logging handlers
+class packet_chain_logger_stats_record : public tracker_component {
+public:
+    packet_chain_logger_stats_record() :
+        tracker_component() {
+        register_fields();
+        reserve_fields(NULL);
+    }
+
+    packet_chain_logger_stats_record(int in_id) :
+        tracker_component(in_id) {
+        register_fields();
+        reserve_fields(NULL);
+    }
+
+    packet_chain_logger_stats_record(int in_id, std::shared_ptr<tracker_element_map> e) :
+        tracker_component(in_id) {
+        register_fields();
+        reserve_fields(e);
+    }
+
+    virtual uint32_t get_signature() const override {
+        return adler32_checksum("packet_chain_logger_stats_record");
+    }
+
+    virtual std::shared_ptr<tracker_element> clone_type() noexcept override {
+        using this_t = typename std::remove_pointer<decltype(this)>::type;
+        auto r = std::make_shared<this_t>();
+        r->set_id(this->get_id());
+        return r;
+    }
+
+    __Proxy(name, std::string, std::string, std::string, name);
+    __Proxy(handler_id, int32_t, int32_t, int32_t, handler_id);
+    __Proxy(overflow_policy, std::string, std::string, std::string, overflow_policy);
+    __Proxy(queue_len, uint64_t, uint64_t, uint64_t, queue_len);
+    __Proxy(queue_max, uint64_t, uint64_t, uint64_t, queue_max);
+    __Proxy(queued, uint64_t, uint64_t, uint64_t, queued);
+    __Proxy(logged, uint64_t, uint64_t, uint64_t, logged);
+    __Proxy(dropped, uint64_t, uint64_t, uint64_t, dropped);
+    __Proxy(blocked, uint64_t, uint64_t, uint64_t, blocked);
+
+protected:
+    virtual void register_fields() override {
+        tracker_component::register_fields();
+
+        register_field("kismet.packetchain.logger.name", "Logging handler name", &name);
+        register_field("kismet.packetchain.logger.id", "Handler ID", &handler_id);
+        register_field("kismet.packetchain.logger.overflow_policy",
+                "Queue overflow policy (block, drop_oldest, drop_newest)", &overflow_policy);
+        register_field("kismet.packetchain.logger.queue_len", "Packets currently queued", &queue_len);
+        register_field("kismet.packetchain.logger.queue_max", "Maximum queued packets", &queue_max);
+        register_field("kismet.packetchain.logger.queued", "Packets queued for logging", &queued);
+        register_field("kismet.packetchain.logger.logged", "Packets handed to the logger", &logged);
+        register_field("kismet.packetchain.logger.dropped",
+                "Packets dropped because the queue was full", &dropped);
+        register_field("kismet.packetchain.logger.blocked",
+                "Times a packet thread waited for queue space", &blocked);
+    }
+
+    std::shared_ptr<tracker_element_string> name;
+    std::shared_ptr<tracker_element_int32> handler_id;
+    std::shared_ptr<tracker_element_string> overflow_policy;
+    std::shared_ptr<tracker_element_uint64> queue_len;
+    std::shared_ptr<tracker_element_uint64> queue_max;
+    std::shared_ptr<tracker_element_uint64> queued;
+    std::shared_ptr<tracker_element_uint64> logged;
+    std::shared_ptr<tracker_element_uint64> dropped;
+    std::shared_ptr<tracker_element_uint64> blocked;
+};
+
+// Per-thread load record for the thread_stats endpoint
+class packet_chain_thread_stats_record : public tracker_component {
+public:
+    packet_chain_thread_stats_record() :
+        tracker_component() {
+        register_fields();
+        reserve_fields(NULL);
+    }
+
+    packet_chain_thread_stats_record(int in_id) :
+        tracker_component(in_id) {
+        register_fields();
+        reserve_fields(NULL);
+    }
+
+    packet_chain_thread_stats_record(int in_id, std::shared_ptr<tracker_element_map> e) :
+        tracker_component(in_id) {
+        register_fields();
+        reserve_fields(e);
+    }
+
+    virtual uint32_t get_signature() const override {
+        return adler32_checksum("packet_chain_thread_stats_record");
+    }
+
+    virtual std::shared_ptr<tracker_element> clone_type() noexcept override {
+        using this_t = typename std::remove_pointer<decltype(this)>::type;
+        auto r = std::make_shared<this_t>();
+        r->set_id(this->get_id());
+        return r;
+    }
+
+    __Proxy(thread_id, uint32_t, uint32_t, uint32_t, thread_id);
+    __Proxy(queue_len, uint64_t, uint64_t, uint64_t, queue_len);
+    __Proxy(utilization, double, double, double, utilization);
+    __Proxy(packet_rate, double, double, double, packet_rate);
+    __Proxy(packets, uint64_t, uint64_t, uint64_t, packets);
+    __Proxy(buckets, uint32_t, uint32_t, uint32_t, buckets);
+    __Proxy(buckets_in, uint64_t, uint64_t, uint64_t, buckets_in);
+    __Proxy(buckets_out, uint64_t, uint64_t, uint64_t, buckets_out);
+
+protected:
+    virtual void register_fields() override {
+        tracker_component::register_fields();
+
+        register_field("kismet.packetchain.thread.id", "Packet thread number", &thread_id);
+        register_field("kismet.packetchain.thread.queue_len", "Packets currently queued", &queue_len);
+        register_field("kismet.packetchain.thread.utilization",
+                "Percent of the last interval spent processing packets", &utilization);
+        register_field("kismet.packetchain.thread.packet_rate",
+                "Packets per second processed over the last interval", &packet_rate);
+        register_field("kismet.packetchain.thread.packets", "Packets processed", &packets);
+        register_field("kismet.packetchain.thread.buckets",
+                "Assignment buckets currently mapped to the thread", &buckets);
+        register_field("kismet.packetchain.thread.buckets_in",
+                "Assignment buckets migrated to the thread", &buckets_in);
+        register_field("kismet.packetchain.thread.buckets_out",
+                "Assignment buckets migrated away from the thread", &buckets_out);
+    }
+
+    std::shared_ptr<tracker_element_uint32> thread_id;
+    std::shared_ptr<tracker_element_uint64> queue_len;
+    std::shared_ptr<tracker_element_double> utilization;
+    std::shared_ptr<tracker_element_double> packet_rate;
+    std::shared_ptr<tracker_element_uint64> packets;
+    std::shared_ptr<tracker_element_uint32> buckets;
+    std::shared_ptr<tracker_element_uint64> buckets_in;
+    std::shared_ptr<tracker_element_uint64> buckets_out;
+};
+
 class packet_chain : public lifetime_global {
 public:
     static std::string global_name() { return "PACKETCHAIN"; }
@@ -134,102 +402,341 @@ public:
 
     // Callback and information
     typedef int (*pc_callback)(CHAINCALL_PARMS);
+    typedef int (*pc_batch_callback)(CHAINCALL_BATCH_PARMS);
+
+    // Handler statistics.  Every packet handed to a handler is counted, and a sample
+    // of invocations are timed with the cycle counter and recorded in a log-linear
+    // (HDR style) histogram of per-packet latency: 4 linear sub-buckets for every
+    // power of two, in cycle counter ticks.
+    struct handler_stats {
+        static constexpr unsigned int n_buckets = 252;
+
+        handler_stats() :
+            packets{0},
+            samples{0},
+            sample_ticks{0},
+            max_ticks{0},
+            buckets{} { }
+
+        static unsigned int bucket(uint64_t ticks) {
+            if (ticks < 4)
+                return ticks;
+
+            unsigned int msb = 63 - __builtin_clzll(ticks);
+            return ((msb - 1) * 4) + ((ticks >> (msb - 2)) & 0x03);
+        }
+
+        static uint64_t bucket_floor(unsigned int b) {
+            if (b < 4)
+                return b;
+
+            unsigned int msb = (b / 4) + 1;
+            return static_cast<uint64_t>(4 + (b % 4)) << (msb - 2);
+        }
+
+        void record(uint64_t ticks) {
+            samples.fetch_add(1, std::memory_order_relaxed);
+            sample_ticks.fetch_add(ticks, std::memory_order_relaxed);
+            buckets[bucket(ticks)].fetch_add(1, std::memory_order_relaxed);
+
+            auto m = max_ticks.load(std::memory_order_relaxed);
+            while (ticks > m &&
+                    !max_ticks.compare_exchange_weak(m, ticks, std::memory_order_relaxed))
+                ;
+        }
+
+        std::atomic<uint64_t> packets;
+        std::atomic<uint64_t> samples;
+        std::atomic<uint64_t> sample_ticks;
+        std::atomic<uint64_t> max_ticks;
+        std::array<std::atomic<uint64_t>, n_buckets> buckets;
+    };
+
+    // What an asynchronous logger does with a new packet when its queue is full
+    enum class log_overflow_policy {
+        block, drop_oldest, drop_newest
+    };
+
+    static std::string log_overflow_policy_name(log_overflow_policy in_policy);
+
+    // Logging handler state when asynchronous logging is enabled.  Packet threads hand
+    // packets to each logger through its own bounded queue, and the logger runs on its
+    // own thread, so a slow log writer stalls only itself.
+    struct async_logger {
+        async_logger(log_overflow_policy in_policy, size_t in_max) :
+            policy{in_policy},
+            max_queue{in_max},
+            stopping{false},
+            queued{0},
+            logged{0},
+            dropped{0},
+            blocked{0} { }
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::shared_ptr<kis_packet>> queue;
+
+        log_overflow_policy policy;
+        size_t max_queue;
+        bool stopping;
+
+        std::thread thread;
+
+        std::atomic<uint64_t> queued, logged, dropped, blocked;
+    };
+
+    // Packets a handler cares about.  A handler with a filter is only called for packets
+    // whose link or decapsulated DLT is one of dlts (if any are listed), and which carry
+    // every listed packet component; everything else skips the call entirely.
+    struct pc_filter {
+        std::vector<unsigned int> dlts;
+        std::vector<int> components;
+    };
+
     typedef struct {
         int priority;
 
 		packet_chain::pc_callback callback;
+        packet_chain::pc_batch_callback batch_callback;
 
         void *auxdata;
 		int id;
+
+        // Human-readable name for statistics
+        std::string name;
+
+        // Statistics are shared by every snapshot the link appears in
+        std::shared_ptr<handler_stats> stats;
+
+        // Asynchronous logging queue and thread, for logging handlers when async
+        // logging is enabled
+        std::shared_ptr<async_logger> logger;
+
+        // Linktypes the handler accepts (empty for all), and a bitmask of the packet
+        // components it requires
+        std::vector<unsigned int> dlts;
+        uint64_t component_mask;
     } pc_link;
 
-    // Register a callback, aux data, a chain to put it in, and the priority
-    int register_handler(pc_callback in_cb, void *in_aux, int in_chain, int in_prio);
+    // Immutable snapshot of every handler chain.  Registering or removing a handler
+    // copies the current snapshot, modifies the copy, and publishes it with a new
+    // version; packet workers compare the published version against their cached
+    // snapshot and only re-load when it has changed, so the per-packet path never
+    // takes the packetchain lock.  Old snapshots are released when the last worker
+    // holding them moves on.
+    struct handler_chains {
+        handler_chains() :
+            version{0},
+            n_dlt_index{0} { }
+
+        uint64_t version;
+        std::array<std::vector<std::shared_ptr<pc_link>>, CHAINPOS_MAX> chains;
+
+        // Dispatch tables built from the handler filters.  Every DLT named by a filter
+        // gets an index (0 is any other DLT, or no DLT at all), and each chain has a
+        // list of handlers, in priority order, for every combination of link and
+        // decapsulated DLT index.  A handler without a DLT filter is in every list.
+        ankerl::unordered_dense::map<unsigned int, unsigned int> dlt_index;
+        size_t n_dlt_index;
+        std::array<std::vector<std::vector<std::shared_ptr<pc_link>>>, CHAINPOS_MAX> dispatch;
+    };
+
+    // Register a callback, aux data, a chain to put it in, and the priority; the name
+    // is used to identify the handler in the handler statistics, and the optional filter
+    // limits which packets the handler is called for
+    int register_handler(pc_callback in_cb, void *in_aux, int in_chain, int in_prio,
+            const std::string& in_name = "", const pc_filter& in_filter = {});
     int remove_handler(pc_callback in_cb, int in_chain);
 	int remove_handler(int in_id, int in_chain);
 
+    // Register a handler which is called with batches of packets instead of one packet
+    // at a time; the batch size is set per chain stage.  Single-packet and batch
+    // handlers may be freely mixed within a chain and still run in priority order.
+    int register_batch_handler(pc_batch_callback in_cb, void *in_aux, int in_chain, int in_prio,
+            const std::string& in_name = "", const pc_filter& in_filter = {});
+    int remove_handler(pc_batch_callback in_cb, int in_chain);
+
+    // Set the queue overflow policy and queue length (0 for the default) of a logging
+    // handler; only meaningful when asynchronous logging is enabled
+    int set_logging_policy(int in_id, log_overflow_policy in_policy, size_t in_queue_max = 0);
+
+    // Printable name of a chain position
+    static std::string chain_name(int in_chain);
+
     static std::string event_packetstats() { return "PACKETCHAIN_STATS"; }
 
     template<typename T>
     std::shared_ptr<T> new_packet_component() {
-        // pools protect their internal state; we only have to protect creating the pool
-        // or changing how packet IDs are mapped
+        // pools protect their internal state; we only have to protect creating the pool.
+        // Each component type gets a fixed slot the first time it is used, so finding the
+        // pool is a single atomic load.
 
-        auto lk = std::shared_lock(packetcomp_mutex);
+        const auto slot = component_pool_slot<T>();
 
-        auto p = component_pool_map.find(typeid(T).hash_code());
+        if (slot >= max_component_pools)
+            return std::make_shared<T>();
 
-        if (p != component_pool_map.end()) {
-            return std::static_pointer_cast<shared_object_pool<T>>(p->second)->acquire();
-        } else {
-            lk.unlock();
+        auto pool =
+            static_cast<shared_object_pool<T> *>(component_pools[slot].load(std::memory_order_acquire));
 
+        if (pool == nullptr) {
             auto ulk = std::unique_lock(packetcomp_mutex);
 
-            auto pool = std::make_shared<shared_object_pool<T>>();
-            pool->set_max(1024);
-            pool->set_reset([](T *c) { c->reset(); });
-            component_pool_map.insert({typeid(T).hash_code(), pool});
+            pool = static_cast<shared_object_pool<T> *>(component_pools[slot].load(std::memory_order_relaxed));
+
+            if (pool == nullptr) {
+                auto new_pool = std::make_shared<shared_object_pool<T>>();
+                new_pool->set_max(1024);
+                new_pool->set_thread_cache(pool_thread_cache);
+                new_pool->set_reset([](T *c) { c->reset(); });
+                component_pool_list.push_back(new_pool);
 
-            return pool->acquire();
+                pool = new_pool.get();
+                component_pools[slot].store(pool, std::memory_order_release);
+            }
         }
+
+        return pool->acquire();
     }
 
 protected:
-    void packet_queue_processor(moodycamel::BlockingConcurrentQueue<std::shared_ptr<kis_packet>> *packet_queue);
+    struct packet_thread;
+    void packet_queue_processor(packet_thread *thread);
 
     // Common function for both insertion methods
-    int register_int_handler(pc_callback in_cb, void *in_aux, int in_chain, int in_prio);
+    int register_int_handler(pc_callback in_cb, pc_batch_callback in_batch_cb,
+            void *in_aux, int in_chain, int in_prio, const std::string& in_name,
+            const pc_filter& in_filter);
+
+    // Rebuild the per-DLT dispatch tables of a snapshot after its chains change
+    void build_dispatch(handler_chains& chains);
+
+    // Does a packet pass a handler filter
+    bool handler_accepts(const std::shared_ptr<pc_link>& pcl, const std::shared_ptr<kis_packet>& in_pack);
+
+    // Link and decapsulated DLTs of a packet, if it has them
+    void packet_dlts(const std::shared_ptr<kis_packet>& in_pack, unsigned int& lf_dlt, unsigned int& dc_dlt,
+            bool& has_lf, bool& has_dc);
+
+    // Run one chain over a slice of packets, using the dispatch table when every packet
+    // in the slice has the same linktypes, and filtering per packet otherwise
+    void dispatch_slice(const handler_chains& chains, int in_chain,
+            const std::shared_ptr<kis_packet> *in_packs, size_t n_packs);
+
+    // Start and stop the thread behind an asynchronous logging handler; stopping logs
+    // whatever is still queued before the thread exits
+    void start_async_logger(const std::shared_ptr<pc_link>& pcl);
+    void stop_async_logger(const std::shared_ptr<pc_link>& pcl);
+    void async_logger_processor(std::shared_ptr<pc_link> pcl);
+
+    // Hand a slice of packets to an asynchronous logger, applying its overflow policy
+    void enqueue_async_logger(const std::shared_ptr<pc_link>& pcl,
+            const std::shared_ptr<kis_packet> *in_packs, size_t n_packs);
+
+    // Remove matching handlers from a chain and stop any asynchronous loggers among them
+    int remove_handler_if(int in_chain, const std::function<bool (const std::shared_ptr<pc_link>&)>& match);
+
+    std::shared_ptr<tracker_element> packet_stats_endp_handler();
+
+    // Call a handler for a slice of packets, counting and optionally timing it
+    void invoke_handler(const std::shared_ptr<pc_link>& pcl,
+            const std::shared_ptr<kis_packet> *in_packs, size_t n_packs, bool timed);
+
+    // Decide if the next invocation on this thread should be timed
+    bool sample_handler_timing();
+
+    // Build the handler statistics for the handler_stats endpoint
+    std::shared_ptr<tracker_element> handler_stats_endp_handler();
+
+    // Run a batch of locked packets through the post-postcap chains and release them
+    void process_packet_batch(const handler_chains& chainset,
+            std::vector<std::shared_ptr<kis_packet>>& batch);
 
     int next_componentid, next_handlerid;
 
     std::unordered_map<std::string, int> component_str_map;
     std::map<int, std::string> component_id_map;
 
-    // Core chain components
-    std::vector<packet_chain::pc_link*> postcap_chain;
-    std::vector<packet_chain::pc_link*> llcdissect_chain;
-    std::vector<packet_chain::pc_link*> decrypt_chain;
-    std::vector<packet_chain::pc_link*> datadissect_chain;
-    std::vector<packet_chain::pc_link*> classifier_chain;
-	std::vector<packet_chain::pc_link*> tracker_chain;
-    std::vector<packet_chain::pc_link*> logging_chain;
-
-    // Updated chain components
-    std::vector<packet_chain::pc_link*> postcap_chain_new;
-    std::vector<packet_chain::pc_link*> llcdissect_chain_new;
-    std::vector<packet_chain::pc_link*> decrypt_chain_new;
-    std::vector<packet_chain::pc_link*> datadissect_chain_new;
-    std::vector<packet_chain::pc_link*> classifier_chain_new;
-	std::vector<packet_chain::pc_link*> tracker_chain_new;
-    std::vector<packet_chain::pc_link*> logging_chain_new;
-
-    bool postcap_chain_update;
-    bool llcdissect_chain_update;
-    bool decrypt_chain_update;
-    bool datadissect_chain_update;
-    bool classifier_chain_update;
-    bool tracker_chain_update;
-    bool logging_chain_update;
+    // Current published handler chains; only accessed via atomic load/store
+    std::shared_ptr<const handler_chains> chain_snapshot;
+    std::atomic<uint64_t> chain_version;
+
+    // Refresh a cached snapshot if the published version has changed
+    const std::shared_ptr<const handler_chains>& fetch_chains(std::shared_ptr<const handler_chains>& cache) {
+        if (cache == nullptr || cache->version != chain_version.load(std::memory_order_acquire))
+            cache = std::atomic_load_explicit(&chain_snapshot, std::memory_order_acquire);
+        return cache;
+    }
+
+    // Copy the current snapshot, apply a modification to one chain, and publish the
+    // result.  Must be called with packetchain_mutex held.
+    void update_chain(int in_chain, const std::function<void (std::vector<std::shared_ptr<pc_link>>&)>& mutator);
 
     // Packet component mutex
     mutable kis_shared_mutex packetcomp_mutex;
 
-    // Packet chain mutex
+    // Packet chain mutex, serializes handler registration; readers use the snapshot
     mutable kis_shared_mutex packetchain_mutex;
 
     struct packet_thread {
         std::thread packet_thread;
         moodycamel::BlockingConcurrentQueue<std::shared_ptr<kis_packet>> packet_queue;
+
+        // Time spent processing and packets processed, updated by the thread itself
+        std::atomic<uint64_t> busy_ns{0}, packets{0};
+
+        // Load over the last rebalance interval and bucket migrations, protected by
+        // thread_stats_mutex
+        uint64_t last_busy_ns{0}, last_packets{0};
+        double utilization{0}, packet_rate{0};
+        uint64_t buckets_in{0}, buckets_out{0};
     };
 
     packet_thread **packet_threads;
     size_t n_packet_threads;
 
+    // Packets are grouped into assignment buckets by assignment id, and each bucket is
+    // mapped to a thread.  The bucket state packs the thread (upper 32 bits) with the
+    // number of packets queued or processing (lower 32 bits), so a bucket is only moved
+    // to another thread when it has nothing in flight and packets for the same devices
+    // are never processed out of order or on two threads at once.
+    size_t n_assignment_buckets;
+    std::unique_ptr<std::atomic<uint64_t>[]> bucket_state;
+    std::unique_ptr<std::atomic<uint32_t>[]> bucket_packets;
+
+    // Move idle buckets off of threads processing more than rebalance_ratio times the
+    // mean packet rate
+    bool rebalance_threads;
+    double rebalance_ratio;
+    std::chrono::steady_clock::time_point last_rebalance;
+    std::mutex thread_stats_mutex;
+
+    int thread_stats_record_id;
+
+    // Pick the thread for a packet and count it as in flight in its bucket
+    unsigned int assign_packet_thread(const std::shared_ptr<kis_packet>& in_pack);
+
+    // Packet has finished processing (or was dropped); release it from its bucket
+    void release_packet_bucket(kis_packet *in_pack);
+
+    // Measure per-thread load and migrate idle buckets away from overloaded threads;
+    // called from the stats timer
+    void rebalance_packet_threads();
+
+    std::shared_ptr<tracker_element> thread_stats_endp_handler();
+
+    // Maximum number of packets a worker pulls from its queue at once, and the
+    // batch size handed to each chain stage
+    size_t dequeue_batch_size;
+    std::array<size_t, CHAINPOS_MAX> stage_batch_size;
+
     bool packetchain_shutdown;
 
     // Warning and discard levels for packet queue being full
     unsigned int packet_queue_warning, packet_queue_drop;
+
+    // Backlog beyond which packets of each shed priority are dropped
+    std::array<unsigned int, packet_shed_max> packet_shed_limit;
     time_t last_packet_queue_user_warning, last_packet_drop_user_warning;
 
     std::shared_ptr<kis_tracked_rrd<kis_tracked_rrd_default_aggregator,
@@ -255,8 +762,42 @@ protected:
     std::shared_ptr<kis_tracked_rrd<>> packet_processed_rrd;
     int packet_processed_rrd_id;
 
+    // Packets dropped from the backlog, by shed priority
+    std::array<std::shared_ptr<kis_tracked_rrd<>>, packet_shed_max> packet_shed_drop_rrd;
+
     std::shared_ptr<tracker_element_map> packet_stats_map;
 
+    // Per-packet counters feeding the RRDs above; packet threads only touch their own
+    // shard, and the stats timer flushes them into the RRDs once a second
+    std::unique_ptr<sharded_rrd_counter<decltype(packet_peak_rrd)::element_type>> packet_peak_counter;
+    std::unique_ptr<sharded_rrd_counter<kis_tracked_rrd<>>> packet_rate_counter;
+    std::unique_ptr<sharded_rrd_counter<kis_tracked_rrd<>>> packet_error_counter;
+    std::unique_ptr<sharded_rrd_counter<kis_tracked_rrd<>>> packet_dupe_counter;
+    std::unique_ptr<sharded_rrd_counter<kis_tracked_rrd<kis_tracked_rrd_extreme_aggregator>,
+        sharded_counter_max>> packet_queue_counter;
+    std::unique_ptr<sharded_rrd_counter<kis_tracked_rrd<>>> packet_drop_counter;
+    std::unique_ptr<sharded_rrd_counter<kis_tracked_rrd<>>> packet_processed_counter;
+    std::array<std::unique_ptr<sharded_rrd_counter<kis_tracked_rrd<>>>, packet_shed_max> packet_shed_drop_counter;
+
+    void flush_packet_counters(time_t now);
+
+    // Time one in every handler_sample_rate batches (or postcap packets) per thread,
+    // 0 disables timing
+    unsigned int handler_sample_rate;
+
+    // Cycle counter and clock at startup, used to convert sampled ticks to ns
+    uint64_t handler_ticks_base;
+    std::chrono::steady_clock::time_point handler_clock_base;
+
+    int handler_stats_record_id;
+
+    // Run logging handlers on their own threads, fed by bounded queues
+    bool async_logging;
+    size_t async_log_queue_max;
+    log_overflow_policy async_log_policy;
+
+    int logger_stats_record_id, logger_stats_vec_id;
+
     std::shared_ptr<time_tracker> timetracker;
     int event_timer_id;
     std::shared_ptr<event_bus> eventbus;
@@ -264,31 +805,27 @@ protected:
     // Packet & data component pools
     shared_object_pool<kis_packet> packet_pool;
 
-    ankerl::unordered_dense::map<size_t, std::shared_ptr<void>> component_pool_map;
+    // Free objects each thread caches in front of the shared packet and component pools
+    size_t pool_thread_cache;
 
-    // Unique lock for packet number and dedupe
-    kis_shared_mutex pack_no_mutex;
+    // Component pools, indexed by a per-type slot; the list owns the pools
+    static constexpr size_t max_component_pools = 128;
+    std::array<std::atomic<void *>, max_component_pools> component_pools;
+    std::vector<std::shared_ptr<void>> component_pool_list;
 
-    // Next unique packet number
-    std::atomic<uint64_t> unique_packet_no;
-
-    // A simple array of hash to packet ID for the past 1024 unique packets
-    typedef struct packno_map {
-        packno_map() {
-            hash = 0;
-            packno = 0;
-        }
+    static std::atomic<size_t> next_component_pool_slot;
 
-        uint32_t hash;
-        uint64_t packno;
-        std::shared_ptr<kis_packet> original_pkt;
-    } packno_map_t;
+    template<typename T>
+    static size_t component_pool_slot() {
+        static const size_t slot = next_component_pool_slot.fetch_add(1);
+        return slot;
+    }
 
-    std::array<packno_map_t, 1024> dedupe_list;
-    // packno_map_t dedupe_list[1024];
+    // Next unique packet number
+    std::atomic<uint64_t> unique_packet_no;
 
-    // Current position in the dedupe list
-    std::atomic<unsigned int> dedupe_list_pos;
+    // Recently seen packet hashes, used to mark duplicates seen by multiple sources
+    std::unique_ptr<packet_dedupe_table> dedupe_table;
 
 	int pack_comp_linkframe, pack_comp_decap, pack_comp_l1_agg, pack_comp_datasource;
 
@@ -696,7 +696,11 @@ public:
 					auto pcapng = reinterpret_cast<pcapng_stream_packetchain *>(auxdata);
                     pcapng->handle_packet(packet);
                     return 1;
-				}, this, CHAINPOS_LOGGING, -100);
+				}, this, CHAINPOS_LOGGING, -100, "pcapng stream");
+
+        // A slow client should lose packets rather than hold up other loggers
+        this->packetchain->set_logging_policy(packethandler_id,
+                packet_chain::log_overflow_policy::drop_newest);
 
     }
 
@@ -100,6 +100,10 @@ int phydot11_packethook_wep(CHAINCALL_PARMS) {
     return ((kis_80211_phy *) auxdata)->packet_wep_decryptor(in_pack.get());
 }
 
+int phydot11_packethook_shed(CHAINCALL_PARMS) {
+    return ((kis_80211_phy *) auxdata)->packet_dot11_shed_classifier(in_pack.get());
+}
+
 int phydot11_packethook_dot11(CHAINCALL_PARMS) {
     return ((kis_80211_phy *) auxdata)->packet_dot11_dissector(in_pack.get());
 }
@@ -172,12 +176,6 @@ kis_80211_phy::kis_80211_phy(int in_phyid) :
                 "IEEE802.11 device");
     dot11_builder = std::make_shared<dot11_tracked_device>(dot11_device_entry_id);
 
-    // Packet classifier - makes basic records plus dot11 data
-    packetchain->register_handler(&packet_dot11_common_classifier, this, CHAINPOS_CLASSIFIER, -100);
-    packetchain->register_handler(&packet_dot11_scan_json_classifier, this, CHAINPOS_CLASSIFIER, -99);
-    packetchain->register_handler(&phydot11_packethook_wep, this, CHAINPOS_DECRYPT, -100);
-    packetchain->register_handler(&phydot11_packethook_dot11, this, CHAINPOS_LLCDISSECT, -100);
-
     // If we haven't registered packet components yet, do so.  We have to
     // co-exist with the old tracker core for some time
     pack_comp_80211 =
@@ -204,6 +202,20 @@ kis_80211_phy::kis_80211_phy(int in_phyid) :
     pack_comp_json =
         packetchain->register_packet_component("JSON");
 
+    // Packet classifier - makes basic records plus dot11 data; the common classifier
+    // also marks errors as filtered in survey mode, so it sees every packet
+    packetchain->register_handler(&packet_dot11_common_classifier, this, CHAINPOS_CLASSIFIER, -100,
+            "dot11 classifier");
+    packetchain->register_handler(&packet_dot11_scan_json_classifier, this, CHAINPOS_CLASSIFIER, -99,
+            "dot11 scan json classifier", {{}, {pack_comp_json}});
+    // Shed priority runs after DLT decapsulation in postcap
+    packetchain->register_handler(&phydot11_packethook_shed, this, CHAINPOS_POSTCAP, 100,
+            "dot11 shed classifier", {{KDLT_IEEE802_11}, {}});
+    packetchain->register_handler(&phydot11_packethook_wep, this, CHAINPOS_DECRYPT, -100,
+            "dot11 wep decrypt", {{KDLT_IEEE802_11}, {pack_comp_80211}});
+    packetchain->register_handler(&phydot11_packethook_dot11, this, CHAINPOS_LLCDISSECT, -100,
+            "dot11 dissector", {{KDLT_IEEE802_11}, {}});
+
     devtype_adhoc = devicetracker->get_cached_devicetype("Wi-Fi Ad-Hoc");
     devtype_ap = devicetracker->get_cached_devicetype("Wi-Fi AP");
     devtype_client = devicetracker->get_cached_devicetype("Wi-Fi Client");
@@ -932,25 +944,36 @@ kis_80211_phy::kis_80211_phy(int in_phyid) :
                     std::function<void (std::shared_ptr<kis_tracked_device_base>)> find_clients =
                         [&](std::shared_ptr<kis_tracked_device_base> dev) {
 
-                        // Don't add non-dot11 devices
-                        auto dot11 =
-                            dev->get_sub_as<dot11_tracked_device>(dot11_device_entry_id);
+                        std::vector<device_key> client_keys;
+
+                        {
+                            // Only hold this device while we copy its clients
+                            device_lock_scope dlk(devicetracker, dev->get_macaddr());
+
+                            // Don't add non-dot11 devices
+                            auto dot11 =
+                                dev->get_sub_as<dot11_tracked_device>(dot11_device_entry_id);
 
-                        if (dot11 == nullptr)
-                            return;
+                            if (dot11 == nullptr)
+                                return;
 
-                        // Don't add devices we've already added
-                        if (seen_nodes.find(dev->get_key()) != seen_nodes.end())
-                            return;
+                            // Don't add devices we've already added
+                            if (seen_nodes.find(dev->get_key()) != seen_nodes.end())
+                                return;
 
-                        // Add this device
-                        seen_nodes[dev->get_key()] = true;
-                        cl->push_back(dev);
+                            // Add this device
+                            seen_nodes[dev->get_key()] = true;
+                            cl->push_back(dev);
+
+                            for (const auto& ci : *dot11->get_associated_client_map()) {
+                                auto dk = static_cast<tracker_element_device_key *>(ci.second.get());
+                                client_keys.push_back(dk->get());
+                            }
+                        }
 
                         // For every client, repeat, looking for associated clients and shard APs
-                        for (const auto& ci : *dot11->get_associated_client_map()) {
-                            auto dk = static_cast<tracker_element_device_key *>(ci.second.get());
-                            auto d = devicetracker->fetch_device(dk->get());
+                        for (const auto& k : client_keys) {
+                            auto d = devicetracker->fetch_device(k);
 
                             if (d != nullptr)
                                 find_clients(d);
@@ -960,7 +983,7 @@ kis_80211_phy::kis_80211_phy(int in_phyid) :
                     find_clients(dev);
 
                     return cl;
-                }, devicetracker->get_devicelist_mutex()));
+                }));
 
     httpd->register_route("/phy/phy80211/by-key/:key/device/:device/pcap/handshake", {"GET"}, httpd->RO_ROLE, {"pcap"},
             std::make_shared<kis_net_web_function_endpoint>(
@@ -1041,6 +1064,7 @@ kis_80211_phy::kis_80211_phy(int in_phyid) :
 }
 
 kis_80211_phy::~kis_80211_phy() {
+    packetchain->remove_handler(&phydot11_packethook_shed, CHAINPOS_POSTCAP);
     packetchain->remove_handler(&phydot11_packethook_wep, CHAINPOS_DECRYPT);
     packetchain->remove_handler(&phydot11_packethook_dot11, CHAINPOS_LLCDISSECT);
     packetchain->remove_handler(&packet_dot11_common_classifier, CHAINPOS_CLASSIFIER);
@@ -1272,8 +1296,10 @@ int kis_80211_phy::packet_dot11_common_classifier(CHAINCALL_PARMS) {
         return 1;
     }
 
-    kis_unique_lock<kis_mutex> list_locker(d11phy->devicetracker->get_devicelist_mutex(),
-            "phy80211 common_classifier");
+    // Lock every device this packet can touch up front, in shard order
+    device_lock_scope list_locker(d11phy->devicetracker,
+            {dot11info->bssid_mac, dot11info->source_mac, dot11info->dest_mac,
+             dot11info->transmit_mac, dot11info->receive_mac});
 
     if (dot11info->type == packet_management) {
         // Resolve the common structures of management frames; this is a lot of code
@@ -1613,6 +1639,10 @@ int kis_80211_phy::packet_dot11_common_classifier(CHAINCALL_PARMS) {
 
         }
 
+        // Release the packet devices before running the deferred workers; they lock other
+        // devices, which can't be taken out of shard order
+        list_locker.unlock();
+
         // BSSTS relationship worker
         if (associate_bssts) {
             auto bss_worker =
@@ -1646,21 +1676,22 @@ int kis_80211_phy::packet_dot11_common_classifier(CHAINCALL_PARMS) {
                         return diff < d11phy->bss_ts_group_usec;
                 });
 
-            // We have to do write work because we're still holding the device list
-            // write state
             d11phy->ap_view->do_device_work(bss_worker);
 
-            for (const auto& ri : *(bss_worker.getMatchedDevices())) {
-                auto rdev = std::static_pointer_cast<kis_tracked_device_base>(ri);
-                dot11info->bssid_dev->add_related_device("dot11_bssts_similar", rdev->get_key());
-            }
+            {
+                device_lock_scope bssid_lk(d11phy->devicetracker, dot11info->bssid_mac);
 
-            // bssid_lk.unlock();
+                for (const auto& ri : *(bss_worker.getMatchedDevices())) {
+                    auto rdev = std::static_pointer_cast<kis_tracked_device_base>(ri);
+                    dot11info->bssid_dev->add_related_device("dot11_bssts_similar", rdev->get_key());
+                }
+            }
 
             // Assign the reverse map for each device under individual lock
             for (const auto& ri : *(bss_worker.getMatchedDevices())) {
                 auto rdev = std::static_pointer_cast<kis_tracked_device_base>(ri);
 
+                device_lock_scope rdev_lk(d11phy->devicetracker, rdev->get_macaddr());
                 rdev->add_related_device("dot11_bssts_similar", dot11info->bssid_dev->get_key());
             }
         }
@@ -2244,6 +2275,8 @@ int kis_80211_phy::packet_dot11_scan_json_classifier(CHAINCALL_PARMS) {
         in_pack->common_info.transmitter = bssid_mac;
         in_pack->common_info.dest = Globalreg::globalreg->broadcast_mac;
 
+        device_lock_scope list_locker(d11phy->devicetracker, bssid_mac);
+
         auto bssid_dev =
             d11phy->devicetracker->update_common_device(bssid_mac, d11phy,
                     in_pack,
@@ -2252,9 +2285,6 @@ int kis_80211_phy::packet_dot11_scan_json_classifier(CHAINCALL_PARMS) {
                      UCD_UPDATE_SEENBY | UCD_UPDATE_ENCRYPTION),
                     "Wi-Fi AP");
 
-        kis_unique_lock<kis_mutex> list_locker(d11phy->devicetracker->get_devicelist_mutex(),
-                "phy80211 json_classifier");
-
         auto bssid_dot11 =
             bssid_dev->get_sub_as<dot11_tracked_device>(d11phy->dot11_device_entry_id);
         std::stringstream newdevstr;
@@ -3827,13 +3857,13 @@ void kis_80211_phy::handle_probed_ssid(const std::shared_ptr<kis_tracked_device_
     }
 
     bool new_probessid = false;
+    bool relate_uuid_e = false;
 
     if (dot11info->subtype == packet_sub_probe_req ||
             dot11info->subtype == packet_sub_association_req ||
             dot11info->subtype == packet_sub_reassociation_req) {
 
-        kis_unique_lock<kis_mutex> list_locker(devicetracker->get_devicelist_mutex(),
-                "phy80211 handle_probed_ssid");
+        device_lock_scope list_locker(devicetracker, basedev->get_macaddr());
 
         auto probemap(dot11dev->get_probed_ssid_map());
 
@@ -3937,47 +3967,11 @@ void kis_80211_phy::handle_probed_ssid(const std::shared_ptr<kis_tracked_device_
         // XXHash32 says the canonical representation of the hash is little-endian
         dot11dev->set_probe_fingerprint(htole32(tag_hash.hash()));
 
+        // Devices sharing the uuid are related once we've released this device
         if (dot11info->wps_uuid_e != "") {
             if (probessid->get_wps_uuid_e() != dot11info->wps_uuid_e) {
-                // lk.unlock();
-
-                device_tracker_view_function_worker dev_worker(
-                        [this, dot11info, basedev, dot11dev](std::shared_ptr<kis_tracked_device_base> dev) -> bool {
-                            auto bssid_dot11 =
-                                dev->get_sub_as<dot11_tracked_device>(dot11_device_entry_id);
-
-                            if (bssid_dot11 == nullptr) {
-                                return false;
-                            }
-
-                            if (bssid_dot11->has_probed_ssid_map()) {
-                                for (const auto& pi : *bssid_dot11->probed_ssid_map) {
-                                    auto ps = static_cast<dot11_probed_ssid *>(pi.second.get());
-
-                                    if (ps->get_wps_uuid_e() == dot11info->wps_uuid_e)
-                                        return true;
-                                }
-                            }
-
-                        return false;
-                        });
-                devicetracker->do_device_work(dev_worker);
-
-                // Update main device under lock
-                // lk.lock();
                 probessid->set_wps_uuid_e(dot11info->wps_uuid_e);
-                // Set a bidirectional relationship
-                for (const auto& ri : *(dev_worker.getMatchedDevices())) {
-                    auto rdev = static_cast<kis_tracked_device_base *>(ri.get());
-                    basedev->add_related_device("dot11_uuid_e", rdev->get_key());
-                }
-                // lk.unlock();
-
-                // Update associated devices under single device lock
-                for (const auto& ri : *(dev_worker.getMatchedDevices())) {
-                    auto rdev = static_cast<kis_tracked_device_base *>(ri.get());
-                    rdev->add_related_device("dot11_uuid_e", basedev->get_key());
-                }
+                relate_uuid_e = true;
             }
         }
 
@@ -4011,6 +4005,49 @@ void kis_80211_phy::handle_probed_ssid(const std::shared_ptr<kis_tracked_device_
         }
     }
 
+    if (relate_uuid_e) {
+        device_tracker_view_function_worker dev_worker(
+                [this, dot11info, basedev](std::shared_ptr<kis_tracked_device_base> dev) -> bool {
+                    if (dev->get_key() == basedev->get_key())
+                        return false;
+
+                    auto bssid_dot11 =
+                        dev->get_sub_as<dot11_tracked_device>(dot11_device_entry_id);
+
+                    if (bssid_dot11 == nullptr) {
+                        return false;
+                    }
+
+                    if (bssid_dot11->has_probed_ssid_map()) {
+                        for (const auto& pi : *bssid_dot11->probed_ssid_map) {
+                            auto ps = static_cast<dot11_probed_ssid *>(pi.second.get());
+
+                            if (ps->get_wps_uuid_e() == dot11info->wps_uuid_e)
+                                return true;
+                        }
+                    }
+
+                return false;
+                });
+        devicetracker->do_device_work(dev_worker);
+
+        // Set a bidirectional relationship
+        {
+            device_lock_scope base_lk(devicetracker, basedev->get_macaddr());
+
+            for (const auto& ri : *(dev_worker.getMatchedDevices())) {
+                auto rdev = static_cast<kis_tracked_device_base *>(ri.get());
+                basedev->add_related_device("dot11_uuid_e", rdev->get_key());
+            }
+        }
+
+        // Update associated devices under single device lock
+        for (const auto& ri : *(dev_worker.getMatchedDevices())) {
+            auto rdev = static_cast<kis_tracked_device_base *>(ri.get());
+            device_lock_scope rdev_lk(devicetracker, rdev->get_macaddr());
+            rdev->add_related_device("dot11_uuid_e", basedev->get_key());
+        }
+    }
 }
 
 // Associate a client device and a dot11 access point
@@ -4762,8 +4799,7 @@ void kis_80211_phy::generate_handshake_pcap(std::shared_ptr<kis_net_beast_httpd_
 
     stream.write((const char *) &hdr, sizeof(hdr));
 
-    kis_unique_lock<kis_mutex> list_locker(devicetracker->get_devicelist_mutex(),
-            "phy80211 generate_handshake_pcap");
+    device_lock_scope list_locker(devicetracker, dev->get_macaddr());
 
 
     /* Write the beacon */
@@ -435,6 +435,8 @@ public:
 
     // Dot11 decoders, wep decryptors, etc
     int packet_wep_decryptor(kis_packet* in_pack);
+    // Postcap classifier; assigns a load shedding priority from the frame type
+    int packet_dot11_shed_classifier(kis_packet* in_pack);
     // Top-level dissector; decodes basic type and populates the dot11 packet
     int packet_dot11_dissector(kis_packet* in_pack);
     // Expects an existing dot11 packet with the basic type intact, interprets
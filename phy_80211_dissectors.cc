@@ -562,6 +562,58 @@ uint64_t kis_80211_phy::wfa_auth_conv(ie221_wfa_mgmt cipher) {
     return ret;
 }
 
+int kis_80211_phy::packet_dot11_shed_classifier(kis_packet* in_pack) {
+    auto chunk = in_pack->fetch<kis_datachunk>(pack_comp_decap, pack_comp_linkframe);
+
+    if (chunk == nullptr || chunk->dlt != KDLT_IEEE802_11 || chunk->length() < 2)
+        return 0;
+
+    const auto fc = reinterpret_cast<const frame_control *>(chunk->data());
+
+    // Management frames drive device discovery and are kept as long as possible
+    if (fc->type == packet_management) {
+        in_pack->shed_priority = packet_shed_high;
+        return 1;
+    }
+
+    // Control frames and encrypted data only feed statistics
+    if (fc->type != packet_data || fc->wep) {
+        in_pack->shed_priority = packet_shed_low;
+        return 1;
+    }
+
+    // Null data frames carry no payload
+    if (fc->subtype & 0x04) {
+        in_pack->shed_priority = packet_shed_low;
+        return 1;
+    }
+
+    // Find the LLC header past the addresses, qos, and ht control fields, and
+    // keep EAPOL handshakes with the management frames
+    size_t offt = 24;
+
+    if (fc->to_ds && fc->from_ds)
+        offt += 6;
+
+    if (fc->subtype & 0x08) {
+        offt += 2;
+
+        if (fc->order)
+            offt += 4;
+    }
+
+    if (chunk->length() >= offt + LLC_UI_OFFSET + 3 + sizeof(DOT1X_PROTO) &&
+            memcmp(&chunk->data()[offt], LLC_UI_SIGNATURE, sizeof(LLC_UI_SIGNATURE)) == 0 &&
+            memcmp(&chunk->data()[offt + LLC_UI_OFFSET + 3], DOT1X_PROTO, sizeof(DOT1X_PROTO)) == 0) {
+        in_pack->shed_priority = packet_shed_high;
+        return 1;
+    }
+
+    in_pack->shed_priority = packet_shed_normal;
+
+    return 1;
+}
+
 // This needs to be optimized and it needs to not use casting to do its magic
 int kis_80211_phy::packet_dot11_dissector(kis_packet* in_pack) {
     if (in_pack->error) {
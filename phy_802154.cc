@@ -95,8 +95,10 @@ kis_802154_phy::kis_802154_phy(int in_phyid) :
         Globalreg::fetch_mandatory_global_as<dlt_tracker>("DLTTRACKER");
     dlt = KDLT_IEEE802_15_4_NOFCS;
 
-    packetchain->register_handler(&dissector802154, this, CHAINPOS_LLCDISSECT, -100);
-    packetchain->register_handler(&commonclassifier802154, this, CHAINPOS_CLASSIFIER, -100);
+    packetchain->register_handler(&dissector802154, this, CHAINPOS_LLCDISSECT, -100, "802.15.4 dissector",
+            {{KDLT_IEEE802_15_4_NOFCS, KDLT_IEEE802_15_4_TAP}, {}});
+    packetchain->register_handler(&commonclassifier802154, this, CHAINPOS_CLASSIFIER, -100, "802.15.4 classifier",
+            {{KDLT_IEEE802_15_4_NOFCS, KDLT_IEEE802_15_4_TAP}, {}});
 
     auto httpregistry = Globalreg::fetch_mandatory_global_as<kis_httpd_registry>();
     httpregistry->register_js_module("kismet_ui_802_15_4", "js/kismet.ui.802_15_4.js");
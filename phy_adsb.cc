@@ -107,7 +107,8 @@ kis_adsb_phy::kis_adsb_phy(int in_phyid) :
         Globalreg::fetch_mandatory_global_as<kis_httpd_registry>();
     httpregistry->register_js_module("kismet_ui_adsb", "js/kismet.ui.adsb.js");
 
-	packetchain->register_handler(&packet_handler, this, CHAINPOS_CLASSIFIER, -100);
+	packetchain->register_handler(&packet_handler, this, CHAINPOS_CLASSIFIER, -100, "adsb classifier",
+            {{}, {pack_comp_json}});
 
     icaodb = std::make_shared<kis_adsb_icao>();
 
@@ -217,7 +218,7 @@ kis_adsb_phy::kis_adsb_phy(int in_phyid) :
             std::make_shared<kis_net_web_tracked_endpoint>(
                 [this](std::shared_ptr<kis_net_beast_httpd_connection> con) {
                     return adsb_map_endp_handler(con);
-                }, devicetracker->get_devicelist_mutex()));
+                }));
 
     httpd->register_websocket_route("/phy/ADSB/beast", {httpd->RO_ROLE, "ADSB"}, {"ws"},
             std::make_shared<kis_net_web_function_endpoint>(
@@ -312,7 +313,10 @@ kis_adsb_phy::kis_adsb_phy(int in_phyid) :
                                 }
 
                                 return 1;
-                    }, uptr, CHAINPOS_LOGGING, 1000);
+                    }, uptr, CHAINPOS_LOGGING, 1000, "adsb beast websocket");
+
+                packetchain->set_logging_policy(beast_handler_id,
+                        packet_chain::log_overflow_policy::drop_newest);
 
                 ws->binary();
 
@@ -386,7 +390,10 @@ kis_adsb_phy::kis_adsb_phy(int in_phyid) :
                             }
 
                             return 1;
-                    }, uptr, CHAINPOS_LOGGING, 1000);
+                    }, uptr, CHAINPOS_LOGGING, 1000, "adsb raw websocket");
+
+                packetchain->set_logging_policy(raw_handler_id,
+                        packet_chain::log_overflow_policy::drop_newest);
 
                 ws->text();
 
@@ -469,7 +476,10 @@ kis_adsb_phy::kis_adsb_phy(int in_phyid) :
                             }
 
                             return 1;
-                    }, uptr, CHAINPOS_LOGGING, 1000);
+                    }, uptr, CHAINPOS_LOGGING, 1000, "adsb raw source websocket");
+
+                packetchain->set_logging_policy(raw_handler_id,
+                        packet_chain::log_overflow_policy::drop_newest);
 
                 ws->text();
 
@@ -622,7 +632,7 @@ bool kis_adsb_phy::process_adsb_hex(nlohmann::json& json, const std::shared_ptr<
     packet->common_info.source = mac;
     packet->common_info.transmitter = mac;
 
-    kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex(), "adsb_raw");
+    device_lock_scope lk(devicetracker, mac);
 
     // Update the base dev without setting location, because we want to
     // override that location ourselves later once we've gotten our
@@ -831,7 +841,7 @@ bool kis_adsb_phy::json_to_rtl(nlohmann::json& json, const std::shared_ptr<kis_p
                 (UCD_UPDATE_FREQUENCIES | UCD_UPDATE_PACKETS |
                  UCD_UPDATE_SEENBY), "ADSB");
 
-    kis_lock_guard<kis_mutex> lk(devicetracker->get_devicelist_mutex(), "adsb_json_to_rtl");
+    device_lock_scope lk(devicetracker, rtlmac);
 
     std::string dn = "Airplane";
 
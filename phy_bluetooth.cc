@@ -76,17 +76,22 @@ kis_bluetooth_phy::kis_bluetooth_phy(int in_phyid) :
                 tracker_element_factory<bluetooth_tracked_device>(),
                 "Bluetooth device");
 
-    packetchain->register_handler(&common_classifier_bluetooth, this, CHAINPOS_CLASSIFIER, -100);
-    packetchain->register_handler(&packet_tracker_bluetooth, this, CHAINPOS_TRACKER, -100);
-    packetchain->register_handler(&packet_tracker_h4_linux, this, CHAINPOS_TRACKER, -100);
-    packetchain->register_handler(&packet_bluetooth_scan_json_classifier, this, CHAINPOS_CLASSIFIER, -99);
-    packetchain->register_handler(&packet_bluetooth_hci_json_classifier, this, CHAINPOS_CLASSIFIER, -99);
-
     pack_comp_btdevice = packetchain->register_packet_component("BTDEVICE");
     pack_comp_meta = packetchain->register_packet_component("METABLOB");
     pack_comp_json = packetchain->register_packet_component("JSON");
     pack_comp_linkframe = packetchain->register_packet_component("LINKFRAME");
 
+    packetchain->register_handler(&common_classifier_bluetooth, this, CHAINPOS_CLASSIFIER, -100,
+            "bluetooth classifier", {{}, {pack_comp_btdevice}});
+    packetchain->register_handler(&packet_tracker_bluetooth, this, CHAINPOS_TRACKER, -100,
+            "bluetooth tracker", {{}, {pack_comp_btdevice}});
+    packetchain->register_handler(&packet_tracker_h4_linux, this, CHAINPOS_TRACKER, -100,
+            "bluetooth h4 tracker", {{KDLT_BT_H4_LINUX}, {}});
+    packetchain->register_handler(&packet_bluetooth_scan_json_classifier, this, CHAINPOS_CLASSIFIER, -99,
+            "bluetooth scan json classifier", {{}, {pack_comp_json}});
+    packetchain->register_handler(&packet_bluetooth_hci_json_classifier, this, CHAINPOS_CLASSIFIER, -99,
+            "bluetooth hci json classifier", {{}, {pack_comp_json}});
+
     btdev_bredr = devicetracker->get_cached_devicetype("BR/EDR");
     btdev_btle = devicetracker->get_cached_devicetype("BTLE");
     btdev_bt = devicetracker->get_cached_devicetype("BT");
@@ -177,8 +182,7 @@ int kis_bluetooth_phy::packet_bluetooth_hci_json_classifier(CHAINCALL_PARMS) {
         in_pack->common_info.channel = "FHSS";
         in_pack->common_info.freq_khz = 2400000;
 
-        kis_lock_guard<kis_mutex> lk(btphy->devicetracker->get_devicelist_mutex(),
-                "packet_bluetooth_hci_json_classifier");
+        device_lock_scope lk(btphy->devicetracker, btaddr_mac);
 
         auto basedev =
             btphy->devicetracker->update_common_device(btaddr_mac, btphy, in_pack,
@@ -288,8 +292,7 @@ int kis_bluetooth_phy::packet_bluetooth_scan_json_classifier(CHAINCALL_PARMS) {
         in_pack->common_info.channel = "FHSS";
         in_pack->common_info.freq_khz = 2400000;
 
-        kis_lock_guard<kis_mutex> lk(btphy->devicetracker->get_devicelist_mutex(),
-                "packet_bluetooth_scan_json_classifier");
+        device_lock_scope lk(btphy->devicetracker, btaddr_mac);
 
         auto btdev =
             btphy->devicetracker->update_common_device(btaddr_mac, btphy, in_pack,
@@ -496,8 +499,7 @@ int kis_bluetooth_phy::packet_tracker_bluetooth(CHAINCALL_PARMS) {
         return 0;
     }
 
-    kis_lock_guard<kis_mutex> lk(btphy->devicetracker->get_devicelist_mutex(),
-            "packet_tracker_bluetooth");
+    device_lock_scope lk(btphy->devicetracker, in_pack->common_info.source);
 
     std::shared_ptr<kis_tracked_device_base> basedev =
         btphy->devicetracker->update_common_device(in_pack->common_info.source, btphy, in_pack,
@@ -120,8 +120,10 @@ kis_btle_phy::kis_btle_phy(int in_phyid) :
                 "BTLE events which can act as denial of service attacks "
                 "or cause other problems with some Bluetooth devices.", phyid);
 
-    packetchain->register_handler(&dissector, this, CHAINPOS_LLCDISSECT, -100);
-    packetchain->register_handler(&common_classifier, this, CHAINPOS_CLASSIFIER, -100);
+    packetchain->register_handler(&dissector, this, CHAINPOS_LLCDISSECT, -100, "btle dissector",
+            {{KDLT_BLUETOOTH_LE_LL}, {}});
+    packetchain->register_handler(&common_classifier, this, CHAINPOS_CLASSIFIER, -100, "btle classifier",
+            {{}, {pack_comp_btle}});
 
     btle_device_id =
         entrytracker->register_field("btle.device",
@@ -274,7 +276,7 @@ int kis_btle_phy::common_classifier(CHAINCALL_PARMS) {
                  UCD_UPDATE_SEENBY | UCD_UPDATE_ENCRYPTION),
                 "BTLE");
 
-    kis_lock_guard<kis_mutex> lk(mphy->devicetracker->get_devicelist_mutex(), "btle_common_classifier");
+    device_lock_scope lk(mphy->devicetracker, in_pack->common_info.source);
 
     auto new_dev = false;
 
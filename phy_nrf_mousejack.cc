@@ -72,8 +72,10 @@ Kis_Mousejack_Phy::Kis_Mousejack_Phy(int in_phyid) :
     mj_manuf_microsoft = Globalreg::globalreg->manufdb->make_manuf("Microsoft");
     mj_manuf_nrf = Globalreg::globalreg->manufdb->make_manuf("nRF/Mousejack HID");
 
-    packetchain->register_handler(&DissectorMousejack, this, CHAINPOS_LLCDISSECT, -100);
-    packetchain->register_handler(&CommonClassifierMousejack, this, CHAINPOS_CLASSIFIER, -100);
+    packetchain->register_handler(&DissectorMousejack, this, CHAINPOS_LLCDISSECT, -100,
+            "mousejack dissector", {{static_cast<unsigned int>(dlt)}, {}});
+    packetchain->register_handler(&CommonClassifierMousejack, this, CHAINPOS_CLASSIFIER, -100,
+            "mousejack classifier", {{static_cast<unsigned int>(dlt)}, {}});
 }
 
 Kis_Mousejack_Phy::~Kis_Mousejack_Phy() {
@@ -135,7 +137,7 @@ int Kis_Mousejack_Phy::CommonClassifierMousejack(CHAINCALL_PARMS) {
                  UCD_UPDATE_SEENBY | UCD_UPDATE_ENCRYPTION),
                 "KB/Mouse");
 
-    kis_lock_guard<kis_mutex> lk(mphy->devicetracker->get_devicelist_mutex(), "common_classifier_mousejack");
+    device_lock_scope lk(mphy->devicetracker, in_pack->common_info.source);
 
     // Figure out what we think it could be; this isn't very precise.  Fingerprinting
     // based on methods in mousejack python.
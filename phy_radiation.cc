@@ -52,7 +52,8 @@ kis_radiation_phy::kis_radiation_phy(int in_phyid) :
     pack_comp_datasrc =
         packetchain->register_packet_component("KISDATASRC");
 
-	packetchain->register_handler(&packet_handler, this, CHAINPOS_CLASSIFIER, -100);
+	packetchain->register_handler(&packet_handler, this, CHAINPOS_CLASSIFIER, -100, "radiation classifier",
+            {{}, {pack_comp_json, pack_comp_datasrc}});
 
     geiger_counters = 
         std::make_shared<tracker_element_uuid_map>();
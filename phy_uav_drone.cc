@@ -137,7 +137,8 @@ kis_uav_phy::kis_uav_phy(int in_phyid) :
 
     // Tag into the packet chain at the very end so we've gotten all the other tracker
     // elements already
-    packetchain->register_handler(kis_uav_phy::common_classifier, this, CHAINPOS_TRACKER, 65535);
+    packetchain->register_handler(kis_uav_phy::common_classifier, this, CHAINPOS_TRACKER, 65535,
+            "uav classifier");
 
     // Register js module for UI
     auto httpregistry = 
@@ -280,7 +281,7 @@ int kis_uav_phy::common_classifier(CHAINCALL_PARMS) {
                 return 0;
             }
 
-            auto lg = kis_lock_guard<kis_mutex>(uavphy->devicetracker->get_devicelist_mutex(), "uav rf droneid");
+            device_lock_scope lg(uavphy->devicetracker, in_pack->common_info.source);
 
             basedev->set_manuf(uavphy->dji_manuf);
             basedev->set_tracker_type_string(uavphy->devicetracker->get_cached_devicetype("DJI UAV"));
@@ -338,7 +339,7 @@ int kis_uav_phy::common_classifier(CHAINCALL_PARMS) {
         return 1;
     }
 
-    kis_lock_guard<kis_mutex> lk(uavphy->devicetracker->get_devicelist_mutex(), "uav_phy common_classifier");
+    device_lock_scope lk(uavphy->devicetracker, dot11info->bssid_mac);
 
     for (auto di : devinfo->devrefs) {
         auto basedev = di.second;
@@ -0,0 +1,144 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __SHARDED_COUNTER_H__
+#define __SHARDED_COUNTER_H__
+
+#include "config.h"
+
+#include <array>
+#include <atomic>
+#include <memory>
+
+#include <stdint.h>
+#include <time.h>
+
+// Sharded statistics counters.
+//
+// Per-packet statistics which land in a RRD would otherwise take the RRD mutex for
+// every packet, from every thread.  A sharded counter gives each thread its own
+// cache-line sized slot, updated with relaxed atomics; the owner drains the shards
+// periodically (typically from a once-per-second timer) and adds a single sample
+// to the RRD.
+//
+// Threads are assigned a shard round-robin the first time they touch any counter;
+// with more threads than shards, threads share a shard but still never lock.
+
+// Combine policies, matching the RRD aggregator the counter feeds
+struct sharded_counter_sum {
+    static void update(std::atomic<uint64_t>& slot, uint64_t v) {
+        slot.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    static uint64_t combine(uint64_t a, uint64_t b) {
+        return a + b;
+    }
+};
+
+struct sharded_counter_max {
+    static void update(std::atomic<uint64_t>& slot, uint64_t v) {
+        auto m = slot.load(std::memory_order_relaxed);
+        while (v > m && !slot.compare_exchange_weak(m, v, std::memory_order_relaxed))
+            ;
+    }
+
+    static uint64_t combine(uint64_t a, uint64_t b) {
+        return a > b ? a : b;
+    }
+};
+
+template<typename combiner = sharded_counter_sum>
+class sharded_counter {
+public:
+    static constexpr unsigned int n_shards = 16;
+
+    sharded_counter() {
+        for (auto& s : shards)
+            s.value.store(0, std::memory_order_relaxed);
+    }
+
+    void add(uint64_t v) {
+        combiner::update(shards[thread_shard()].value, v);
+    }
+
+    // Combined value of all shards, without resetting them
+    uint64_t peek() const {
+        uint64_t r = 0;
+
+        for (const auto& s : shards)
+            r = combiner::combine(r, s.value.load(std::memory_order_relaxed));
+
+        return r;
+    }
+
+    // Combined value of all shards, resetting them to zero
+    uint64_t drain() {
+        uint64_t r = 0;
+
+        for (auto& s : shards)
+            r = combiner::combine(r, s.value.exchange(0, std::memory_order_relaxed));
+
+        return r;
+    }
+
+protected:
+    struct alignas(64) shard {
+        std::atomic<uint64_t> value;
+    };
+
+    static unsigned int thread_shard() {
+        static std::atomic<unsigned int> next_shard{0};
+        thread_local unsigned int shard_no =
+            next_shard.fetch_add(1, std::memory_order_relaxed) % n_shards;
+        return shard_no;
+    }
+
+    std::array<shard, n_shards> shards;
+};
+
+// A sharded counter which feeds a RRD (or anything else with add_sample(double, time_t));
+// flush() must be called periodically by the owner
+template<typename rrd_t, typename combiner = sharded_counter_sum>
+class sharded_rrd_counter {
+public:
+    sharded_rrd_counter(std::shared_ptr<rrd_t> rrd) :
+        rrd{rrd} { }
+
+    void add(uint64_t v) {
+        counter.add(v);
+    }
+
+    // Add everything counted since the last flush as a single sample; empty intervals
+    // add nothing, as if no per-packet samples had been added
+    void flush(time_t now) {
+        auto v = counter.drain();
+
+        if (v != 0)
+            rrd->add_sample(v, now);
+    }
+
+    const std::shared_ptr<rrd_t>& get_rrd() const {
+        return rrd;
+    }
+
+protected:
+    std::shared_ptr<rrd_t> rrd;
+    sharded_counter<combiner> counter;
+};
+
+#endif
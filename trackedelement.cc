@@ -744,6 +744,14 @@ void tracker_element_serializer::pre_serialize_path(const SharedElementSummary&
     if (inter->get_type() == tracker_type::tracker_alias)
         inter = static_cast<tracker_element_alias *>(inter.get())->get();
 
+    // A summary with no path stands for a whole summarized record; the parent is
+    // pre-serialized once for the record (devices lock themselves there) and released
+    // in post_serialize_path
+    if (in_summary->resolved_path.size() == 0) {
+        inter->pre_serialize();
+        return;
+    }
+
     try {
         for (const auto& p : in_summary->resolved_path) {
 #if TE_TYPE_SAFETY == 1
@@ -782,6 +790,11 @@ void tracker_element_serializer::post_serialize_path(const SharedElementSummary&
     if (inter->get_type() == tracker_type::tracker_alias)
         inter = static_cast<tracker_element_alias *>(inter.get())->get();
 
+    if (in_summary->resolved_path.size() == 0) {
+        inter->post_serialize();
+        return;
+    }
+
     try {
         for (const auto& p : in_summary->resolved_path) {
 #if TE_TYPE_SAFETY == 1
@@ -1569,38 +1582,29 @@ std::shared_ptr<tracker_element> summarize_tracker_element(std::shared_ptr<track
 
     in->post_serialize();
 
+    // Map the record itself to the summarized object with no path, so the object is
+    // pre-serialized once around the whole record when it is serialized
+    auto record = Globalreg::new_from_pool<tracker_element_summary>();
+    record->parent_element = in;
+    (*rename_map)[ret_elem] = record;
+
     return ret_elem;
 }
 
 std::shared_ptr<tracker_element> summarize_tracker_element_with_json(std::shared_ptr<tracker_element> data,
         const nlohmann::json& json, std::shared_ptr<tracker_element_serializer::rename_map> rename_map) {
 
-    auto summary_vec = std::vector<SharedElementSummary>{};
-
-    if (json.contains("fields")) {
-        auto fields = json["fields"];
-
-        if (!fields.is_null() && fields.is_array()) {
-            for (const auto& i : fields) {
-                if (i.is_string()) {
-                    auto sum = Globalreg::new_from_pool<tracker_element_summary>();
-                    sum->assign(i.get<std::string>());
-                    summary_vec.push_back(sum);
-                } else if (i.is_array()) {
-                    if (i.size() != 2)
-                        throw std::runtime_error("Invalid field mapping, expected [field, name]");
-                    auto sum = Globalreg::new_from_pool<tracker_element_summary>();
-                    sum->assign(i[0].get<std::string>(), i[1].get<std::string>());
-                    summary_vec.push_back(sum);
-                    // _MSG_DEBUG("Assigning summary vec {} {}", i[0].get<std::string>(), i[1].get<std::string>());
-                } else {
-                    throw std::runtime_error("Invalid field mapping, expected field or [field,rename]");
-                }
-            }
-        }
-    }
+    if (!json.contains("fields"))
+        return summarize_tracker_element(data, std::vector<SharedElementSummary>{}, rename_map);
+
+    const auto& fields = json["fields"];
+
+    if (fields.is_null() || !fields.is_array())
+        return summarize_tracker_element(data, std::vector<SharedElementSummary>{}, rename_map);
+
+    auto plan = Globalreg::globalreg->entrytracker->fetch_summary_plan(fields);
 
-    return summarize_tracker_element(data, summary_vec, rename_map);
+    return summarize_tracker_element(data, plan->summary_vec, rename_map);
 }
 
 bool sort_tracker_element_less(const std::shared_ptr<tracker_element> lhs,
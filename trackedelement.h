@@ -2370,6 +2370,19 @@ protected:
     void parse_path(const std::vector<std::string>& in_path, const std::string& in_rename);
 };
 
+// A compiled 'fields' request: a summary for each requested field, with every path already
+// resolved to field ids.  Plans are cached by the entry tracker and shared between requests,
+// so they must never be modified once built.
+class tracker_element_summary_plan {
+public:
+    std::vector<SharedElementSummary> summary_vec;
+
+    // Resolved path of each field, for searching the fields a request returns
+    std::vector<std::vector<int>> search_paths;
+};
+
+using shared_summary_plan = std::shared_ptr<const tracker_element_summary_plan>;
+
 // Generic serializer class to allow easy swapping of serializers
 class tracker_element_serializer {
 public: